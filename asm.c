@@ -0,0 +1,946 @@
+// This file is a built-in assembler for the output of codegen.c.
+//
+// With -c, we encode the assembly ourselves and write an ELF
+// relocatable object instead of leaving a large .s file for `as` to
+// parse again. This is not a general assembler: it knows the
+// directives and the instruction forms that codegen.c and peephole.c
+// print, in AT&T syntax, and reports anything else as an error.
+//
+// Every jump and call is encoded with a 32-bit displacement, so the
+// size of an instruction never depends on where its target is and a
+// single pass over the text is enough. Jumps to local labels in the
+// same section are patched once all labels are known. The other
+// references to symbols become relocations for the linker.
+//
+// We don't emit debug information, so .file and .loc are ignored.
+
+#include "sodium.h"
+
+static Section **secs;
+static int nsecs;
+static Section *cur_sec;
+
+static Symbol *syms;
+static HashMap symmap;
+
+// The line being assembled, for error messages
+static char *cur_line;
+
+// References to symbols that are resolved after the last line
+typedef struct Fixup Fixup;
+struct Fixup {
+  Fixup *next;
+  Section *sec;
+  int offset;
+  Symbol *sym;
+  RelocKind kind;
+  int64_t addend;
+};
+
+static Fixup *fixups;
+
+// A 32-bit displacement in the current instruction that refers to
+// `sym + disp`. Its addend depends on the size of the instruction, so
+// it is added to `fixups` once the instruction is complete.
+static Fixup *pending;
+
+static void asm_error(char *msg) {
+  error("cannot assemble: %s: %s", cur_line, msg);
+}
+
+//
+// Sections and symbols
+//
+
+static Section *get_section(char *name) {
+  for (int i = 0; i < nsecs; i++)
+    if (!strcmp(secs[i]->name, name))
+      return secs[i];
+
+  Section *sec = calloc(1, sizeof(Section));
+  sec->name = name;
+  sec->align = 1;
+  sec->is_alloc = true;
+  if (strcmp(name, ".bss")) {
+    sec->capacity = 256;
+    sec->buf = calloc(1, sec->capacity);
+  }
+
+  secs = realloc(secs, sizeof(Section *) * (nsecs + 1));
+  secs[nsecs++] = sec;
+  return sec;
+}
+
+static Symbol *get_symbol(char *name) {
+  Symbol *sym = hashmap_get(&symmap, name, strlen(name));
+  if (sym)
+    return sym;
+
+  sym = calloc(1, sizeof(Symbol));
+  sym->name = name;
+  sym->next = syms;
+  syms = sym;
+  hashmap_put(&symmap, name, strlen(name), sym);
+  return sym;
+}
+
+static void emit8(int c) {
+  Section *sec = cur_sec;
+  if (!sec->buf)
+    asm_error("data in a section without contents");
+
+  if (sec->size == sec->capacity) {
+    sec->capacity *= 2;
+    sec->buf = realloc(sec->buf, sec->capacity);
+  }
+  sec->buf[sec->size++] = c;
+}
+
+static void emit16(int64_t val) {
+  emit8(val);
+  emit8(val >> 8);
+}
+
+static void emit32(int64_t val) {
+  emit16(val);
+  emit16(val >> 16);
+}
+
+static void emit64(int64_t val) {
+  emit32(val);
+  emit32(val >> 32);
+}
+
+static void emit_imm(int64_t val, int size) {
+  switch (size) {
+  case 1:
+    emit8(val);
+    return;
+  case 2:
+    emit16(val);
+    return;
+  case 4:
+    emit32(val);
+    return;
+  }
+  emit64(val);
+}
+
+// Emit a 32-bit displacement to `sym + addend`.
+static void emit_fixup(Symbol *sym, int64_t addend, RelocKind kind) {
+  pending = calloc(1, sizeof(Fixup));
+  pending->sec = cur_sec;
+  pending->offset = cur_sec->size;
+  pending->sym = sym;
+  pending->kind = kind;
+  pending->addend = addend;
+  emit32(0);
+}
+
+// The displacement is relative to the end of the instruction, which
+// may have an immediate after the displacement.
+static void finish_insn(void) {
+  if (!pending)
+    return;
+  pending->addend -= cur_sec->size - pending->offset;
+  pending->next = fixups;
+  fixups = pending;
+  pending = NULL;
+}
+
+//
+// Operands
+//
+
+typedef enum {
+  OPD_REG,   // General-purpose register
+  OPD_XMM,   // SSE register
+  OPD_IMM,   // $imm
+  OPD_MEM,   // disp(base,index,scale) or sym+disp(%rip)
+  OPD_LABEL, // Target of a jump or a call
+} OperandKind;
+
+// Stands for %rip as the base of a memory operand
+#define RIP 16
+
+typedef struct {
+  OperandKind kind;
+  int reg;     // OPD_REG or OPD_XMM
+  int size;    // OPD_REG: 1, 2, 4 or 8 bytes
+  int64_t imm;
+
+  // OPD_MEM
+  int base;    // Register, RIP or -1
+  int index;   // Register or -1
+  int scale;
+  int64_t disp;
+  Symbol *sym; // OPD_MEM based on %rip, or OPD_LABEL
+} Operand;
+
+static bool is_int8(int64_t val) {
+  return val == (int8_t)val;
+}
+
+static bool is_int32(int64_t val) {
+  return val == (int32_t)val;
+}
+
+static bool parse_reg(char *s, Operand *op) {
+  static char **regs[] = {reg8, reg16, reg32, reg64};
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 16; j++) {
+      if (!strcmp(s, regs[i][j])) {
+        op->kind = OPD_REG;
+        op->reg = j;
+        op->size = 1 << i;
+        return true;
+      }
+    }
+  }
+
+  if (!strncmp(s, "%xmm", 4)) {
+    op->kind = OPD_XMM;
+    op->reg = atoi(s + 4);
+    return true;
+  }
+  return false;
+}
+
+static int64_t parse_num(char *s) {
+  char *end;
+  int64_t val = strtoll(s, &end, 0);
+  if (end == s || *end)
+    asm_error("invalid number");
+  return val;
+}
+
+// Parse `sym`, `sym+N` or `sym-N`.
+static Symbol *parse_symbol(char *s, int64_t *addend) {
+  char *end = s;
+  while (isalnum(*end) || *end == '_' || *end == '.')
+    end++;
+  if (end == s)
+    asm_error("invalid operand");
+
+  *addend = *end ? parse_num(end) : 0;
+  return get_symbol(strndup(s, end - s));
+}
+
+static int parse_base_reg(char *s) {
+  Operand op;
+  if (!strcmp(s, "%rip"))
+    return RIP;
+  if (!parse_reg(s, &op) || op.kind != OPD_REG || op.size != 8)
+    asm_error("invalid base or index register");
+  return op.reg;
+}
+
+// Parse `disp(base,index,scale)`, in which every part is optional,
+// or `sym+disp(%rip)`.
+static void parse_mem(char *s, Operand *op) {
+  op->kind = OPD_MEM;
+  op->base = op->index = -1;
+  op->scale = 1;
+
+  char *paren = strchr(s, '(');
+  if (paren != s) {
+    char *prefix = strndup(s, paren - s);
+    if (isdigit(*prefix) || *prefix == '-')
+      op->disp = parse_num(prefix);
+    else
+      op->sym = parse_symbol(prefix, &op->disp);
+  }
+
+  char *p = paren + 1;
+  char *end = strchr(p, ')');
+  if (!end || end[1])
+    asm_error("invalid memory operand");
+
+  char *comma = strchr(p, ',');
+  if (!comma || comma > end)
+    comma = end;
+  if (comma != p)
+    op->base = parse_base_reg(strndup(p, comma - p));
+
+  if (comma != end) {
+    p = comma + 1;
+    comma = strchr(p, ',');
+    if (!comma)
+      asm_error("invalid memory operand");
+    op->index = parse_base_reg(strndup(p, comma - p));
+    op->scale = parse_num(strndup(comma + 1, end - comma - 1));
+  }
+
+  if ((op->sym != NULL) != (op->base == RIP))
+    asm_error("symbols must be addressed relative to %rip");
+}
+
+static Operand parse_operand(char *s) {
+  Operand op = {};
+  if (*s == '$') {
+    op.kind = OPD_IMM;
+    op.imm = parse_num(s + 1);
+    return op;
+  }
+  if (*s == '%') {
+    if (!parse_reg(s, &op))
+      asm_error("unknown register");
+    return op;
+  }
+  if (strchr(s, '(')) {
+    parse_mem(s, &op);
+    return op;
+  }
+
+  int64_t addend;
+  op.kind = OPD_LABEL;
+  op.sym = parse_symbol(s, &addend);
+  if (addend)
+    asm_error("invalid jump target");
+  return op;
+}
+
+//
+// Instruction encoding
+//
+
+// A byte register other than %al, %cl, %dl and %bl needs a REX
+// prefix, without which %spl to %dil would mean %ah to %bh.
+static bool needs_rex(Operand *op) {
+  return op && op->kind == OPD_REG && op->size == 1 && op->reg >= 4;
+}
+
+static void emit_rex(bool w, Operand *reg, Operand *rm) {
+  int rex = w ? 8 : 0;
+  if (reg && reg->reg >= 8)
+    rex |= 4;
+  if (rm && rm->kind == OPD_MEM) {
+    if (rm->index >= 8)
+      rex |= 2;
+    if (rm->base >= 8 && rm->base != RIP)
+      rex |= 1;
+  } else if (rm && rm->reg >= 8) {
+    rex |= 1;
+  }
+
+  if (rex || needs_rex(reg) || needs_rex(rm))
+    emit8(0x40 | rex);
+}
+
+static void emit_modrm(int reg, Operand *rm) {
+  reg &= 7;
+  if (rm->kind != OPD_MEM) {
+    emit8(0xc0 | reg << 3 | (rm->reg & 7));
+    return;
+  }
+
+  if (rm->base == RIP) {
+    emit8(reg << 3 | 5);
+    emit_fixup(rm->sym, rm->disp, RELOC_PC32);
+    return;
+  }
+
+  int ss = (rm->scale == 8) ? 3 : (rm->scale == 4) ? 2 : (rm->scale == 2) ? 1 : 0;
+  if (rm->base == -1) {
+    emit8(reg << 3 | 4);
+    emit8(ss << 6 | (rm->index & 7) << 3 | 5);
+    emit32(rm->disp);
+    return;
+  }
+
+  // %rbp and %r13 as a base without a displacement would mean
+  // %rip-relative or no base, so they get a zero displacement.
+  int mod = 2;
+  if (rm->disp == 0 && (rm->base & 7) != RBP)
+    mod = 0;
+  else if (is_int8(rm->disp))
+    mod = 1;
+
+  // %rsp and %r12 as a base can only be encoded with a SIB byte.
+  if (rm->index == -1 && (rm->base & 7) != RSP) {
+    emit8(mod << 6 | reg << 3 | (rm->base & 7));
+  } else {
+    int index = (rm->index == -1) ? 4 : rm->index & 7;
+    emit8(mod << 6 | reg << 3 | 4);
+    emit8(ss << 6 | index << 3 | (rm->base & 7));
+  }
+
+  if (mod == 1)
+    emit8(rm->disp);
+  else if (mod == 2)
+    emit32(rm->disp);
+}
+
+// Encode an instruction with a ModRM byte: the prefix if it is not 0,
+// a REX prefix if needed, an opcode of up to three bytes, and the
+// operands. The reg field of ModRM is `reg` if given, or the opcode
+// extension `ext` otherwise.
+static void encode(int prefix, bool w, int opcode, Operand *reg, int ext, Operand *rm) {
+  if (prefix)
+    emit8(prefix);
+  emit_rex(w, reg, rm);
+  if (opcode > 0xffff)
+    emit8(opcode >> 16);
+  if (opcode > 0xff)
+    emit8(opcode >> 8);
+  emit8(opcode);
+  emit_modrm(reg ? reg->reg : ext, rm);
+}
+
+// Encode a general-purpose instruction of a given operand size, whose
+// 8-bit form has an opcode one less than the others.
+static void encode_sized(int size, int opcode, Operand *reg, int ext, Operand *rm) {
+  encode(size == 2 ? 0x66 : 0, size == 8, (size == 1) ? opcode - 1 : opcode, reg, ext, rm);
+}
+
+// Returns the operand size of an instruction: the size of its
+// register operands, or the one given by the suffix of the mnemonic.
+static int operand_size(char *op, char *name, Operand *ops, int nops) {
+  for (int i = nops - 1; i >= 0; i--)
+    if (ops[i].kind == OPD_REG)
+      return ops[i].size;
+
+  int len = strlen(name);
+  if (strlen(op) == len + 1 && !strncmp(op, name, len)) {
+    switch (op[len]) {
+    case 'b':
+      return 1;
+    case 'w':
+      return 2;
+    case 'l':
+      return 4;
+    case 'q':
+      return 8;
+    }
+  }
+  asm_error("unknown operand size");
+  return 0;
+}
+
+// Returns true if `op` is `name` with or without a size suffix.
+static bool match(char *op, char *name) {
+  int len = strlen(name);
+  if (strncmp(op, name, len))
+    return false;
+  return !op[len] || (!op[len + 1] && strchr("bwlq", op[len]));
+}
+
+static bool is_kind(Operand *ops, int nops, OperandKind k0, OperandKind k1) {
+  return nops == 2 && ops[0].kind == k0 && ops[1].kind == k1;
+}
+
+// Condition codes of conditional jumps and setcc
+static char *cond_names[] = {
+  "o", "no", "b", "ae", "e", "ne", "be", "a",
+  "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+static int cond_code(char *s) {
+  for (int i = 0; i < 16; i++)
+    if (!strcmp(s, cond_names[i]))
+      return i;
+  return -1;
+}
+
+// Arithmetic instructions with the classic encodings, whose opcodes
+// are `8 * ext + 1` for `op %reg, r/m`, `8 * ext + 3` for `op r/m, %reg`
+// and 0x81 or 0x83 with opcode extension `ext` for an immediate.
+static char *alu_names[] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"};
+
+static void asm_alu(int ext, Operand *src, Operand *dst, int size) {
+  if (src->kind == OPD_IMM) {
+    if (size == 1) {
+      encode_sized(size, 0x81, NULL, ext, dst);
+      emit8(src->imm);
+    } else if (is_int8(src->imm)) {
+      encode_sized(size, 0x83, NULL, ext, dst);
+      emit8(src->imm);
+    } else {
+      encode_sized(size, 0x81, NULL, ext, dst);
+      emit_imm(src->imm, size == 2 ? 2 : 4);
+    }
+    return;
+  }
+
+  if (src->kind == OPD_REG)
+    encode_sized(size, ext * 8 + 1, src, 0, dst);
+  else
+    encode_sized(size, ext * 8 + 3, dst, 0, src);
+}
+
+static void asm_mov(char *op, Operand *src, Operand *dst, int size) {
+  if (src->kind == OPD_IMM && dst->kind == OPD_REG) {
+    if (size == 8 && is_int32(src->imm)) {
+      encode_sized(8, 0xc7, NULL, 0, dst);
+      emit32(src->imm);
+      return;
+    }
+
+    // mov $imm, %reg with the register in the opcode
+    if (size == 2)
+      emit8(0x66);
+    emit_rex(size == 8, NULL, dst);
+    emit8(((size == 1) ? 0xb0 : 0xb8) + (dst->reg & 7));
+    emit_imm(src->imm, size);
+    return;
+  }
+
+  if (src->kind == OPD_IMM) {
+    encode_sized(size, 0xc7, NULL, 0, dst);
+    emit_imm(src->imm, size == 8 ? 4 : size);
+    return;
+  }
+
+  if (src->kind == OPD_REG)
+    encode_sized(size, 0x89, src, 0, dst);
+  else
+    encode_sized(size, 0x8b, dst, 0, src);
+}
+
+// movd and movq between SSE registers and general-purpose registers
+// or memory
+static void asm_movd(char *op, Operand *src, Operand *dst) {
+  bool q = !strcmp(op, "movq");
+
+  if (dst->kind == OPD_XMM && src->kind == OPD_MEM && q)
+    encode(0xf3, false, 0x0f7e, dst, 0, src);
+  else if (dst->kind == OPD_XMM)
+    encode(0x66, q, 0x0f6e, dst, 0, src);
+  else if (dst->kind == OPD_MEM && q)
+    encode(0x66, false, 0x0fd6, src, 0, dst);
+  else
+    encode(0x66, q, 0x0f7e, src, 0, dst);
+}
+
+// SSE2 instructions of the form `op %xmm/mem, %xmm`
+static struct {
+  char *name;
+  int opcode;
+} sse_ops[] = {
+  {"paddb", 0x0ffc}, {"paddw", 0x0ffd}, {"paddd", 0x0ffe},
+  {"psubb", 0x0ff8}, {"psubw", 0x0ff9}, {"psubd", 0x0ffa},
+  {"pmullw", 0x0fd5}, {"pxor", 0x0fef},
+  {"pcmpeqb", 0x0f74}, {"pcmpeqw", 0x0f75}, {"pcmpeqd", 0x0f76},
+  {"pcmpgtb", 0x0f64}, {"pcmpgtw", 0x0f65}, {"pcmpgtd", 0x0f66},
+  {"punpcklbw", 0x0f60}, {"punpcklwd", 0x0f61},
+};
+
+static bool asm_sse(char *op, Operand *ops, int nops) {
+  if (!strcmp(op, "movdqu") || !strcmp(op, "movdqa")) {
+    int prefix = (op[5] == 'u') ? 0xf3 : 0x66;
+    if (ops[1].kind == OPD_XMM)
+      encode(prefix, false, 0x0f6f, &ops[1], 0, &ops[0]);
+    else
+      encode(prefix, false, 0x0f7f, &ops[0], 0, &ops[1]);
+    return true;
+  }
+
+  if (!strcmp(op, "pshufd")) {
+    encode(0x66, false, 0x0f70, &ops[2], 0, &ops[1]);
+    emit8(ops[0].imm);
+    return true;
+  }
+
+  if (!strcmp(op, "psraw") || !strcmp(op, "psrad")) {
+    encode(0x66, false, (op[4] == 'w') ? 0x0f71 : 0x0f72, NULL, 4, &ops[1]);
+    emit8(ops[0].imm);
+    return true;
+  }
+
+  for (int i = 0; i < sizeof(sse_ops) / sizeof(*sse_ops); i++) {
+    if (!strcmp(op, sse_ops[i].name)) {
+      encode(0x66, false, sse_ops[i].opcode, &ops[1], 0, &ops[0]);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void asm_jump(int opcode, Operand *target) {
+  if (target->kind != OPD_LABEL)
+    asm_error("invalid jump target");
+  if (opcode > 0xff)
+    emit8(opcode >> 8);
+  emit8(opcode);
+  emit_fixup(target->sym, 0, RELOC_PLT32);
+}
+
+static void asm_insn(AsmInsn *insn) {
+  char *op = insn->op;
+  Operand ops[3];
+  int nops = insn->nargs;
+  for (int i = 0; i < nops; i++)
+    ops[i] = parse_operand(insn->args[i]);
+
+  if (!strcmp(op, "ret") && !nops) {
+    emit8(0xc3);
+    return;
+  }
+  if (!strcmp(op, "cdq") && !nops) {
+    emit8(0x99);
+    return;
+  }
+  if (!strcmp(op, "cqo") && !nops) {
+    emit8(0x48);
+    emit8(0x99);
+    return;
+  }
+  if (!strcmp(op, "rep") && nops == 1 && !strcmp(insn->args[0], "movsb")) {
+    emit8(0xf3);
+    emit8(0xa4);
+    return;
+  }
+
+  if (nops == 1 && !strcmp(op, "call")) {
+    asm_jump(0xe8, &ops[0]);
+    return;
+  }
+  if (nops == 1 && !strcmp(op, "jmp")) {
+    asm_jump(0xe9, &ops[0]);
+    return;
+  }
+  if (nops == 1 && op[0] == 'j' && cond_code(op + 1) != -1) {
+    asm_jump(0x0f80 + cond_code(op + 1), &ops[0]);
+    return;
+  }
+  if (nops == 1 && !strncmp(op, "set", 3) && cond_code(op + 3) != -1) {
+    encode(0, false, 0x0f90 + cond_code(op + 3), NULL, 0, &ops[0]);
+    return;
+  }
+
+  if (nops == 1 && (!strcmp(op, "push") || !strcmp(op, "pop"))) {
+    bool push = (op[1] == 'u');
+    if (ops[0].kind == OPD_REG && ops[0].size == 8) {
+      emit_rex(false, NULL, &ops[0]);
+      emit8((push ? 0x50 : 0x58) + (ops[0].reg & 7));
+    } else if (push && ops[0].kind == OPD_IMM && is_int8(ops[0].imm)) {
+      emit8(0x6a);
+      emit8(ops[0].imm);
+    } else if (push && ops[0].kind == OPD_IMM) {
+      emit8(0x68);
+      emit32(ops[0].imm);
+    } else if (push && ops[0].kind == OPD_MEM) {
+      encode(0, false, 0xff, NULL, 6, &ops[0]);
+    } else {
+      asm_error("invalid operand");
+    }
+    return;
+  }
+
+  if (asm_sse(op, ops, nops))
+    return;
+
+  if (!strcmp(op, "movd") || (!strcmp(op, "movq") && nops == 2 &&
+                              (ops[0].kind == OPD_XMM || ops[1].kind == OPD_XMM))) {
+    asm_movd(op, &ops[0], &ops[1]);
+    return;
+  }
+
+  if (nops == 2 && match(op, "mov")) {
+    asm_mov(op, &ops[0], &ops[1], operand_size(op, "mov", ops, nops));
+    return;
+  }
+
+  for (int i = 0; i < sizeof(alu_names) / sizeof(*alu_names); i++) {
+    if (nops == 2 && match(op, alu_names[i])) {
+      asm_alu(i, &ops[0], &ops[1], operand_size(op, alu_names[i], ops, nops));
+      return;
+    }
+  }
+
+  if (is_kind(ops, nops, OPD_REG, OPD_REG) && match(op, "test")) {
+    encode_sized(ops[1].size, 0x85, &ops[0], 0, &ops[1]);
+    return;
+  }
+
+  if (is_kind(ops, nops, OPD_MEM, OPD_REG) && !strcmp(op, "lea")) {
+    encode_sized(ops[1].size, 0x8d, &ops[1], 0, &ops[0]);
+    return;
+  }
+
+  // Sign and zero extensions to 64 bits
+  if (nops == 2 && ops[1].kind == OPD_REG) {
+    if (!strcmp(op, "movsbq")) {
+      encode(0, true, 0x0fbe, &ops[1], 0, &ops[0]);
+      return;
+    }
+    if (!strcmp(op, "movswq")) {
+      encode(0, true, 0x0fbf, &ops[1], 0, &ops[0]);
+      return;
+    }
+    if (!strcmp(op, "movslq")) {
+      encode(0, true, 0x63, &ops[1], 0, &ops[0]);
+      return;
+    }
+    if (!strcmp(op, "movzb")) {
+      encode(0, ops[1].size == 8, 0x0fb6, &ops[1], 0, &ops[0]);
+      return;
+    }
+  }
+
+  if (match(op, "imul")) {
+    int size = operand_size(op, "imul", ops, nops);
+    if (nops == 1) {
+      encode_sized(size, 0xf7, NULL, 5, &ops[0]);
+    } else if (nops == 2) {
+      encode_sized(size, 0x0faf, &ops[1], 0, &ops[0]);
+    } else if (is_int8(ops[0].imm)) {
+      encode_sized(size, 0x6b, &ops[2], 0, &ops[1]);
+      emit8(ops[0].imm);
+    } else {
+      encode_sized(size, 0x69, &ops[2], 0, &ops[1]);
+      emit_imm(ops[0].imm, size == 2 ? 2 : 4);
+    }
+    return;
+  }
+
+  if (nops == 1 && (match(op, "idiv") || match(op, "neg"))) {
+    int ext = (op[0] == 'i') ? 7 : 3;
+    encode_sized(operand_size(op, op[0] == 'i' ? "idiv" : "neg", ops, nops), 0xf7, NULL, ext, &ops[0]);
+    return;
+  }
+
+  static char *shifts[] = {"shl", "shr", "sar"};
+  static int shift_ext[] = {4, 5, 7};
+  for (int i = 0; i < 3; i++) {
+    if (nops != 2 || !match(op, shifts[i]))
+      continue;
+
+    int size = operand_size(op, shifts[i], &ops[1], 1);
+    if (ops[0].kind == OPD_IMM && ops[0].imm == 1) {
+      encode_sized(size, 0xd1, NULL, shift_ext[i], &ops[1]);
+    } else if (ops[0].kind == OPD_IMM) {
+      encode_sized(size, 0xc1, NULL, shift_ext[i], &ops[1]);
+      emit8(ops[0].imm);
+    } else if (ops[0].kind == OPD_REG && ops[0].reg == RCX && ops[0].size == 1) {
+      encode_sized(size, 0xd3, NULL, shift_ext[i], &ops[1]);
+    } else {
+      asm_error("invalid shift count");
+    }
+    return;
+  }
+
+  asm_error("unknown instruction");
+}
+
+//
+// Directives
+//
+
+static char *skip_spaces(char *p) {
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+}
+
+// Decode the string of an .ascii directive.
+static void asm_ascii(char *p) {
+  p = skip_spaces(p);
+  if (*p++ != '"')
+    asm_error("expected a string");
+
+  while (*p != '"') {
+    if (!*p)
+      asm_error("unterminated string");
+    if (*p != '\\') {
+      emit8(*p++);
+      continue;
+    }
+
+    p++;
+    if ('0' <= *p && *p <= '7') {
+      int c = 0;
+      for (int i = 0; i < 3 && '0' <= *p && *p <= '7'; i++)
+        c = c * 8 + (*p++ - '0');
+      emit8(c);
+      continue;
+    }
+    emit8(*p++);
+  }
+}
+
+// `.section name` or `.section name,"flags",@type,entsize`
+static void asm_section(char *p) {
+  p = skip_spaces(p);
+  char *end = p;
+  while (*end && *end != ',')
+    end++;
+
+  cur_sec = get_section(strndup(p, end - p));
+  if (*end == ',' && end[1] == '"') {
+    char *flags = end + 2;
+    cur_sec->is_writable = false;
+    for (; *flags && *flags != '"'; flags++) {
+      if (*flags == 'w')
+        cur_sec->is_writable = true;
+      else if (*flags == 'x')
+        cur_sec->is_exec = true;
+      else if (*flags == 'S')
+        cur_sec->is_strings = true;
+    }
+  }
+}
+
+static void asm_align(int align) {
+  if (align & (align - 1))
+    asm_error("alignment is not a power of 2");
+  if (cur_sec->align < align)
+    cur_sec->align = align;
+
+  int size = align_to(cur_sec->size, align);
+  if (!cur_sec->buf) {
+    cur_sec->size = size;
+    return;
+  }
+  while (cur_sec->size < size)
+    emit8(cur_sec->is_exec ? 0x90 : 0);
+}
+
+// `.quad sym+offset`, which is always left to the linker
+static void asm_quad(char *p) {
+  Fixup *fix = calloc(1, sizeof(Fixup));
+  fix->sec = cur_sec;
+  fix->offset = cur_sec->size;
+  fix->sym = parse_symbol(skip_spaces(p), &fix->addend);
+  fix->kind = RELOC_64;
+  fix->next = fixups;
+  fixups = fix;
+  emit64(0);
+}
+
+// `.type name, @function`. Other symbols have no type.
+static void asm_type(char *p) {
+  char *comma = strchr(p, ',');
+  if (!comma || strcmp(skip_spaces(comma + 1), "@function"))
+    asm_error("expected ', @function'");
+  get_symbol(strndup(p, comma - p))->is_function = true;
+}
+
+// `.set name, sym+offset`
+static void asm_set(char *p) {
+  char *comma = strchr(p, ',');
+  if (!comma)
+    asm_error("expected ','");
+
+  Symbol *sym = get_symbol(strndup(skip_spaces(p), comma - skip_spaces(p)));
+  sym->alias = parse_symbol(skip_spaces(comma + 1), &sym->offset);
+}
+
+static void asm_directive(char *p) {
+  char *end = p;
+  while (*end && *end != ' ')
+    end++;
+  char *name = strndup(p, end - p);
+  char *arg = skip_spaces(end);
+
+  if (!strcmp(name, ".file") || !strcmp(name, ".loc"))
+    return;
+
+  if (!strcmp(name, ".text")) {
+    cur_sec = get_section(".text");
+    cur_sec->is_exec = true;
+  } else if (!strcmp(name, ".data")) {
+    cur_sec = get_section(".data");
+    cur_sec->is_writable = true;
+  } else if (!strcmp(name, ".bss")) {
+    cur_sec = get_section(".bss");
+    cur_sec->is_writable = true;
+  } else if (!strcmp(name, ".section")) {
+    asm_section(arg);
+  } else if (!strcmp(name, ".globl")) {
+    get_symbol(strdup(arg))->is_global = true;
+  } else if (!strcmp(name, ".type")) {
+    asm_type(arg);
+  } else if (!strcmp(name, ".set")) {
+    asm_set(arg);
+  } else if (!strcmp(name, ".align")) {
+    asm_align(parse_num(arg));
+  } else if (!strcmp(name, ".zero")) {
+    int n = parse_num(arg);
+    if (!cur_sec->buf)
+      cur_sec->size += n;
+    else
+      for (int i = 0; i < n; i++)
+        emit8(0);
+  } else if (!strcmp(name, ".ascii")) {
+    asm_ascii(arg);
+  } else if (!strcmp(name, ".quad")) {
+    asm_quad(arg);
+  } else {
+    asm_error("unknown directive");
+  }
+}
+
+static void asm_label(char *p, int len) {
+  Symbol *sym = get_symbol(strndup(p, len));
+  if (sym->sec || sym->alias)
+    asm_error("symbol is already defined");
+  sym->sec = cur_sec;
+  sym->value = cur_sec->size;
+}
+
+static void asm_line(char *line) {
+  cur_line = line;
+  char *p = skip_spaces(line);
+  int len = strlen(p);
+  if (!len)
+    return;
+
+  if (p[len - 1] == ':') {
+    asm_label(p, len - 1);
+    return;
+  }
+  if (*p == '.') {
+    asm_directive(p);
+    return;
+  }
+
+  if (!cur_sec)
+    asm_error("instruction outside of a section");
+  AsmInsn insn = parse_asm(line);
+  asm_insn(&insn);
+  finish_insn();
+}
+
+// Patch the references to local labels in the same section and turn
+// the rest into relocations.
+static void resolve_fixups(void) {
+  for (Symbol *sym = syms; sym; sym = sym->next) {
+    if (!sym->alias)
+      continue;
+    if (!sym->alias->sec)
+      error("cannot assemble: undefined symbol in .set: %s", sym->alias->name);
+    sym->sec = sym->alias->sec;
+    sym->value = sym->alias->value + sym->offset;
+  }
+
+  for (Fixup *fix = fixups; fix; fix = fix->next) {
+    Symbol *sym = fix->sym;
+    if (fix->kind != RELOC_64 && sym->sec == fix->sec && !sym->is_global) {
+      int32_t val = sym->value + fix->addend - fix->offset;
+      memcpy(fix->sec->buf + fix->offset, &val, 4);
+      continue;
+    }
+
+    Reloc *rel = calloc(1, sizeof(Reloc));
+    rel->offset = fix->offset;
+    rel->sym = sym;
+    rel->kind = fix->kind;
+    rel->addend = fix->addend;
+    rel->next = fix->sec->relocs;
+    fix->sec->relocs = rel;
+  }
+}
+
+void assemble(char *text, FILE *out) {
+  for (char *p = text; *p;) {
+    char *end = strchr(p, '\n');
+    if (!end)
+      end = p + strlen(p);
+    asm_line(strndup(p, end - p));
+    p = *end ? end + 1 : end;
+  }
+
+  resolve_fixups();
+  write_elf(out, secs, nsecs, syms);
+}
@@ -0,0 +1,45 @@
+// Throughput of multiplication and division by constants.
+//
+// Sum the quotients or products of a counter by a few constants and
+// report the time per operation.
+
+int printf();
+long clock();
+
+long report(char *name, long n, long start) {
+  long ticks = clock() - start;
+  printf("%12s: %5ld ps/op\n", name, ticks * 1000000 / n);
+  return 0;
+}
+
+int main() {
+  long n = 100000000;
+  long i;
+  long sum = 0;
+  int x;
+
+  long start = clock();
+  for (i = 0; i < n; i = i + 1)
+    sum = sum + i / 7;
+  report("long / 7", n, start);
+
+  start = clock();
+  for (i = 0; i < n; i = i + 1)
+    sum = sum + i / 8;
+  report("long / 8", n, start);
+
+  start = clock();
+  for (i = 0; i < n; i = i + 1) {
+    x = i;
+    sum = sum + x / (int)10;
+  }
+  report("int / 10", n, start);
+
+  start = clock();
+  for (i = 0; i < n; i = i + 1)
+    sum = sum + i * 40;
+  report("long * 40", n, start);
+
+  printf("%ld\n", sum);
+  return 0;
+}
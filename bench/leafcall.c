@@ -0,0 +1,41 @@
+// Call overhead of small leaf functions.
+//
+// Call a few tiny accessors in a loop and report the time per call.
+
+int printf();
+long clock();
+
+int arr[16];
+
+int get(int *p, int i) {
+  return p[i];
+}
+
+int add3(int a, int b, int c) {
+  int t = a + b;
+  return t + c;
+}
+
+long report(char *name, long n, long start) {
+  long ticks = clock() - start;
+  printf("%8s: %4ld ps/call\n", name, ticks * 1000000 / n);
+  return 0;
+}
+
+int main() {
+  long n = 200000000;
+  long i;
+  int sum = 0;
+
+  long start = clock();
+  for (i = 0; i < n; i = i + 1)
+    sum = sum + get(arr, 3);
+  report("get", n, start);
+
+  start = clock();
+  for (i = 0; i < n; i = i + 1)
+    sum = add3(sum, 1, 2);
+  report("add3", n, start);
+
+  return sum - sum;
+}
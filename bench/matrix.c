@@ -0,0 +1,78 @@
+// Nested loops over a matrix.
+//
+// Walk a matrix whose dimensions, data pointer and row stride don't
+// change inside the loops and report the time per element.
+
+int printf();
+long clock();
+
+struct Matrix {
+  int rows;
+  int cols;
+  int *data;
+};
+
+int buf[1000000];
+int grid[1000][1000];
+
+long report(char *name, long n, long start) {
+  long ticks = clock() - start;
+  printf("%8s: %4ld ps/elem\n", name, ticks * 1000000 / n);
+  return 0;
+}
+
+long sum(struct Matrix *m, int rows, int cols) {
+  long s = 0;
+  int i;
+  int j;
+  for (i = 0; i < rows; i = i + 1)
+    for (j = 0; j < cols; j = j + 1)
+      s = s + m->data[i * cols + j];
+  return s;
+}
+
+long sum_grid() {
+  long s = 0;
+  int i;
+  int j;
+  for (i = 0; i < 1000; i = i + 1)
+    for (j = 0; j < 1000; j = j + 1)
+      s = s + grid[i][j];
+  return s;
+}
+
+int fill(struct Matrix *m, int rows, int cols, int k) {
+  int i;
+  for (i = 0; i < rows * cols; i = i + 1)
+    m->data[i] = i * k;
+  return 0;
+}
+
+int main() {
+  struct Matrix m;
+  m.rows = 1000;
+  m.cols = 1000;
+  m.data = buf;
+
+  int reps = 200;
+  long n = reps * 1000000;
+  long s = 0;
+  int r;
+
+  long start = clock();
+  for (r = 0; r < reps; r = r + 1)
+    fill(&m, m.rows, m.cols, r);
+  report("fill", n, start);
+
+  start = clock();
+  for (r = 0; r < reps; r = r + 1)
+    s = s + sum(&m, m.rows, m.cols);
+  report("sum", n, start);
+
+  start = clock();
+  for (r = 0; r < reps; r = r + 1)
+    s = s + sum_grid();
+  report("grid", n, start);
+
+  return s - s;
+}
@@ -0,0 +1,150 @@
+// Struct copy throughput.
+//
+// For each struct size, copy a struct back and forth between two
+// globals until 256 MiB have been moved and report the throughput.
+
+int printf();
+long clock();
+
+struct S8 { char b[8]; } a8, b8;
+struct S16 { char b[16]; } a16, b16;
+struct S24 { char b[24]; } a24, b24;
+struct S32 { char b[32]; } a32, b32;
+struct S64 { char b[64]; } a64, b64;
+struct S128 { char b[128]; } a128, b128;
+struct S256 { char b[256]; } a256, b256;
+struct S512 { char b[512]; } a512, b512;
+struct S1024 { char b[1024]; } a1024, b1024;
+struct S4096 { char b[4096]; } a4096, b4096;
+
+long report(int size, long n, long start) {
+  long ticks = clock() - start;
+  if (ticks == 0)
+    ticks = 1;
+  printf("%6d bytes: %8ld MiB/s\n", size, n * size * 2 / ticks * 1000000 / 1048576);
+  return 0;
+}
+
+long copy8() {
+  long n = 268435456 / 8 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b8 = a8;
+    a8 = b8;
+  }
+  return report(8, n, start);
+}
+
+long copy16() {
+  long n = 268435456 / 16 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b16 = a16;
+    a16 = b16;
+  }
+  return report(16, n, start);
+}
+
+long copy24() {
+  long n = 268435456 / 24 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b24 = a24;
+    a24 = b24;
+  }
+  return report(24, n, start);
+}
+
+long copy32() {
+  long n = 268435456 / 32 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b32 = a32;
+    a32 = b32;
+  }
+  return report(32, n, start);
+}
+
+long copy64() {
+  long n = 268435456 / 64 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b64 = a64;
+    a64 = b64;
+  }
+  return report(64, n, start);
+}
+
+long copy128() {
+  long n = 268435456 / 128 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b128 = a128;
+    a128 = b128;
+  }
+  return report(128, n, start);
+}
+
+long copy256() {
+  long n = 268435456 / 256 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b256 = a256;
+    a256 = b256;
+  }
+  return report(256, n, start);
+}
+
+long copy512() {
+  long n = 268435456 / 512 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b512 = a512;
+    a512 = b512;
+  }
+  return report(512, n, start);
+}
+
+long copy1024() {
+  long n = 268435456 / 1024 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b1024 = a1024;
+    a1024 = b1024;
+  }
+  return report(1024, n, start);
+}
+
+long copy4096() {
+  long n = 268435456 / 4096 / 2;
+  long start = clock();
+  long i;
+  for (i = 0; i < n; i = i + 1) {
+    b4096 = a4096;
+    a4096 = b4096;
+  }
+  return report(4096, n, start);
+}
+
+int main() {
+  copy8();
+  copy16();
+  copy24();
+  copy32();
+  copy64();
+  copy128();
+  copy256();
+  copy512();
+  copy1024();
+  copy4096();
+  return 0;
+}
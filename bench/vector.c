@@ -0,0 +1,101 @@
+// Straight-line loops over int, short and char arrays.
+//
+// Sum, add, copy and count matches in arrays that fit in the L1
+// cache and report the time per element.
+
+int printf();
+long clock();
+
+int a[4096];
+int b[4096];
+int c[4096];
+short s[4096];
+short t[4096];
+char x[4096];
+char y[4096];
+
+long report(char *name, long n, long start) {
+  long ticks = clock() - start;
+  printf("%12s: %5ld ps/elem\n", name, ticks * 1000000 / n);
+  return 0;
+}
+
+int sum(int *p, int n) {
+  int i;
+  int r = 0;
+  for (i = 0; i < n; i = i + 1)
+    r = r + p[i];
+  return r;
+}
+
+int count(int *p, int n, int v) {
+  int i;
+  int r = 0;
+  for (i = 0; i < n; i = i + 1)
+    r = r + (p[i] == v);
+  return r;
+}
+
+int add(int *d, int *p, int *q, int n) {
+  int i;
+  for (i = 0; i < n; i = i + 1)
+    d[i] = p[i] + q[i];
+  return 0;
+}
+
+int scale(short *d, short *p, int n) {
+  int i;
+  for (i = 0; i < n; i = i + 1)
+    d[i] = p[i] * 3 + 1;
+  return 0;
+}
+
+int copy(char *d, char *p, int n) {
+  int i;
+  for (i = 0; i < n; i = i + 1)
+    d[i] = p[i];
+  return 0;
+}
+
+int main() {
+  int n = 4096;
+  int reps = 20000;
+  long total = n * (long)reps;
+  long r = 0;
+  int k;
+
+  for (k = 0; k < n; k = k + 1) {
+    a[k] = k;
+    b[k] = k * 3;
+    s[k] = k;
+    x[k] = k;
+  }
+
+  long start = clock();
+  for (k = 0; k < reps; k = k + 1)
+    r = r + sum(a, n);
+  report("int sum", total, start);
+
+  start = clock();
+  for (k = 0; k < reps; k = k + 1)
+    r = r + count(b, n, k);
+  report("int count", total, start);
+
+  start = clock();
+  for (k = 0; k < reps; k = k + 1)
+    add(c, a, b, n);
+  report("int add", total, start);
+
+  start = clock();
+  for (k = 0; k < reps; k = k + 1)
+    scale(t, s, n);
+  report("short scale", total, start);
+
+  start = clock();
+  for (k = 0; k < reps; k = k + 1)
+    copy(y, x, n);
+  report("char copy", total, start);
+
+  printf("%ld %d %d %d\n", r, c[100], t[100], y[100]);
+  return 0;
+}
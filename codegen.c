@@ -1,37 +1,95 @@
+// This file translates the IR to x86-64 assembly.
+//
+// A virtual register either lives in a real register assigned by
+// regalloc.c (rn != -1) or in a stack slot. Operands that live in
+// memory are reloaded into scratch registers right before they are
+// used and results are written back right after they are computed.
+// %rax, %rdx, %rdi and %r8 as well as the argument registers are
+// used as scratch registers and are never allocated. Base and index
+// registers of memory operands are reloaded into %rsi and %rcx.
+// %xmm0 is used for copying structs and as a scratch register of
+// vector instructions, whose other registers are numbered by ir.c.
+
 #include "sodium.h"
 
+char *reg64[] = {
+  "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+  "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15",
+};
+char *reg32[] = {
+  "%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi",
+  "%r8d", "%r9d", "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d",
+};
+char *reg16[] = {
+  "%ax", "%cx", "%dx", "%bx", "%sp", "%bp", "%si", "%di",
+  "%r8w", "%r9w", "%r10w", "%r11w", "%r12w", "%r13w", "%r14w", "%r15w",
+};
+char *reg8[] = {
+  "%al", "%cl", "%dl", "%bl", "%spl", "%bpl", "%sil", "%dil",
+  "%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b",
+};
+
+static int argreg[MAX_REG_ARGS] = {RDI, RSI, RDX, RCX, R8, R9};
+
+static int callee_saved[] = {RBX, R12, R13, R14, R15};
+
 static FILE *output_file;
-static int depth;
-static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
-static char *argreg32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
-static char *argreg16[] = {"%di", "%si", "%dx", "%cx", "%r8w", "%r9w"};
-static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
 static Obj *current_fn;
 
-static void gen_expr(Node *node);
-static void gen_stmt(Node *node);
+// The line of the last .loc directive in the current function
+static int last_line;
+
+// The register stack slots are addressed from. It is %rbp unless the
+// frame is omitted, in which case the slots are in the red zone below
+// %rsp.
+static int frame_reg;
+
+// The size of the red zone, which signal handlers and the kernel
+// never touch.
+#define RED_ZONE_SIZE 128
+
+// Stack slots where the callee-saved registers used by the current
+// function are saved, or 0 if a register is not used.
+static int saved_reg_offset[16];
+
+// The lines of the current function, which are buffered for the
+// peephole optimizer
+static AsmInsn *lines;
+static int nlines;
+static int lines_cap;
+static bool buffering;
 
 static void println(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(output_file, fmt, ap);
-  va_end(ap);
-  fprintf(output_file, "\n");
-}
+  if (!buffering) {
+    vfprintf(output_file, fmt, ap);
+    va_end(ap);
+    fprintf(output_file, "\n");
+    return;
+  }
 
-static int count(void) {
-  static int i = 1;
-  return i++;
-}
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+  vfprintf(out, fmt, ap);
+  va_end(ap);
+  fclose(out);
 
-static void push(void) {
-  println("  push %%rax");
-  depth++;
+  if (nlines == lines_cap) {
+    lines_cap = lines_cap ? lines_cap * 2 : 256;
+    lines = realloc(lines, lines_cap * sizeof(AsmInsn));
+  }
+  lines[nlines++] = parse_asm(buf);
 }
 
-static void pop(char *arg) {
-  println("  pop %s", arg);
-  depth--;
+// Optimize and write out the buffered lines.
+static void flush_lines(Obj *fn) {
+  optimize_asm(fn, lines, nlines);
+  for (int i = 0; i < nlines; i++)
+    if (!lines[i].deleted)
+      print_asm(output_file, &lines[i]);
+  nlines = 0;
 }
 
 // Round up `n` to the nearest multiple of `align`. For instance,
@@ -40,328 +98,917 @@ int align_to(int n, int align) {
   return (n + align - 1) / align * align;
 }
 
-// Compute the absolute address of a given node.
-// It's an error if a given node does not reside in memory.
-static void gen_addr(Node *node) {
-  switch (node->kind) {
-  case ND_VAR:
-    if (node->var->is_local) {
-      // Local variable
-      println("  lea %d(%%rbp), %%rax", node->var->offset);
+static char *reg(int rn, int size) {
+  switch (size) {
+  case 1:
+    return reg8[rn];
+  case 2:
+    return reg16[rn];
+  case 4:
+    return reg32[rn];
+  }
+  return reg64[rn];
+}
+
+// Returns the real register holding `r`. If `r` lives in memory,
+// it is reloaded into `scratch` first.
+static int use(Reg *r, int scratch) {
+  if (r->rn != -1)
+    return r->rn;
+  println("  mov %d(%s), %s", r->offset, reg64[frame_reg], reg64[scratch]);
+  return scratch;
+}
+
+// Returns the real register a value for `r` should be computed into.
+static int def(Reg *r, int scratch) {
+  return (r->rn != -1) ? r->rn : scratch;
+}
+
+// Writes a value computed into `rn` back to memory if `r` lives there.
+static void writeback(Reg *r, int rn) {
+  if (r->rn == -1)
+    println("  mov %s, %d(%s)", reg64[rn], r->offset, reg64[frame_reg]);
+}
+
+static void mov(int dst, int src) {
+  if (dst != src)
+    println("  mov %s, %s", reg64[src], reg64[dst]);
+}
+
+static bool is_commutative(IROp op) {
+  return op == IR_ADD || op == IR_MUL;
+}
+
+// Returns the assembly syntax of a memory operand, reloading its
+// registers first if they live in memory.
+static char *mem_operand(Mem *m) {
+  char *index = "";
+  if (m->index)
+    index = format(",%s,%d", reg64[use(m->index, RCX)], m->scale);
+
+  if (m->var && !m->var->is_local) {
+    if (m->disp)
+      return format("%s%+d(%%rip)", m->var->name, m->disp);
+    return format("%s(%%rip)", m->var->name);
+  }
+  if (m->var)
+    return format("%d(%s%s)", m->var->offset + m->disp, reg64[frame_reg], index);
+  if (m->base)
+    return format("%d(%s%s)", m->disp, reg64[use(m->base, RSI)], index);
+  return format("%d(%s)", m->disp, index);
+}
+
+// Returns true if a memory operand reads a given real register.
+static bool mem_reads(Mem *m, int rn) {
+  return (m->base && m->base->rn == rn) || (m->index && m->index->rn == rn);
+}
+
+// Returns the assembly syntax of the second operand of an arithmetic
+// instruction or a comparison. `*rn` is set to the register it reads,
+// if any.
+static char *rhs_operand(IR *ir, int *rn) {
+  *rn = -1;
+  if (ir->r2) {
+    *rn = use(ir->r2, RDI);
+    return reg(*rn, ir->size);
+  }
+  if (ir->mem)
+    return mem_operand(ir->mem);
+  return format("$%ld", ir->imm);
+}
+
+static void gen_binop(IR *ir, char *insn) {
+  int a = use(ir->r1, RAX);
+  int b;
+  char *src = rhs_operand(ir, &b);
+  int d = def(ir->r0, RAX);
+
+  // A three-operand multiply by an immediate doesn't need a copy.
+  if (ir->op == IR_MUL && !ir->r2 && !ir->mem) {
+    println("  imul %s, %s, %s", src, reg(a, ir->size), reg(d, ir->size));
+    writeback(ir->r0, d);
+    return;
+  }
+
+  if (d != a && (d == b || (ir->mem && mem_reads(ir->mem, d)))) {
+    if (d == b && is_commutative(ir->op)) {
+      src = reg(a, ir->size);
+      a = d;
     } else {
-      // Global variable
-      println("  lea %s(%%rip), %%rax", node->var->name);
+      // Computing directly into `d` would clobber the second operand.
+      mov(RAX, a);
+      println("  %s %s, %s", insn, src, reg(RAX, ir->size));
+      mov(d, RAX);
+      writeback(ir->r0, d);
+      return;
     }
+  }
+
+  mov(d, a);
+  println("  %s %s, %s", insn, src, reg(d, ir->size));
+  writeback(ir->r0, d);
+}
+
+static void gen_div(IR *ir) {
+  int a = use(ir->r1, RAX);
+  int b;
+  char *src = rhs_operand(ir, &b);
+  mov(RAX, a);
+  if (ir->size == 8)
+    println("  cqo");
+  else
+    println("  cdq");
+
+  if (ir->mem)
+    println("  idiv%c %s", ir->size == 8 ? 'q' : 'l', src);
+  else
+    println("  idiv %s", src);
+
+  int d = def(ir->r0, RAX);
+  mov(d, RAX);
+  writeback(ir->r0, d);
+}
+
+// Compare the operands of a comparison or a compare-and-branch.
+static void emit_cmp(IR *ir) {
+  int a = use(ir->r1, RAX);
+  int b;
+  char *src = rhs_operand(ir, &b);
+  println("  cmp %s, %s", src, reg(a, ir->size));
+}
+
+static void gen_shift(IR *ir, char *insn) {
+  int a = use(ir->r1, RAX);
+  char *count = format("$%ld", ir->imm);
+  if (ir->r2) {
+    mov(RCX, use(ir->r2, RCX));
+    count = "%cl";
+  }
+
+  int d = def(ir->r0, RAX);
+  mov(d, a);
+  println("  %s %s, %s", insn, count, reg(d, ir->size));
+  writeback(ir->r0, d);
+}
+
+// The one-operand imul leaves the high half of the product in %rdx.
+static void gen_mulh(IR *ir) {
+  int a = use(ir->r1, RAX);
+  int b = use(ir->r2, RDI);
+  mov(RAX, a);
+  println("  imul %s", reg64[b]);
+
+  int d = def(ir->r0, RDX);
+  mov(d, RDX);
+  writeback(ir->r0, d);
+}
+
+static void gen_cmp(IR *ir) {
+  emit_cmp(ir);
+
+  if (ir->op == IR_EQ)
+    println("  sete %%al");
+  else if (ir->op == IR_NE)
+    println("  setne %%al");
+  else if (ir->op == IR_LT)
+    println("  setl %%al");
+  else
+    println("  setle %%al");
+
+  int d = def(ir->r0, RAX);
+  println("  movzb %%al, %s", reg64[d]);
+  writeback(ir->r0, d);
+}
+
+static void gen_load(IR *ir) {
+  char *src = ir->mem ? mem_operand(ir->mem) : format("(%s)", reg64[use(ir->r1, RAX)]);
+  int d = def(ir->r0, RAX);
+
+  if (ir->size == 1)
+    println("  movsbq %s, %s", src, reg64[d]);
+  else if (ir->size == 2)
+    println("  movswq %s, %s", src, reg64[d]);
+  else if (ir->size == 4)
+    println("  movslq %s, %s", src, reg64[d]);
+  else
+    println("  mov %s, %s", src, reg64[d]);
+  writeback(ir->r0, d);
+}
+
+static void gen_store(IR *ir) {
+  char *dst = ir->mem ? mem_operand(ir->mem) : format("(%s)", reg64[use(ir->r1, RAX)]);
+
+  if (ir->r2) {
+    println("  mov %s, %s", reg(use(ir->r2, RDI), ir->size), dst);
     return;
-  case ND_DEREF:
-    gen_expr(node->lhs);
+  }
+
+  switch (ir->size) {
+  case 1:
+    println("  movb $%d, %s", (int8_t)ir->imm, dst);
     return;
-  case ND_COMMA:
-    gen_expr(node->lhs);
-    gen_addr(node->rhs);
+  case 2:
+    println("  movw $%d, %s", (int16_t)ir->imm, dst);
     return;
-  case ND_MEMBER:
-    gen_addr(node->lhs);
-    println(" add $%d, %%rax", node->member->offset);
+  case 4:
+    println("  movl $%d, %s", (int32_t)ir->imm, dst);
     return;
   }
+  println("  movq $%ld, %s", ir->imm, dst);
+}
+
+// Structs smaller than this are copied with unrolled 8-byte moves.
+#define COPY_GP_MAX 32
 
-  error_tok(node->tok, "not an lvalue");
+// Structs of at least this size are copied with `rep movsb`.
+#define COPY_REP_MIN 1024
+
+// Copy the `size - off` bytes at the end of a struct with the widest
+// moves that fit, through %r8.
+static void copy_tail(int dst, int src, int off, int size) {
+  while (off < size) {
+    int n = 8;
+    while (off + n > size)
+      n /= 2;
+    println("  mov %d(%s), %s", off, reg64[src], reg(R8, n));
+    println("  mov %s, %d(%s)", reg(R8, n), off, reg64[dst]);
+    off += n;
+  }
 }
 
-// Load a value from where %rax is pointing to.
-static void load(Type *ty) {
-  if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
-    // If it is an array, do not attempt to load a value to the
-    // register because in general we can't load an entire array to a
-    // register. As a result, the result of an evaluation of an array
-    // becomes not the array itself but the address of the array.
-    // This is where "array is automatically converted to a pointer to
-    // the first element of the array in C" occurs.
+static void gen_memcpy(IR *ir) {
+  int a = use(ir->r1, RAX);
+  int b = use(ir->r2, RDI);
+
+  if (ir->size < COPY_GP_MAX) {
+    copy_tail(a, b, 0, ir->size);
+    return;
+  }
+
+  if (ir->size < COPY_REP_MIN) {
+    int off = 0;
+    for (; off + 16 <= ir->size; off += 16) {
+      println("  movdqu %d(%s), %%xmm0", off, reg64[b]);
+      println("  movdqu %%xmm0, %d(%s)", off, reg64[a]);
+    }
+    copy_tail(a, b, off, ir->size);
     return;
   }
 
-  if (ty->size == 1)
-    println("  movsbq (%%rax), %%rax");
-  else if (ty->size == 2)
-    println(" movswq (%%rax), %%rax");
-  else if (ty->size == 4)
-    println(" movsxd (%%rax), %%rax");
+  // `b` may be %rdi, so move it out of the way first.
+  mov(RSI, b);
+  mov(RDI, a);
+  println("  mov $%d, %%ecx", ir->size);
+  println("  rep movsb");
+}
+
+static void gen_sext(IR *ir) {
+  int a = use(ir->r1, RAX);
+  int d = def(ir->r0, RAX);
+
+  if (ir->size == 1)
+    println("  movsbq %s, %s", reg8[a], reg64[d]);
+  else if (ir->size == 2)
+    println("  movswq %s, %s", reg16[a], reg64[d]);
   else
-    println("  mov (%%rax), %%rax");
+    println("  movslq %s, %s", reg32[a], reg64[d]);
+  writeback(ir->r0, d);
 }
 
-// Store %rax to an address that the stack top is pointing to.
-static void store(Type *ty) {
-  pop("%rdi");
+static void gen_insn(IR *ir, BB *next);
 
-  if (ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
-    for (int i = 0; i < ty->size; i++) {
-      println(" mov %d(%%rax), %%r8b", i);
-      println(" mov %%r8b, %d(%%rdi)", i);
-    }
+// Compute argument `i` of a call into register `rn`.
+static void load_arg(IR *ir, int i, int rn) {
+  IR *arg = ir->arg_insns ? ir->arg_insns[i] : NULL;
+  if (!arg) {
+    mov(rn, use(ir->args[i], rn));
     return;
   }
-  
-  if (ty->size == 1)
-    println("  mov %%al, (%%rdi)");
-  else if (ty->size == 2)
-    println("  mov %%ax, (%%rdi)");
-  else if (ty->size == 4)
-    println("  mov %%eax, (%%rdi)");
-  else
-    println("  mov %%rax, (%%rdi)");
+
+  // Emit the instruction that computes the argument with the argument
+  // register as its destination, on the line of the call.
+  Reg *r0 = arg->r0;
+  Token *tok = arg->tok;
+  arg->r0 = &(Reg){.rn = rn};
+  arg->tok = ir->tok;
+  gen_insn(arg, NULL);
+  arg->r0 = r0;
+  arg->tok = tok;
 }
 
-enum { I8, I16, I32, I64};
+// Push the arguments passed on the stack and load the rest into
+// their registers. Returns the number of bytes pushed.
+static int load_args(IR *ir) {
+  int nstack = (ir->nargs > MAX_REG_ARGS) ? ir->nargs - MAX_REG_ARGS : 0;
+  int size = align_to(nstack * 8, 16);
+
+  // %rsp must stay 16-byte aligned at the call.
+  if (size != nstack * 8)
+    println("  sub $8, %%rsp");
 
-static int getTypeId(Type *ty) {
-  switch (ty->kind) {
-    case TY_CHAR:
-     return I8;
-    case TY_SHORT:
-      return I16;
-    case TY_INT:
-      return I32;
+  for (int i = ir->nargs - 1; i >= MAX_REG_ARGS; i--) {
+    IR *arg = ir->arg_insns ? ir->arg_insns[i] : NULL;
+    if (arg && arg->op == IR_IMM && arg->imm == (int32_t)arg->imm) {
+      println("  push $%ld", arg->imm);
+    } else if (arg) {
+      load_arg(ir, i, RAX);
+      println("  push %%rax");
+    } else if (ir->args[i]->rn == -1) {
+      println("  push %d(%s)", ir->args[i]->offset, reg64[frame_reg]);
+    } else {
+      println("  push %s", reg64[ir->args[i]->rn]);
+    }
   }
-  return I64;
+
+  // Arguments never live in argument registers, and the ones computed
+  // by their own instruction read no register, so loading them one by
+  // one cannot clobber an argument loaded earlier.
+  for (int i = 0; i < ir->nargs && i < MAX_REG_ARGS; i++)
+    load_arg(ir, i, argreg[i]);
+
+  // A variadic function reads the number of vector registers used for
+  // arguments from %al.
+  if (ir->is_variadic)
+    println("  mov $0, %%rax");
+  return size;
 }
 
-// 類型轉換表
-static char i32i8[] = "movsbl %al, %eax";
-static char i32i16[] = "movswl %ax, %eax";
-static char i32i64[] = "movsxd %eax, %rax";
+static void gen_call(IR *ir) {
+  int size = load_args(ir);
+  println("  call %s", ir->funcname);
+  if (size)
+    println("  add $%d, %%rsp", size);
 
-static char *cast_table[][10] = {
-  {NULL,  NULL,   NULL, i32i64},  // i8
-  {i32i8, i32i16, NULL, i32i64},  // i16
-  {i32i8, i32i16, NULL, i32i64},  // i32
-  {i32i8, i32i16, NULL, NULL},    // i64
-};
+  int d = def(ir->r0, RAX);
+  mov(d, RAX);
+  writeback(ir->r0, d);
+}
+
+static char *xmm(int x) {
+  return format("%%xmm%d", x);
+}
+
+// The suffix of SSE2 integer instructions for a given lane width
+static char lane_suffix(int size) {
+  return (size == 1) ? 'b' : (size == 2) ? 'w' : 'd';
+}
 
-static void cast(Type *from, Type *ty) {
-  if (ty->kind == TY_VOID)
+// Sign-extend the `size`-byte elements in the low bytes of %xmm`x` to
+// `lane`-byte lanes. Interleaving a register with itself doubles the
+// width of each element, with a copy of it in the high half, and an
+// arithmetic shift then replaces the copy with the sign.
+static void widen(int x, int size, int lane) {
+  int shift = (lane - size) * 8;
+  for (; size < lane; size *= 2)
+    println("  punpckl%s %s, %s", size == 1 ? "bw" : "wd", xmm(x), xmm(x));
+  println("  psra%c $%d, %s", lane_suffix(lane), shift, xmm(x));
+}
+
+static void gen_vload(IR *ir) {
+  char *src = ir->mem ? mem_operand(ir->mem) : format("(%s)", reg64[use(ir->r1, RAX)]);
+  int bytes = 16 / ir->size * ir->imm;
+
+  if (bytes == 4)
+    println("  movd %s, %s", src, xmm(ir->x0));
+  else if (bytes == 8)
+    println("  movq %s, %s", src, xmm(ir->x0));
+  else
+    println("  movdqu %s, %s", src, xmm(ir->x0));
+
+  if (ir->imm < ir->size)
+    widen(ir->x0, ir->imm, ir->size);
+}
+
+static void gen_vstore(IR *ir) {
+  char *dst = ir->mem ? mem_operand(ir->mem) : format("(%s)", reg64[use(ir->r1, RAX)]);
+  println("  movdqu %s, %s", xmm(ir->x1), dst);
+}
+
+// Copy the low `size` bytes of r1 to every lane of x0.
+static void gen_vsplat(IR *ir) {
+  int x = ir->x0;
+  println("  movd %s, %s", reg32[use(ir->r1, RAX)], xmm(x));
+  if (ir->size == 1)
+    println("  punpcklbw %s, %s", xmm(x), xmm(x));
+  if (ir->size <= 2)
+    println("  punpcklwd %s, %s", xmm(x), xmm(x));
+  println("  pshufd $0, %s, %s", xmm(x), xmm(x));
+}
+
+// SSE2 instructions overwrite their first operand, so x1 is copied to
+// x0 first. ir.c never uses x0 as the second operand unless it is
+// also the first.
+static void gen_vbinop(IR *ir, char *insn) {
+  if (ir->x0 != ir->x1)
+    println("  movdqa %s, %s", xmm(ir->x1), xmm(ir->x0));
+  println("  %s%c %s, %s", insn, lane_suffix(ir->size), xmm(ir->x2), xmm(ir->x0));
+}
+
+// Add up the four 4-byte lanes of x1: first the upper half to the
+// lower half, then the two lanes left.
+static void gen_vhsum(IR *ir) {
+  println("  pshufd $0x4e, %s, %%xmm0", xmm(ir->x1));
+  println("  paddd %s, %%xmm0", xmm(ir->x1));
+  println("  movd %%xmm0, %%eax");
+  println("  pshufd $0x55, %%xmm0, %%xmm0");
+  println("  movd %%xmm0, %%edx");
+  println("  add %%edx, %%eax");
+
+  int d = def(ir->r0, RAX);
+  mov(d, RAX);
+  writeback(ir->r0, d);
+}
+
+// Returns the condition code of a comparison, or of its negation.
+static char *cond_code(IROp op, bool negate) {
+  switch (op) {
+  case IR_EQ:
+    return negate ? "ne" : "e";
+  case IR_NE:
+    return negate ? "e" : "ne";
+  case IR_LT:
+    return negate ? "ge" : "l";
+  case IR_LE:
+    return negate ? "g" : "le";
+  }
+  unreachable();
+}
+
+// Jump to bb1 if the flags satisfy `cond`, or to bb2 otherwise.
+static void emit_jcc(IR *ir, IROp cond, BB *next) {
+  if (ir->bb2 == next) {
+    println("  j%s .L.bb.%d", cond_code(cond, false), ir->bb1->label);
     return;
+  }
 
-  int t1 = getTypeId(from);
-  int t2 = getTypeId(ty);
-  if (cast_table[t1][t2])
-    println(" %s",  cast_table[t1][t2]);
+  println("  j%s .L.bb.%d", cond_code(cond, true), ir->bb2->label);
+  if (ir->bb1 != next)
+    println("  jmp .L.bb.%d", ir->bb1->label);
 }
 
-// Generate code for a given node.
-static void gen_expr(Node *node) {
-  println("   .loc 1 %d", node->tok->line_no); 
+// Restore the callee-saved registers and tear down the frame.
+static void leave_frame(void) {
+  for (int i = 0; i < 16; i++)
+    if (saved_reg_offset[i])
+      println("  mov %d(%s), %s", saved_reg_offset[i], reg64[frame_reg], reg64[i]);
 
-  switch (node->kind) {
-  case ND_NUM:
-    println("  mov $%ld, %%rax", node->val);
+  if (frame_reg == RBP) {
+    println("  mov %%rbp, %%rsp");
+    println("  pop %%rbp");
+  }
+}
+
+static void emit_epilogue(void) {
+  leave_frame();
+  println("  ret");
+}
+
+static void gen_insn(IR *ir, BB *next) {
+  if (opt_g && ir->tok->line_no != last_line) {
+    println("  .loc 1 %d", ir->tok->line_no);
+    last_line = ir->tok->line_no;
+  }
+
+  switch (ir->op) {
+  case IR_IMM: {
+    int d = def(ir->r0, RAX);
+    println("  mov $%ld, %s", ir->imm, reg64[d]);
+    writeback(ir->r0, d);
     return;
-  case ND_NEG:
-    gen_expr(node->lhs);
-    println("  neg %%rax");
+  }
+  case IR_MOV: {
+    int d = def(ir->r0, RAX);
+    mov(d, use(ir->r1, d));
+    writeback(ir->r0, d);
     return;
-  case ND_VAR:
-  case ND_MEMBER:
-    gen_addr(node);
-    load(node->ty);
+  }
+  case IR_ADD:
+    gen_binop(ir, "add");
     return;
-  case ND_DEREF:
-    gen_expr(node->lhs);
-    load(node->ty);
+  case IR_SUB:
+    gen_binop(ir, "sub");
     return;
-  case ND_ADDR:
-    gen_addr(node->lhs);
+  case IR_MUL:
+    gen_binop(ir, "imul");
     return;
-  case ND_ASSIGN:
-    gen_addr(node->lhs);
-    push();
-    gen_expr(node->rhs);
-    store(node->ty);
+  case IR_DIV:
+    gen_div(ir);
     return;
-  case ND_STMT_EXPR:
-    for (Node *n = node->body; n; n = n->next)
-      gen_stmt(n);
+  case IR_MULH:
+    gen_mulh(ir);
     return;
-  case ND_COMMA:
-    gen_expr(node->lhs);
-    gen_expr(node->rhs);
+  case IR_SHL:
+    gen_shift(ir, "shl");
     return;
-  case ND_CAST:
-    gen_expr(node->lhs);
-    cast(node->lhs->ty, node->ty);
+  case IR_SHR:
+    gen_shift(ir, "shr");
     return;
-  case ND_FUNCALL: {
-    int nargs = 0;
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      gen_expr(arg);
-      push();
-      nargs++;
-    }
-
-    for (int i = nargs - 1; i >= 0; i--)
-      pop(argreg64[i]);
-
-    println("  mov $0, %%rax");
-    println("  call %s", node->funcname);
+  case IR_SAR:
+    gen_shift(ir, "sar");
+    return;
+  case IR_NEG: {
+    int d = def(ir->r0, RAX);
+    mov(d, use(ir->r1, d));
+    println("  neg %s", reg64[d]);
+    writeback(ir->r0, d);
     return;
   }
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+    gen_cmp(ir);
+    return;
+  case IR_SEXT:
+    gen_sext(ir);
+    return;
+  case IR_LVAR: {
+    int d = def(ir->r0, RAX);
+    println("  lea %d(%s), %s", ir->var->offset, reg64[frame_reg], reg64[d]);
+    writeback(ir->r0, d);
+    return;
   }
-
-  gen_expr(node->rhs);
-  push();
-  gen_expr(node->lhs);
-  pop("%rdi");
-
-  char *ax, *di;
-
-  if (node->lhs->ty->kind == TY_LONG || node->lhs->ty->base) {
-    ax = "%rax";
-    di = "%rdi";
-  } else {
-    ax = "%eax";
-    di = "%edi";
+  case IR_GVAR: {
+    int d = def(ir->r0, RAX);
+    println("  lea %s(%%rip), %s", ir->var->name, reg64[d]);
+    writeback(ir->r0, d);
+    return;
   }
-
-  switch (node->kind) {
-  case ND_ADD:
-    println("  add %s, %s", di, ax);
+  case IR_LEA: {
+    char *src = mem_operand(ir->mem);
+    int d = def(ir->r0, RAX);
+    println("  lea %s, %s", src, reg(d, ir->size));
+    writeback(ir->r0, d);
     return;
-  case ND_SUB:
-    println("  sub %s, %s", di, ax);
+  }
+  case IR_LOAD:
+    gen_load(ir);
     return;
-  case ND_MUL:
-    println("  imul %s, %s", di, ax);
+  case IR_STORE:
+    gen_store(ir);
     return;
-  case ND_DIV:
-    if (node->lhs->ty->size == 8)
-      println("  cqo");
-    else
-      println(" cdq");
-    println("  idiv %s", di);
-    return;
-  case ND_EQ:
-  case ND_NE:
-  case ND_LT:
-  case ND_LE:
-    println("  cmp %s, %s", di, ax);
-
-    if (node->kind == ND_EQ)
-      println("  sete %%al");
-    else if (node->kind == ND_NE)
-      println("  setne %%al");
-    else if (node->kind == ND_LT)
-      println("  setl %%al");
-    else if (node->kind == ND_LE)
-      println("  setle %%al");
-
-    println("  movzb %%al, %%rax");
-    return;
-  }
-
-  error_tok(node->tok, "invalid expression");
-}
-
-static void gen_stmt(Node *node) {
-  println("   .loc 1 %d", node->tok->line_no);
-
-  switch (node->kind) {
-  case ND_IF: {
-    int c = count();
-    gen_expr(node->cond);
-    println("  cmp $0, %%rax");
-    println("  je  .L.else.%d", c);
-    gen_stmt(node->then);
-    println("  jmp .L.end.%d", c);
-    println(".L.else.%d:", c);
-    if (node->els)
-      gen_stmt(node->els);
-    println(".L.end.%d:", c);
-    return;
-  }
-  case ND_FOR: {
-    int c = count();
-    if (node->init)
-      gen_stmt(node->init);
-    println(".L.begin.%d:", c);
-    if (node->cond) {
-      gen_expr(node->cond);
-      println("  cmp $0, %%rax");
-      println("  je  .L.end.%d", c);
+  case IR_MEMCPY:
+    gen_memcpy(ir);
+    return;
+  case IR_VZERO:
+    println("  pxor %s, %s", xmm(ir->x0), xmm(ir->x0));
+    return;
+  case IR_VSPLAT:
+    gen_vsplat(ir);
+    return;
+  case IR_VLOAD:
+    gen_vload(ir);
+    return;
+  case IR_VSTORE:
+    gen_vstore(ir);
+    return;
+  case IR_VADD:
+    gen_vbinop(ir, "padd");
+    return;
+  case IR_VSUB:
+    gen_vbinop(ir, "psub");
+    return;
+  case IR_VMUL:
+    // SSE2 only has pmullw, so ir.c uses this for 2-byte lanes only.
+    gen_vbinop(ir, "pmull");
+    return;
+  case IR_VEQ:
+    gen_vbinop(ir, "pcmpeq");
+    return;
+  case IR_VGT:
+    gen_vbinop(ir, "pcmpgt");
+    return;
+  case IR_VHSUM:
+    gen_vhsum(ir);
+    return;
+  case IR_PARAM: {
+    int d = def(ir->r0, RAX);
+    if (ir->imm < MAX_REG_ARGS) {
+      mov(d, argreg[ir->imm]);
+    } else {
+      // Stack arguments are above the return address and, if there
+      // is a frame, the saved %rbp.
+      int off = ((frame_reg == RBP) ? 16 : 8) + (ir->imm - MAX_REG_ARGS) * 8;
+      println("  mov %d(%s), %s", off, reg64[frame_reg], reg64[d]);
     }
-    gen_stmt(node->then);
-    if (node->inc)
-      gen_expr(node->inc);
-    println("  jmp .L.begin.%d", c);
-    println(".L.end.%d:", c);
+    writeback(ir->r0, d);
     return;
   }
-  case ND_BLOCK:
-    for (Node *n = node->body; n; n = n->next)
-      gen_stmt(n);
+  case IR_CALL:
+    gen_call(ir);
+    return;
+  case IR_TAILCALL:
+    // The callee returns directly to our caller. tailcall.c only
+    // makes calls with register arguments tail calls.
+    load_args(ir);
+    leave_frame();
+    println("  jmp %s", ir->funcname);
     return;
-  case ND_RETURN:
-    gen_expr(node->lhs);
-    println("  jmp .L.return.%s", current_fn->name);
+  case IR_JMP:
+    if (ir->bb1 != next)
+      println("  jmp .L.bb.%d", ir->bb1->label);
     return;
-  case ND_EXPR_STMT:
-    gen_expr(node->lhs);
+  case IR_BR: {
+    int a = use(ir->r1, RAX);
+    println("  test %s, %s", reg64[a], reg64[a]);
+    emit_jcc(ir, IR_NE, next);
+    return;
+  }
+  case IR_CBR:
+    emit_cmp(ir);
+    emit_jcc(ir, ir->cond, next);
+    return;
+  case IR_RET:
+    if (ir->r1)
+      mov(RAX, use(ir->r1, RAX));
+    if (frame_reg == RSP)
+      emit_epilogue();
+    else
+      println("  jmp .L.return.%s", current_fn->name);
     return;
   }
 
-  error_tok(node->tok, "invalid statement");
+  unreachable();
 }
 
 // Assign offsets to local variables.
+static bool lifetimes_overlap(Obj *x, Obj *y) {
+  return x->live_begin <= y->live_end && y->live_begin <= x->live_end;
+}
+
+// Sort variables by decreasing alignment, and by decreasing size among
+// variables with the same alignment, to avoid padding between them.
+// Variables of the same type are laid out in declaration order from
+// the bottom of the frame, as they were before slots were shared.
+static int cmp_align(const void *a, const void *b) {
+  Obj *x = *(Obj **)a;
+  Obj *y = *(Obj **)b;
+  if (x->ty->align != y->ty->align)
+    return y->ty->align - x->ty->align;
+  if (x->ty->size != y->ty->size)
+    return y->ty->size - x->ty->size;
+  return y->live_begin - x->live_begin;
+}
+
+// Returns the lowest offset from the top of the frame at which `var`
+// doesn't overlap any of the `n` variables in `vars`, whose lifetimes
+// overlap with that of `var`.
+static int find_slot(Obj *var, Obj **vars, int n) {
+  int size = var->ty->size;
+  int align = var->ty->align;
+
+  // The lowest offset is either the top of the frame or right below
+  // one of the conflicting variables.
+  int best = -1;
+  for (int i = -1; i < n; i++) {
+    int start = (i == -1) ? 0 : align_to(-vars[i]->offset, align);
+    if (best != -1 && best <= start)
+      continue;
+
+    bool ok = true;
+    for (int j = 0; j < n && ok; j++) {
+      int end2 = -vars[j]->offset;
+      int start2 = end2 - vars[j]->ty->size;
+      if (start < end2 && start2 < start + size)
+        ok = false;
+    }
+    if (ok)
+      best = start;
+  }
+  return best;
+}
+
+// Assign stack slots to local variables. Variables whose lifetimes
+// don't overlap, such as the ones declared in sibling blocks, share
+// space.
 static void assign_lvar_offsets(Obj *prog) {
   for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function)
+    if (!fn->is_function || !fn->is_definition)
       continue;
 
-    int offset = 0;
+    int n = 0;
+    int naive = 0;
     for (Obj *var = fn->locals; var; var = var->next) {
-      offset += var->ty->size;
-      offset = align_to(offset, var->ty->align);
-      var->offset = -offset;
+      if (var->reg)
+        continue;
+      naive = align_to(naive + var->ty->size, var->ty->align);
+      n++;
+    }
+
+    Obj **vars = calloc(n, sizeof(Obj *));
+    Obj **conflicts = calloc(n, sizeof(Obj *));
+    n = 0;
+    for (Obj *var = fn->locals; var; var = var->next)
+      if (!var->reg)
+        vars[n++] = var;
+    qsort(vars, n, sizeof(Obj *), cmp_align);
+
+    int size = 0;
+    for (int i = 0; i < n; i++) {
+      int nconflicts = 0;
+      for (int j = 0; j < i; j++)
+        if (lifetimes_overlap(vars[i], vars[j]))
+          conflicts[nconflicts++] = vars[j];
+
+      int start = find_slot(vars[i], conflicts, nconflicts);
+      vars[i]->offset = -(start + vars[i]->ty->size);
+      if (size < start + vars[i]->ty->size)
+        size = start + vars[i]->ty->size;
+    }
+    fn->stack_size = size;
+
+    if (size < naive)
+      opt_info(fn->bbs->ir->tok, "%s: shared stack slots, frame size %d -> %d bytes",
+               fn->name, naive, size);
+  }
+}
+
+static void assign_slot(Obj *fn, Reg *r) {
+  if (!r || r->rn != -1 || r->offset)
+    return;
+  fn->stack_size = align_to(fn->stack_size + 8, 8);
+  r->offset = -fn->stack_size;
+}
+
+// Assign stack slots to virtual registers that live in memory and
+// to callee-saved registers that need to be preserved.
+static void assign_reg_slots(Obj *fn) {
+  bool used[16] = {};
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      assign_slot(fn, ir->r0);
+      if (ir->r0 && ir->r0->rn != -1)
+        used[ir->r0->rn] = true;
     }
-    fn->stack_size = align_to(offset, 16);
   }
+
+  for (int i = 0; i < sizeof(callee_saved) / sizeof(*callee_saved); i++) {
+    int rn = callee_saved[i];
+    saved_reg_offset[rn] = 0;
+    if (used[rn]) {
+      fn->stack_size = align_to(fn->stack_size + 8, 8);
+      saved_reg_offset[rn] = -fn->stack_size;
+    }
+  }
+
+  fn->stack_size = align_to(fn->stack_size, 16);
+}
+
+// Emit `len` bytes of data as a single .ascii directive.
+static void emit_bytes(char *data, int len) {
+  fprintf(output_file, "  .ascii \"");
+  for (int i = 0; i < len; i++) {
+    unsigned char c = data[i];
+    if (c == '"' || c == '\\')
+      fprintf(output_file, "\\%c", c);
+    else if (isprint(c))
+      fputc(c, output_file);
+    else
+      fprintf(output_file, "\\%03o", c);
+  }
+  fprintf(output_file, "\"\n");
+}
+
+// Compare the contents of two string literals backwards from their
+// ends, so that a literal sorts right before the literals it is a
+// suffix of.
+static int cmp_reversed(const void *a, const void *b) {
+  Obj *x = *(Obj **)a;
+  Obj *y = *(Obj **)b;
+  int lx = x->ty->size;
+  int ly = y->ty->size;
+
+  for (int i = 0; i < lx && i < ly; i++) {
+    unsigned char c = x->init_data[lx - 1 - i];
+    unsigned char d = y->init_data[ly - 1 - i];
+    if (c != d)
+      return c - d;
+  }
+  return lx - ly;
+}
+
+static bool is_suffix(Obj *x, Obj *y) {
+  int lx = x->ty->size;
+  int ly = y->ty->size;
+  return lx <= ly && !memcmp(x->init_data, y->init_data + ly - lx, lx);
+}
+
+// String literals are read-only. A literal without embedded NULs goes
+// to a mergeable string section, so that the linker can merge the
+// same literal across object files. A literal that is a suffix of a
+// longer one, like "bar" and "foobar", is emitted as an alias into
+// the longer one instead of as a copy of its own.
+static void emit_literals(Obj *prog) {
+  int n = 0;
+  for (Obj *var = prog; var; var = var->next)
+    if (var->is_literal)
+      n++;
+
+  Obj **strs = calloc(n, sizeof(Obj *));
+  Obj **owner = calloc(n, sizeof(Obj *));
+  int nstrs = 0;
+
+  for (Obj *var = prog; var; var = var->next) {
+    if (!var->is_literal)
+      continue;
+
+    if (memchr(var->init_data, '\0', var->ty->size - 1)) {
+      println("  .section .rodata");
+      println("%s:", var->name);
+      emit_bytes(var->init_data, var->ty->size);
+      continue;
+    }
+    strs[nstrs++] = var;
+  }
+
+  qsort(strs, nstrs, sizeof(Obj *), cmp_reversed);
+
+  // Literals that are suffixes of one another are adjacent after
+  // sorting, and the last one of each such run is the longest.
+  for (int i = nstrs - 1; i >= 0; i--) {
+    if (i + 1 < nstrs && is_suffix(strs[i], strs[i + 1]))
+      owner[i] = owner[i + 1];
+    else
+      owner[i] = strs[i];
+  }
+
+  if (nstrs)
+    println("  .section .rodata.str1.1,\"aMS\",@progbits,1");
+
+  for (int i = 0; i < nstrs; i++) {
+    if (owner[i] != strs[i])
+      continue;
+    println("%s:", strs[i]->name);
+    emit_bytes(strs[i]->init_data, strs[i]->ty->size);
+  }
+
+  for (int i = 0; i < nstrs; i++)
+    if (owner[i] != strs[i])
+      println("  .set %s, %s+%d", strs[i]->name, owner[i]->name,
+              owner[i]->ty->size - strs[i]->ty->size);
 }
 
 static void emit_data(Obj *prog) {
   for (Obj *var = prog; var; var = var->next) {
-    if (var->is_function)
+    if (var->is_function || var->is_literal)
       continue;
 
-    println("  .data");
-    println("  .globl %s", var->name);
-    println("%s:", var->name);
+    // Like GCC, align aggregates of 16 bytes or more to 16 bytes so
+    // that copying them with 16-byte moves never splits a cache line.
+    Type *ty = var->ty;
+    int align = ty->align;
+    if ((ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_UNION) &&
+        ty->size >= 16 && align < 16)
+      align = 16;
+
+    if (!var->is_static)
+      println("  .globl %s", var->name);
 
     if (var->init_data) {
-      for (int i = 0; i < var->ty->size; i++)
-        println("  .byte %d", var->init_data[i]);
-    } else {
-      println("  .zero %d", var->ty->size);
+      println("  .data");
+      println("  .align %d", align);
+      println("%s:", var->name);
+      emit_bytes(var->init_data, var->ty->size);
+      continue;
     }
+
+    // Zero-filled globals take no space in the object file.
+    println("  .bss");
+    println("  .align %d", align);
+    println("%s:", var->name);
+    println("  .zero %d", var->ty->size);
   }
 }
 
-static void store_gp(int r, int offset, int sz) {
-  switch (sz) {
-  case 1:
-    println(" mov %s, %d(%%rbp)", argreg8[r], offset);
-    return;
-  case 2:
-    println(" mov %s, %d(%%rbp)", argreg16[r], offset);
-    return;
-  case 4:
-    println(" mov %s, %d(%%rbp)", argreg32[r], offset);
-    return;
-  case 8:
-    println(" mov %s, %d(%%rbp)", argreg64[r], offset);
-    return;
-  }
-  unreachable();
+// A tail call doesn't make a function non-leaf, because it leaves the
+// frame before jumping to the callee.
+static bool is_leaf(Obj *fn) {
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    for (IR *ir = bb->ir; ir; ir = ir->next)
+      if (ir->op == IR_CALL)
+        return false;
+  return true;
+}
+
+// Call `hook(this_fn, call_site)` for -finstrument-functions. The
+// hook may clobber any caller-saved register, so `regs` that hold
+// incoming arguments or the return value are pushed around the call,
+// padded to keep %rsp 16-byte aligned.
+static void call_hook(char *hook, int *regs, int nregs) {
+  for (int i = 0; i < nregs; i++)
+    println("  push %s", reg64[regs[i]]);
+  if (nregs % 2)
+    println("  sub $8, %%rsp");
+
+  println("  lea %s(%%rip), %%rdi", current_fn->name);
+  println("  mov 8(%%rbp), %%rsi");
+  println("  call %s", hook);
+
+  if (nregs % 2)
+    println("  add $8, %%rsp");
+  for (int i = nregs - 1; i >= 0; i--)
+    println("  pop %s", reg64[regs[i]]);
 }
 
 static void emit_text(Obj *prog) {
@@ -369,30 +1016,78 @@ static void emit_text(Obj *prog) {
     if (!fn->is_function || !fn->is_definition)
       continue;
 
-    println("  .globl %s", fn->name);
+    if (!fn->is_static)
+      println("  .globl %s", fn->name);
     println("  .text");
+    if (fn->is_hot)
+      println("  .align 16");
+
+    // Function symbols let gprof and other tools attribute code.
+    println("  .type %s, @function", fn->name);
     println("%s:", fn->name);
     current_fn = fn;
+    buffering = true;
+    last_line = 0;
+    assign_reg_slots(fn);
+
+    // A leaf function whose frame fits in the red zone doesn't need
+    // to set up a frame. It addresses its stack slots from %rsp and
+    // returns right away instead of jumping to a shared epilogue.
+    // Instrumented functions always have a frame, because mcount
+    // finds the caller through %rbp and the hooks return through
+    // the shared epilogue.
+    frame_reg = RBP;
+    if (is_leaf(fn) && fn->stack_size <= RED_ZONE_SIZE && !opt_pg &&
+        !opt_finstrument_functions)
+      frame_reg = RSP;
 
     // Prologue
-    println("  push %%rbp");
-    println("  mov %%rsp, %%rbp");
-    println("  sub $%d, %%rsp", fn->stack_size);
+    if (frame_reg == RBP) {
+      println("  push %%rbp");
+      println("  mov %%rsp, %%rbp");
 
-    // Save passed-by-register arguments to the stack
-    int i = 0;
-    for (Obj *var = fn->params; var; var = var->next)
-      store_gp(i++, var->offset, var->ty->size);
+      // Like GCC, call mcount as soon as the frame is linked. It
+      // preserves the argument registers.
+      if (opt_pg)
+        println("  call mcount");
+
+      if (fn->stack_size)
+        println("  sub $%d, %%rsp", fn->stack_size);
+    }
+    for (int i = 0; i < 16; i++)
+      if (saved_reg_offset[i])
+        println("  mov %s, %d(%s)", reg64[i], saved_reg_offset[i], reg64[frame_reg]);
+
+    if (opt_finstrument_functions) {
+      int nparams = 0;
+      for (Obj *var = fn->params; var && nparams < MAX_REG_ARGS; var = var->next)
+        nparams++;
+      call_hook("__cyg_profile_func_enter", argreg, nparams);
+    }
 
     // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      println(".L.bb.%d:", bb->label);
+      for (IR *ir = bb->ir; ir; ir = ir->next)
+        gen_insn(ir, bb->next);
+    }
 
     // Epilogue
-    println(".L.return.%s:", fn->name);
-    println("  mov %%rbp, %%rsp");
-    println("  pop %%rbp");
-    println("  ret");
+    if (frame_reg == RBP) {
+      println(".L.return.%s:", fn->name);
+      if (opt_finstrument_functions)
+        call_hook("__cyg_profile_func_exit", (int[]){RAX}, 1);
+      emit_epilogue();
+    }
+
+    flush_lines(fn);
+    buffering = false;
+
+    if (fn->is_destructor) {
+      println("  .section .fini_array,\"aw\"");
+      println("  .align 8");
+      println("  .quad %s", fn->name);
+    }
   }
 }
 
@@ -401,5 +1096,6 @@ void codegen(Obj *prog, FILE *out) {
 
   assign_lvar_offsets(prog);
   emit_data(prog);
+  emit_literals(prog);
   emit_text(prog);
-}
\ No newline at end of file
+}
@@ -0,0 +1,155 @@
+// This file removes code that can never be executed.
+//
+// ir.c lowers every statement in order, so code after a `return`,
+// `break` or `continue` ends up in blocks that nothing jumps to, and
+// both arms of an `if` are generated even if the condition is a
+// constant folded by the parser. Here we
+//
+//  - turn a branch on a constant into a jump to the arm it takes,
+//  - delete blocks that are not reachable from the entry block, and
+//  - merge a block into its predecessor if that is the only block
+//    jumping to it, so that later passes see longer straight-line
+//    code.
+//
+// The number of deleted instructions is reported with -fopt-info.
+
+#include "sodium.h"
+
+static int count_insns(BB *bb) {
+  int n = 0;
+  for (IR *ir = bb->ir; ir; ir = ir->next)
+    n++;
+  return n;
+}
+
+// Replace branches on registers that always hold the same constant
+// with jumps. Returns the number of replaced branches.
+static int fold_branches(Obj *fn) {
+  int nregs = num_regs(fn);
+  IR **defs = calloc(nregs, sizeof(IR *));
+  int *ndefs = calloc(nregs, sizeof(int));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->r0) {
+        defs[ir->r0->vn] = ir;
+        ndefs[ir->r0->vn]++;
+      }
+    }
+  }
+
+  int n = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    IR *ir = bb->last;
+    if (ir->op != IR_BR || ndefs[ir->r1->vn] != 1)
+      continue;
+
+    IR *def = defs[ir->r1->vn];
+    if (def->op != IR_IMM)
+      continue;
+
+    ir->op = IR_JMP;
+    if (!def->imm)
+      ir->bb1 = ir->bb2;
+    ir->r1 = NULL;
+    ir->bb2 = NULL;
+    n++;
+  }
+  return n;
+}
+
+static void mark(BB *bb) {
+  if (!bb || bb->index)
+    return;
+  bb->index = 1;
+  mark(bb->last->bb1);
+  mark(bb->last->bb2);
+}
+
+// Delete blocks not reachable from the entry block. Returns the number
+// of deleted instructions.
+static int delete_unreachable(Obj *fn) {
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    bb->index = 0;
+  mark(fn->bbs);
+
+  int n = 0;
+  BB head = {.next = fn->bbs};
+  for (BB *bb = &head; bb->next;) {
+    if (bb->next->index) {
+      bb = bb->next;
+      continue;
+    }
+    n += count_insns(bb->next);
+    bb->next = bb->next->next;
+  }
+  fn->bbs = head.next;
+  return n;
+}
+
+// Merge blocks ending with a jump into their successor if they are
+// its only predecessor. Returns the number of deleted jumps.
+static int merge_blocks(Obj *fn) {
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    bb->index = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (bb->last->bb1)
+      bb->last->bb1->index++;
+    if (bb->last->bb2)
+      bb->last->bb2->index++;
+  }
+
+  int n = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (!bb->ir)
+      continue;
+
+    for (;;) {
+      IR *last = bb->last;
+      BB *succ = last->bb1;
+      if (last->op != IR_JMP || succ == fn->bbs || succ == bb ||
+          succ->index != 1)
+        break;
+
+      // Splice the successor's instructions in place of the jump.
+      IR *prev = NULL;
+      for (IR *ir = bb->ir; ir != last; ir = ir->next)
+        prev = ir;
+      if (prev)
+        prev->next = succ->ir;
+      else
+        bb->ir = succ->ir;
+      bb->last = succ->last;
+
+      succ->ir = succ->last = NULL;
+      succ->index = 0;
+      n++;
+    }
+  }
+
+  // Drop the blocks that have been emptied.
+  BB head = {.next = fn->bbs};
+  for (BB *bb = &head; bb->next;) {
+    if (bb->next->ir)
+      bb = bb->next;
+    else
+      bb->next = bb->next->next;
+  }
+  return n;
+}
+
+void remove_dead_code(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition)
+      continue;
+
+    Token *tok = fn->bbs->ir->tok;
+    int nbranches = fold_branches(fn);
+    int ninsns = delete_unreachable(fn);
+    ninsns += merge_blocks(fn);
+
+    if (ninsns)
+      opt_info(tok, "%s: folded %d constant branches, removed %d instructions",
+               fn->name, nbranches, ninsns);
+  }
+}
@@ -0,0 +1,238 @@
+// This file writes an ELF64 relocatable object file for x86-64.
+//
+// The file consists of the ELF header, the contents of the sections
+// and the section header table. Besides the sections assembled by
+// asm.c, it has a .rela section for every section with relocations,
+// the symbol table with its string table, the section name string
+// table, and an empty .note.GNU-stack that tells the linker that our
+// code doesn't need an executable stack.
+
+#include "sodium.h"
+#include <elf.h>
+
+// A string table under construction
+typedef struct {
+  char *buf;
+  int size;
+} StrTab;
+
+static int add_str(StrTab *tab, char *s) {
+  int len = strlen(s) + 1;
+  tab->buf = realloc(tab->buf, tab->size + len);
+  memcpy(tab->buf + tab->size, s, len);
+  tab->size += len;
+  return tab->size - len;
+}
+
+static FILE *out;
+static long pos;
+
+static void write_bytes(void *buf, int size) {
+  fwrite(buf, size, 1, out);
+  pos += size;
+}
+
+static void pad_to(int align) {
+  while (pos % align) {
+    fputc(0, out);
+    pos++;
+  }
+}
+
+static bool is_local(Symbol *sym) {
+  return !sym->is_global && sym->sec;
+}
+
+static int reloc_type(RelocKind kind) {
+  switch (kind) {
+  case RELOC_PLT32:
+    return R_X86_64_PLT32;
+  case RELOC_64:
+    return R_X86_64_64;
+  }
+  return R_X86_64_PC32;
+}
+
+static int section_type(Section *sec) {
+  if (!sec->buf)
+    return SHT_NOBITS;
+  if (!strcmp(sec->name, ".fini_array"))
+    return SHT_FINI_ARRAY;
+  return SHT_PROGBITS;
+}
+
+void write_elf(FILE *file, Section **secs, int nsecs, Symbol *syms) {
+  // The file is built in memory because the offset of the section
+  // header table in the ELF header is only known at the end.
+  char *buf;
+  size_t buflen;
+  out = open_memstream(&buf, &buflen);
+  pos = 0;
+
+  // The symbol table has the symbols that are global, undefined,
+  // functions or referred to by a relocation. Local symbols must come
+  // first.
+  int nsyms = 0;
+  for (Symbol *sym = syms; sym; sym = sym->next)
+    sym->index = 0;
+  for (int i = 0; i < nsecs; i++)
+    for (Reloc *rel = secs[i]->relocs; rel; rel = rel->next)
+      rel->sym->index = -1;
+
+  Symbol **symtab = calloc(1, sizeof(Symbol *));
+  int nlocals = 1;
+  for (int pass = 0; pass < 2; pass++) {
+    for (Symbol *sym = syms; sym; sym = sym->next) {
+      bool needed = sym->is_global || sym->is_function || !sym->sec || sym->index == -1;
+      if (!needed || is_local(sym) != (pass == 0))
+        continue;
+      symtab = realloc(symtab, sizeof(Symbol *) * (nsyms + 2));
+      symtab[++nsyms] = sym;
+      sym->index = nsyms;
+    }
+    if (pass == 0)
+      nlocals = nsyms + 1;
+  }
+
+  // Section header indices: the null section, the assembled sections,
+  // their .rela sections, and then the tables.
+  int shnum = 1;
+  for (int i = 0; i < nsecs; i++)
+    secs[i]->index = shnum++;
+  int *rela_index = calloc(nsecs, sizeof(int));
+  for (int i = 0; i < nsecs; i++)
+    if (secs[i]->relocs)
+      rela_index[i] = shnum++;
+  int symtab_index = shnum++;
+  int strtab_index = shnum++;
+  int shstrtab_index = shnum++;
+  int note_index = shnum++;
+
+  StrTab strtab = {};
+  StrTab shstrtab = {};
+  add_str(&strtab, "");
+  add_str(&shstrtab, "");
+
+  Elf64_Shdr *shdrs = calloc(shnum, sizeof(Elf64_Shdr));
+
+  // ELF header
+  Elf64_Ehdr ehdr = {};
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  ehdr.e_type = ET_REL;
+  ehdr.e_machine = EM_X86_64;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = shnum;
+  ehdr.e_shstrndx = shstrtab_index;
+  write_bytes(&ehdr, sizeof(ehdr));
+
+  // Section contents
+  for (int i = 0; i < nsecs; i++) {
+    Section *sec = secs[i];
+    Elf64_Shdr *sh = &shdrs[sec->index];
+    sh->sh_name = add_str(&shstrtab, sec->name);
+    sh->sh_type = section_type(sec);
+    sh->sh_flags = (sec->is_alloc ? SHF_ALLOC : 0) |
+                   (sec->is_writable ? SHF_WRITE : 0) |
+                   (sec->is_exec ? SHF_EXECINSTR : 0);
+    if (sec->is_strings) {
+      sh->sh_flags |= SHF_MERGE | SHF_STRINGS;
+      sh->sh_entsize = 1;
+    }
+    sh->sh_addralign = sec->align;
+    sh->sh_size = sec->size;
+
+    pad_to(sec->align);
+    sh->sh_offset = pos;
+    if (sec->buf)
+      write_bytes(sec->buf, sec->size);
+  }
+
+  // Relocations
+  for (int i = 0; i < nsecs; i++) {
+    if (!rela_index[i])
+      continue;
+
+    Elf64_Shdr *sh = &shdrs[rela_index[i]];
+    sh->sh_name = add_str(&shstrtab, format(".rela%s", secs[i]->name));
+    sh->sh_type = SHT_RELA;
+    sh->sh_flags = SHF_INFO_LINK;
+    sh->sh_link = symtab_index;
+    sh->sh_info = secs[i]->index;
+    sh->sh_addralign = 8;
+    sh->sh_entsize = sizeof(Elf64_Rela);
+
+    pad_to(8);
+    sh->sh_offset = pos;
+    for (Reloc *rel = secs[i]->relocs; rel; rel = rel->next) {
+      Elf64_Rela rela = {};
+      rela.r_offset = rel->offset;
+      rela.r_info = ELF64_R_INFO(rel->sym->index, reloc_type(rel->kind));
+      rela.r_addend = rel->addend;
+      write_bytes(&rela, sizeof(rela));
+    }
+    sh->sh_size = pos - sh->sh_offset;
+  }
+
+  // Symbol table
+  Elf64_Shdr *sh = &shdrs[symtab_index];
+  sh->sh_name = add_str(&shstrtab, ".symtab");
+  sh->sh_type = SHT_SYMTAB;
+  sh->sh_link = strtab_index;
+  sh->sh_info = nlocals;
+  sh->sh_addralign = 8;
+  sh->sh_entsize = sizeof(Elf64_Sym);
+
+  pad_to(8);
+  sh->sh_offset = pos;
+  Elf64_Sym null_sym = {};
+  write_bytes(&null_sym, sizeof(null_sym));
+  for (int i = 1; i <= nsyms; i++) {
+    Symbol *sym = symtab[i];
+    Elf64_Sym esym = {};
+    esym.st_name = add_str(&strtab, sym->name);
+    esym.st_info = ELF64_ST_INFO(is_local(sym) ? STB_LOCAL : STB_GLOBAL,
+                                 sym->is_function ? STT_FUNC : STT_NOTYPE);
+    esym.st_shndx = sym->sec ? sym->sec->index : SHN_UNDEF;
+    esym.st_value = sym->sec ? sym->value : 0;
+    write_bytes(&esym, sizeof(esym));
+  }
+  sh->sh_size = pos - sh->sh_offset;
+
+  // String tables
+  sh = &shdrs[strtab_index];
+  sh->sh_name = add_str(&shstrtab, ".strtab");
+  sh->sh_type = SHT_STRTAB;
+  sh->sh_addralign = 1;
+  sh->sh_offset = pos;
+  sh->sh_size = strtab.size;
+  write_bytes(strtab.buf, strtab.size);
+
+  sh = &shdrs[note_index];
+  sh->sh_name = add_str(&shstrtab, ".note.GNU-stack");
+  sh->sh_type = SHT_PROGBITS;
+  sh->sh_addralign = 1;
+  sh->sh_offset = pos;
+
+  sh = &shdrs[shstrtab_index];
+  sh->sh_name = add_str(&shstrtab, ".shstrtab");
+  sh->sh_type = SHT_STRTAB;
+  sh->sh_addralign = 1;
+  sh->sh_offset = pos;
+  sh->sh_size = shstrtab.size;
+  write_bytes(shstrtab.buf, shstrtab.size);
+
+  // Section header table, whose offset goes to the ELF header
+  pad_to(8);
+  ehdr.e_shoff = pos;
+  write_bytes(shdrs, shnum * sizeof(Elf64_Shdr));
+
+  fclose(out);
+  memcpy(buf, &ehdr, sizeof(ehdr));
+  fwrite(buf, buflen, 1, file);
+}
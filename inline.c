@@ -0,0 +1,261 @@
+// This file inlines calls to small functions defined in the same
+// translation unit.
+//
+// A call is replaced with a copy of the callee's basic blocks. The
+// callee's virtual registers are renamed to fresh ones, its local
+// variables and parameters get new stack slots in the caller's frame,
+// incoming arguments become moves from the argument registers and
+// each return becomes a jump to the code following the call.
+//
+// A function is inlined if its body has at most `opt_inline_limit`
+// instructions. Functions are visited in the order they are defined,
+// so that a function is inlined into after the functions it calls,
+// which usually come first. A function is never inlined into itself,
+// and calls that appear in an inlined body are not inlined again in
+// the same caller, so recursion can't make us loop.
+//
+// With -fprofile-use, the limit is four times as large at hot call
+// sites, and call sites that never ran are not inlined at all.
+
+#include "sodium.h"
+
+static int nregs;
+static Reg **reg_map;
+static BB **bb_map;
+static Obj **var_map;
+static Obj **vars;
+static int nvars;
+
+static int count_insns(Obj *fn) {
+  int n = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    for (IR *ir = bb->ir; ir; ir = ir->next)
+      n++;
+  return n;
+}
+
+static Obj *find_function(Obj *prog, char *name) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition && !strcmp(fn->name, name))
+      return fn;
+  return NULL;
+}
+
+static Reg *new_reg(void) {
+  Reg *r = calloc(1, sizeof(Reg));
+  r->vn = nregs++;
+  r->rn = -1;
+  return r;
+}
+
+static Reg *map_reg(Reg *r) {
+  if (!r)
+    return NULL;
+  if (!reg_map[r->vn])
+    reg_map[r->vn] = new_reg();
+  return reg_map[r->vn];
+}
+
+static Obj *map_var(Obj *var) {
+  if (!var || !var->is_local)
+    return var;
+  for (int i = 0; i < nvars; i++)
+    if (vars[i] == var)
+      return var_map[i];
+  unreachable();
+}
+
+static IR *new_insn(IROp op, Reg *r0, Reg *r1, Token *tok) {
+  IR *ir = calloc(1, sizeof(IR));
+  ir->op = op;
+  ir->size = 8;
+  ir->r0 = r0;
+  ir->r1 = r1;
+  ir->tok = tok;
+  return ir;
+}
+
+static void append(BB *bb, IR *ir) {
+  if (bb->last)
+    bb->last->next = ir;
+  else
+    bb->ir = ir;
+  bb->last = ir;
+}
+
+// Copy the body of `callee` in place of `call`, which is the
+// instruction after `prev` in `bb`, or the first one if `prev` is
+// NULL.
+static void inline_call(Obj *caller, BB *bb, IR *prev, IR *call, Obj *callee) {
+  int callee_nregs = num_regs(callee);
+  reg_map = calloc(callee_nregs, sizeof(Reg *));
+
+  // Give the callee's locals new slots in the caller's frame. Their
+  // lifetimes are unknown in the caller's scopes, so they may not
+  // share slots with the caller's own locals.
+  nvars = 0;
+  for (Obj *var = callee->locals; var; var = var->next)
+    nvars++;
+  vars = calloc(nvars, sizeof(Obj *));
+  var_map = calloc(nvars, sizeof(Obj *));
+  nvars = 0;
+  for (Obj *var = callee->locals; var; var = var->next) {
+    Obj *copy = calloc(1, sizeof(Obj));
+    *copy = *var;
+    copy->live_begin = 0;
+    copy->live_end = INT32_MAX;
+    copy->next = caller->locals;
+    caller->locals = copy;
+    vars[nvars] = var;
+    var_map[nvars++] = copy;
+  }
+
+  // Split the block after the call.
+  BB *cont = new_bb();
+  cont->count = bb->count;
+  cont->ir = call->next;
+  cont->last = bb->last;
+  if (prev) {
+    prev->next = NULL;
+    bb->last = prev;
+  } else {
+    bb->ir = bb->last = NULL;
+  }
+
+  int nbbs = 0;
+  for (BB *b = callee->bbs; b; b = b->next)
+    b->index = nbbs++;
+  bb_map = calloc(nbbs, sizeof(BB *));
+  for (BB *b = callee->bbs; b; b = b->next) {
+    bb_map[b->index] = new_bb();
+    bb_map[b->index]->count = b->count;
+  }
+
+  IR *jmp = new_insn(IR_JMP, NULL, NULL, call->tok);
+  jmp->bb1 = bb_map[0];
+  append(bb, jmp);
+
+  // Copy the callee's blocks.
+  BB *last = bb;
+  for (BB *b = callee->bbs; b; b = b->next) {
+    BB *copy = bb_map[b->index];
+
+    for (IR *ir = b->ir; ir; ir = ir->next) {
+      if (ir->op == IR_PARAM) {
+        Reg *r0 = map_reg(ir->r0);
+        if (ir->imm < call->nargs)
+          append(copy, new_insn(IR_MOV, r0, call->args[ir->imm], ir->tok));
+        else
+          append(copy, new_insn(IR_IMM, r0, NULL, ir->tok));
+        continue;
+      }
+
+      if (ir->op == IR_RET) {
+        if (call->r0 && ir->r1) {
+          append(copy, new_insn(IR_MOV, call->r0, map_reg(ir->r1), ir->tok));
+        } else if (call->r0) {
+          // The value is unspecified, but the register must be set.
+          append(copy, new_insn(IR_IMM, call->r0, NULL, ir->tok));
+        }
+        IR *jmp = new_insn(IR_JMP, NULL, NULL, ir->tok);
+        jmp->bb1 = cont;
+        append(copy, jmp);
+        continue;
+      }
+
+      IR *ir2 = calloc(1, sizeof(IR));
+      *ir2 = *ir;
+      ir2->next = NULL;
+      ir2->r0 = map_reg(ir->r0);
+      ir2->r1 = map_reg(ir->r1);
+      ir2->r2 = map_reg(ir->r2);
+      ir2->var = map_var(ir->var);
+      if (ir->bb1)
+        ir2->bb1 = bb_map[ir->bb1->index];
+      if (ir->bb2)
+        ir2->bb2 = bb_map[ir->bb2->index];
+      if (ir->nargs) {
+        ir2->args = calloc(ir->nargs, sizeof(Reg *));
+        for (int i = 0; i < ir->nargs; i++)
+          ir2->args[i] = map_reg(ir->args[i]);
+      }
+      append(copy, ir2);
+    }
+
+    copy->next = last->next;
+    last->next = copy;
+    last = copy;
+  }
+
+  cont->next = last->next;
+  last->next = cont;
+}
+
+static void inline_fn(Obj *prog, Obj *fn) {
+  nregs = num_regs(fn);
+
+  // Collect the call sites first, so that calls copied from an
+  // inlined body are not inlined again.
+  int ncalls = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    for (IR *ir = bb->ir; ir; ir = ir->next)
+      if (ir->op == IR_CALL)
+        ncalls++;
+
+  IR **calls = calloc(ncalls, sizeof(IR *));
+  ncalls = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    for (IR *ir = bb->ir; ir; ir = ir->next)
+      if (ir->op == IR_CALL)
+        calls[ncalls++] = ir;
+
+  for (int i = 0; i < ncalls; i++) {
+    Obj *callee = find_function(prog, calls[i]->funcname);
+    if (!callee || callee == fn)
+      continue;
+
+    // Find the block containing the call.
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      IR *prev = NULL;
+      IR *ir = bb->ir;
+      while (ir && ir != calls[i]) {
+        prev = ir;
+        ir = ir->next;
+      }
+      if (!ir)
+        continue;
+
+      int limit = opt_inline_limit;
+      if (bb->count == 0)
+        limit = 0;
+      else if (is_hot_count(bb->count))
+        limit *= 4;
+      if (count_insns(callee) > limit)
+        break;
+
+      inline_call(fn, bb, prev, ir, callee);
+      opt_info(ir->tok, "inlined %s into %s", callee->name, fn->name);
+      break;
+    }
+  }
+}
+
+void inline_functions(Obj *prog) {
+  // With -finstrument-functions, the hooks are called by the prologue
+  // and epilogue, so an inlined function would be missing from traces.
+  if (opt_inline_limit <= 0 || opt_finstrument_functions)
+    return;
+
+  // `prog` lists functions in reverse order of definition.
+  int n = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    n++;
+  Obj **fns = calloc(n, sizeof(Obj *));
+  n = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    fns[n++] = fn;
+
+  for (int i = n - 1; i >= 0; i--)
+    if (fns[i]->is_function && fns[i]->is_definition)
+      inline_fn(prog, fns[i]);
+}
@@ -0,0 +1,966 @@
+// This file lowers the AST to a three-address intermediate
+// representation.
+//
+// Each function becomes a list of basic blocks. A basic block is a
+// straight-line sequence of instructions that ends with exactly one
+// branch or return. Instructions read and write an unlimited number
+// of virtual registers; it is the backend's job to map them to real
+// machine registers or stack slots.
+//
+// Every virtual register created by this file is assigned exactly
+// once, so the IR is in SSA form as long as we don't have to merge
+// values at join points. The exceptions are the pointers that replace
+// array indexing by induction variables (see iv.c) and the counters
+// and pointers of vectorized loops (see vectorize.c), which are
+// advanced at the end of each loop iteration. Local variables still
+// live in memory and are accessed through IR_LVAR, IR_LOAD and
+// IR_STORE, until mem2reg.c promotes the scalar ones to registers.
+//
+// For profile-guided optimization, each function has counters for
+// its entry, the two arms of each `if` and the body of each `for`,
+// numbered in the order we lower them. With -fprofile-generate, the
+// code increments the counters as it runs. With -fprofile-use, we
+// look up their counts in the profile and derive the execution count
+// of every block from them.
+
+#include "sodium.h"
+
+static Obj *current_fn;
+static BB *last_bb; // The last block of the current function
+static BB *out;
+static int nreg;
+
+// The profile of the current function and the execution count of the
+// code being lowered, which is -1 if it is unknown
+static Profile *profile;
+static int64_t cur_count;
+
+static Reg *gen_expr(Node *node);
+static Reg *gen_addr(Node *node);
+static void gen_stmt(Node *node);
+
+static int count(void) {
+  static int i = 1;
+  return i++;
+}
+
+BB *new_bb(void) {
+  BB *bb = calloc(1, sizeof(BB));
+  bb->label = count();
+  bb->count = -1;
+  return bb;
+}
+
+// Make `bb` the block that subsequent instructions are appended to.
+// Blocks are laid out in the order they are started.
+static void start_bb(BB *bb) {
+  if (last_bb)
+    last_bb->next = bb;
+  else
+    current_fn->bbs = bb;
+  last_bb = bb;
+  out = bb;
+  bb->count = cur_count;
+}
+
+static void set_count(int64_t count) {
+  cur_count = out->count = count;
+}
+
+static int64_t add_counts(int64_t a, int64_t b) {
+  return (a < 0 || b < 0) ? -1 : a + b;
+}
+
+static Reg *new_reg(void) {
+  Reg *r = calloc(1, sizeof(Reg));
+  r->vn = nreg++;
+  r->rn = -1;
+  return r;
+}
+
+bool is_terminator(IR *ir) {
+  return ir->op == IR_JMP || ir->op == IR_BR || ir->op == IR_CBR ||
+         ir->op == IR_RET || ir->op == IR_TAILCALL;
+}
+
+// Returns one more than the largest virtual register number used in
+// a given function.
+int num_regs(Obj *fn) {
+  int n = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    for (IR *ir = bb->ir; ir; ir = ir->next)
+      if (ir->r0 && n <= ir->r0->vn)
+        n = ir->r0->vn + 1;
+  return n;
+}
+
+// Stores the virtual registers read by a given instruction to `buf`
+// and returns the number of them. `buf` must have room for
+// ir->nargs + 4 registers.
+int ir_uses(IR *ir, Reg **buf) {
+  int n = 0;
+  if (ir->r1)
+    buf[n++] = ir->r1;
+  if (ir->r2)
+    buf[n++] = ir->r2;
+  if (ir->mem && ir->mem->base)
+    buf[n++] = ir->mem->base;
+  if (ir->mem && ir->mem->index)
+    buf[n++] = ir->mem->index;
+  for (int i = 0; i < ir->nargs; i++)
+    if (ir->args[i])
+      buf[n++] = ir->args[i];
+  return n;
+}
+
+static IR *emit(IROp op, Reg *r0, Reg *r1, Reg *r2, Token *tok) {
+  IR *ir = calloc(1, sizeof(IR));
+  ir->op = op;
+  ir->r0 = r0;
+  ir->r1 = r1;
+  ir->r2 = r2;
+  ir->size = 8;
+  ir->tok = tok;
+
+  if (out->last)
+    out->last = out->last->next = ir;
+  else
+    out->ir = out->last = ir;
+  return ir;
+}
+
+static Reg *emit_imm(int64_t val, Token *tok) {
+  Reg *r = new_reg();
+  emit(IR_IMM, r, NULL, NULL, tok)->imm = val;
+  return r;
+}
+
+static void emit_jmp(BB *bb, Token *tok) {
+  emit(IR_JMP, NULL, NULL, NULL, tok)->bb1 = bb;
+}
+
+static void emit_br(Reg *cond, BB *then, BB *els, Token *tok) {
+  IR *ir = emit(IR_BR, NULL, cond, NULL, tok);
+  ir->bb1 = then;
+  ir->bb2 = els;
+}
+
+// Arithmetic is done in 64 bits if the left-hand side is a long or
+// a pointer and in 32 bits otherwise.
+static int op_size(Type *ty) {
+  return (ty->kind == TY_LONG || ty->base) ? 8 : 4;
+}
+
+// Load a value of a given type from an address.
+static Reg *load(Reg *addr, Type *ty, Token *tok) {
+  if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
+    // If it is an array, do not attempt to load a value to the
+    // register because in general we can't load an entire array to a
+    // register. As a result, the result of an evaluation of an array
+    // becomes not the array itself but the address of the array.
+    // This is where "array is automatically converted to a pointer to
+    // the first element of the array in C" occurs.
+    return addr;
+  }
+
+  Reg *r = new_reg();
+  emit(IR_LOAD, r, addr, NULL, tok)->size = ty->size;
+  return r;
+}
+
+// Store a value of a given type to an address.
+static void store(Reg *addr, Reg *val, Type *ty, Token *tok) {
+  if (ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
+    emit(IR_MEMCPY, NULL, addr, val, tok)->size = ty->size;
+    return;
+  }
+  emit(IR_STORE, NULL, addr, val, tok)->size = ty->size;
+}
+
+// Allocate the next counter of the current function for the code
+// that follows. Returns its count in the profile, or -1 if unknown.
+static int64_t counter(Token *tok) {
+  int i = current_fn->ncounters++;
+
+  if (opt_profile_generate) {
+    Reg *base = new_reg();
+    emit(IR_GVAR, base, NULL, NULL, tok)->var = current_fn->counters;
+    Reg *addr = new_reg();
+    emit(IR_ADD, addr, base, emit_imm(i * 8, tok), tok);
+    Reg *r = new_reg();
+    emit(IR_ADD, r, load(addr, ty_long, tok), emit_imm(1, tok), tok);
+    store(addr, r, ty_long, tok);
+  }
+
+  if (profile && i < profile->n)
+    return profile->counts[i];
+  return -1;
+}
+
+enum { I8, I16, I32, I64 };
+
+static int getTypeId(Type *ty) {
+  switch (ty->kind) {
+  case TY_CHAR:
+    return I8;
+  case TY_SHORT:
+    return I16;
+  case TY_INT:
+    return I32;
+  }
+  return I64;
+}
+
+// The number of bytes to sign-extend from when converting between
+// two integer types, or 0 if no conversion is needed.
+static int cast_table[][4] = {
+  {0, 0, 0, 4}, // i8
+  {1, 0, 0, 4}, // i16
+  {1, 2, 0, 4}, // i32
+  {1, 2, 0, 0}, // i64
+};
+
+static Reg *cast(Reg *r, Type *from, Type *to, Token *tok) {
+  if (to->kind == TY_VOID)
+    return r;
+
+  int sz = cast_table[getTypeId(from)][getTypeId(to)];
+  if (!sz)
+    return r;
+
+  Reg *r0 = new_reg();
+  emit(IR_SEXT, r0, r, NULL, tok)->size = sz;
+  return r0;
+}
+
+// Compute the absolute address of a given node.
+// It's an error if a given node does not reside in memory.
+static Reg *gen_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR: {
+    Reg *r = new_reg();
+    IR *ir = emit(node->var->is_local ? IR_LVAR : IR_GVAR, r, NULL, NULL, node->tok);
+    ir->var = node->var;
+    return r;
+  }
+  case ND_DEREF:
+    return gen_expr(node->lhs);
+  case ND_COMMA:
+    gen_expr(node->lhs);
+    return gen_addr(node->rhs);
+  case ND_MEMBER: {
+    Reg *base = gen_addr(node->lhs);
+    Reg *off = emit_imm(node->member->offset, node->tok);
+    Reg *r = new_reg();
+    emit(IR_ADD, r, base, off, node->tok);
+    return r;
+  }
+  }
+
+  error_tok(node->tok, "not an lvalue");
+}
+
+static Reg *gen_binary(IROp op, Node *node) {
+  Reg *lhs = gen_expr(node->lhs);
+  Reg *rhs = gen_expr(node->rhs);
+  Reg *r = new_reg();
+  emit(op, r, lhs, rhs, node->tok)->size = op_size(node->lhs->ty);
+  return r;
+}
+
+// Generate code for a given node.
+static Reg *gen_expr(Node *node) {
+  if (node->ivptr && node->ivptr->reg)
+    return node->ivptr->reg;
+
+  switch (node->kind) {
+  case ND_NUM:
+    return emit_imm(node->val, node->tok);
+  case ND_NEG: {
+    Reg *r = new_reg();
+    emit(IR_NEG, r, gen_expr(node->lhs), NULL, node->tok);
+    return r;
+  }
+  case ND_VAR:
+  case ND_MEMBER:
+    return load(gen_addr(node), node->ty, node->tok);
+  case ND_DEREF:
+    return load(gen_expr(node->lhs), node->ty, node->tok);
+  case ND_ADDR:
+    return gen_addr(node->lhs);
+  case ND_ASSIGN: {
+    Reg *addr = gen_addr(node->lhs);
+    Reg *val = gen_expr(node->rhs);
+    store(addr, val, node->ty, node->tok);
+    return val;
+  }
+  case ND_STMT_EXPR: {
+    // The value of a statement expression is the value of its last
+    // statement, which must be an expression statement.
+    Node *n = node->body;
+    while (n && n->next)
+      n = n->next;
+    if (!n || n->kind != ND_EXPR_STMT)
+      error_tok(node->tok, "statement expression returning void is not supported");
+
+    for (n = node->body; n->next; n = n->next)
+      gen_stmt(n);
+    return gen_expr(n->lhs);
+  }
+  case ND_COMMA:
+    gen_expr(node->lhs);
+    return gen_expr(node->rhs);
+  case ND_CAST:
+    return cast(gen_expr(node->lhs), node->lhs->ty, node->ty, node->tok);
+  case ND_FUNCALL: {
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      nargs++;
+
+    Reg **args = calloc(nargs, sizeof(Reg *));
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      args[i++] = gen_expr(arg);
+
+    Reg *r = new_reg();
+    IR *ir = emit(IR_CALL, r, NULL, NULL, node->tok);
+    ir->funcname = node->funcname;
+    ir->args = args;
+    ir->nargs = nargs;
+
+    // A function declared without a parameter list may be variadic.
+    Type *ty = node->func_ty;
+    ir->is_variadic = !ty || !ty->params || ty->is_variadic;
+
+    // The ABI leaves the bits above a char or short return value
+    // undefined.
+    if (is_integer(node->ty) && node->ty->size < 4) {
+      Reg *r0 = new_reg();
+      emit(IR_SEXT, r0, r, NULL, node->tok)->size = node->ty->size;
+      return r0;
+    }
+    return r;
+  }
+  case ND_ADD:
+    return gen_binary(IR_ADD, node);
+  case ND_SUB:
+    return gen_binary(IR_SUB, node);
+  case ND_MUL:
+    return gen_binary(IR_MUL, node);
+  case ND_DIV:
+    return gen_binary(IR_DIV, node);
+  case ND_EQ:
+    return gen_binary(IR_EQ, node);
+  case ND_NE:
+    return gen_binary(IR_NE, node);
+  case ND_LT:
+    return gen_binary(IR_LT, node);
+  case ND_LE:
+    return gen_binary(IR_LE, node);
+  }
+
+  error_tok(node->tok, "invalid expression");
+}
+
+//
+// Vectorized loops
+//
+
+static LoopVec *vec;
+static int next_xmm;
+
+static IR *emit_vec(IROp op, int x1, int x2, Token *tok) {
+  IR *ir = emit(op, NULL, NULL, NULL, tok);
+  ir->size = vec->lane;
+  ir->x0 = next_xmm++;
+  ir->x1 = x1;
+  ir->x2 = x2;
+  return ir;
+}
+
+// Compute the lanes of `node` into a new vector register, except for
+// loop-invariant values, which are already in one.
+static int gen_vec_expr(Node *node) {
+  VecSplat *splat = find_splat(vec, node);
+  if (splat)
+    return splat->xmm;
+
+  switch (node->kind) {
+  case ND_DEREF: {
+    VecArray *a = find_array(vec, node);
+    IR *ir = emit_vec(IR_VLOAD, 0, 0, node->tok);
+    ir->r1 = a->reg;
+    ir->imm = a->size;
+    return ir->x0;
+  }
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL: {
+    int x = gen_vec_expr(node->lhs);
+    int y = gen_vec_expr(node->rhs);
+    IROp op = (node->kind == ND_ADD) ? IR_VADD :
+              (node->kind == ND_SUB) ? IR_VSUB : IR_VMUL;
+    return emit_vec(op, x, y, node->tok)->x0;
+  }
+  case ND_NEG: {
+    int x = gen_vec_expr(node->lhs);
+    int zero = emit_vec(IR_VZERO, 0, 0, node->tok)->x0;
+    return emit_vec(IR_VSUB, zero, x, node->tok)->x0;
+  }
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    // A comparison gives -1 in the lanes where it is true. x < y is
+    // y > x, and x != y and x <= y are computed by negating x == y
+    // and x > y.
+    int x = gen_vec_expr(node->lhs);
+    int y = gen_vec_expr(node->rhs);
+    int mask;
+    if (node->kind == ND_EQ || node->kind == ND_NE)
+      mask = emit_vec(IR_VEQ, x, y, node->tok)->x0;
+    else if (node->kind == ND_LT)
+      mask = emit_vec(IR_VGT, y, x, node->tok)->x0;
+    else
+      mask = emit_vec(IR_VGT, x, y, node->tok)->x0;
+
+    int zero = emit_vec(IR_VZERO, 0, 0, node->tok)->x0;
+    if (node->kind == ND_NE || node->kind == ND_LE)
+      mask = emit_vec(IR_VEQ, mask, zero, node->tok)->x0;
+    return emit_vec(IR_VSUB, zero, mask, node->tok)->x0;
+  }
+  case ND_CAST:
+    return gen_vec_expr(node->lhs);
+  }
+  unreachable();
+}
+
+// Branch to `skip` if a stored array may overlap another one in the
+// `n` iterations from the current elements on.
+static void gen_alias_check(VecCheck *c, Reg *n, BB *skip, Token *tok) {
+  VecArray *arrays[] = {c->x, c->y};
+  Reg *start[2];
+  Reg *end[2];
+  for (int i = 0; i < 2; i++) {
+    Reg *len = new_reg();
+    emit(IR_MUL, len, n, emit_imm(arrays[i]->size, tok), tok);
+    start[i] = arrays[i]->reg;
+    end[i] = new_reg();
+    emit(IR_ADD, end[i], start[i], len, tok);
+  }
+
+  BB *ok = new_bb();
+
+  // Arrays whose elements are at the same address in each iteration
+  // are accessed in the same order as in the original loop.
+  if (c->x->size == c->y->size) {
+    BB *next = new_bb();
+    Reg *r = new_reg();
+    emit(IR_EQ, r, start[0], start[1], tok);
+    emit_br(r, ok, next, tok);
+    start_bb(next);
+  }
+
+  BB *next = new_bb();
+  Reg *r = new_reg();
+  emit(IR_LE, r, end[0], start[1], tok);
+  emit_br(r, ok, next, tok);
+
+  start_bb(next);
+  r = new_reg();
+  emit(IR_LE, r, end[1], start[0], tok);
+  emit_br(r, ok, skip, tok);
+
+  start_bb(ok);
+}
+
+// Emit a loop that runs the iterations of the `for` loop `node`
+// 16 / vec->lane at a time while that many are left. The original
+// loop, whose init has already been emitted, runs the rest.
+static void gen_vector_loop(Node *node) {
+  Token *tok = node->tok;
+  int lanes = 16 / vec->lane;
+
+  // The counter and the bound, in 64 bits so that i + lanes can't
+  // overflow.
+  Reg *i = new_reg();
+  emit(IR_MOV, i, gen_expr(vec->counter), NULL, tok);
+  Reg *end = gen_expr(vec->bound);
+  if (vec->inclusive) {
+    Reg *r = new_reg();
+    emit(IR_ADD, r, end, emit_imm(1, tok), tok);
+    end = r;
+  }
+  Reg *limit = new_reg();
+  emit(IR_SUB, limit, end, emit_imm(lanes, tok), tok);
+
+  for (VecArray *a = vec->arrays; a; a = a->next) {
+    Reg *off = new_reg();
+    emit(IR_MUL, off, i, emit_imm(a->size, tok), tok);
+    Reg *r = new_reg();
+    emit(IR_ADD, r, gen_expr(a->base), off, tok);
+    a->reg = new_reg();
+    emit(IR_MOV, a->reg, r, NULL, tok);
+  }
+
+  next_xmm = 1;
+  for (int k = 0; k < vec->nsums; k++)
+    emit_vec(IR_VZERO, 0, 0, tok);
+
+  for (VecSplat *s = vec->splats; s; s = s->next) {
+    IR *ir = emit(IR_VSPLAT, NULL, gen_expr(s->node), NULL, tok);
+    ir->size = vec->lane;
+    ir->x0 = s->xmm;
+  }
+  int temps = 1 + vec->nsums;
+  for (VecSplat *s = vec->splats; s; s = s->next)
+    temps++;
+
+  BB *cond = new_bb();
+  BB *body = new_bb();
+  BB *exit = new_bb();
+
+  if (vec->checks) {
+    Reg *n = new_reg();
+    emit(IR_SUB, n, end, i, tok);
+    for (VecCheck *c = vec->checks; c; c = c->next)
+      gen_alias_check(c, n, exit, tok);
+  }
+  emit_jmp(cond, tok);
+
+  start_bb(cond);
+  Reg *r = new_reg();
+  emit(IR_LE, r, i, limit, tok);
+  emit_br(r, body, exit, tok);
+
+  start_bb(body);
+  int acc = 1;
+  for (int k = 0; k < vec->nstmts; k++) {
+    Node *assign = vec->stmts[k]->lhs;
+    next_xmm = temps;
+
+    if (assign->lhs->kind == ND_VAR) {
+      int x = gen_vec_expr(assign->rhs->rhs);
+      IR *ir = emit(IR_VADD, NULL, NULL, NULL, assign->tok);
+      ir->size = 4;
+      ir->x0 = ir->x1 = acc++;
+      ir->x2 = x;
+    } else {
+      int x = gen_vec_expr(assign->rhs);
+      IR *ir = emit(IR_VSTORE, NULL, find_array(vec, assign->lhs)->reg, NULL, assign->tok);
+      ir->size = vec->lane;
+      ir->x1 = x;
+    }
+  }
+
+  for (VecArray *a = vec->arrays; a; a = a->next)
+    emit(IR_ADD, a->reg, a->reg, emit_imm(lanes * a->size, tok), tok);
+  emit(IR_ADD, i, i, emit_imm(lanes, tok), tok);
+  emit_jmp(cond, tok);
+
+  // Add up the lanes of the sums and continue where we left off.
+  start_bb(exit);
+  acc = 1;
+  for (int k = 0; k < vec->nstmts; k++) {
+    Node *sum = vec->stmts[k]->lhs->lhs;
+    if (sum->kind != ND_VAR)
+      continue;
+
+    Reg *t = new_reg();
+    IR *ir = emit(IR_VHSUM, t, NULL, NULL, tok);
+    ir->size = 4;
+    ir->x1 = acc++;
+
+    Reg *r = new_reg();
+    emit(IR_ADD, r, gen_expr(sum), t, tok)->size = 4;
+    store(gen_addr(sum), r, sum->ty, tok);
+  }
+  store(gen_addr(vec->counter), i, vec->counter->ty, tok);
+}
+
+static void gen_stmt(Node *node) {
+  switch (node->kind) {
+  case ND_IF: {
+    BB *then = new_bb();
+    BB *els = new_bb();
+    BB *end = new_bb();
+
+    emit_br(gen_expr(node->cond), then, els, node->tok);
+
+    start_bb(then);
+    set_count(counter(node->tok));
+    gen_stmt(node->then);
+    emit_jmp(end, node->tok);
+    int64_t then_count = cur_count;
+
+    start_bb(els);
+    set_count(counter(node->tok));
+    if (node->els)
+      gen_stmt(node->els);
+    emit_jmp(end, node->tok);
+
+    start_bb(end);
+    set_count(add_counts(then_count, cur_count));
+    return;
+  }
+  case ND_FOR: {
+    BB *cond = new_bb();
+    BB *body = new_bb();
+    BB *brk = new_bb();
+    int64_t entry_count = cur_count;
+
+    if (node->init)
+      gen_stmt(node->init);
+
+    // Run as many iterations as possible four to sixteen at a time
+    // with SSE2.
+    vec = vectorize(current_fn->body, node);
+    if (vec)
+      gen_vector_loop(node);
+
+    // Compute addresses derived from induction variables before the
+    // loop, and maybe the value to compare them against on exit.
+    LoopIV *liv = find_ivs(current_fn->body, node);
+    Reg *end = NULL;
+    if (liv) {
+      for (IVPtr *p = liv->ptrs; p; p = p->next) {
+        Reg *r = gen_expr(p->addr);
+        p->reg = new_reg();
+        emit(IR_MOV, p->reg, r, NULL, node->tok);
+      }
+
+      if (liv->bound) {
+        Node *bound = liv->bound;
+        int64_t size = liv->ptrs->size;
+        Reg *off;
+        if (bound->kind == ND_NUM) {
+          off = emit_imm(bound->val * size, node->tok);
+        } else {
+          off = new_reg();
+          emit(IR_MUL, off, gen_expr(bound), emit_imm(size, node->tok), node->tok);
+        }
+        end = new_reg();
+        emit(IR_ADD, end, gen_expr(liv->ptrs->base), off, node->tok);
+      }
+    }
+    emit_jmp(cond, node->tok);
+
+    start_bb(cond);
+    if (end) {
+      Reg *r = new_reg();
+      emit(liv->inclusive ? IR_LE : IR_LT, r, liv->ptrs->reg, end, node->tok);
+      emit_br(r, body, brk, node->tok);
+    } else if (node->cond) {
+      emit_br(gen_expr(node->cond), body, brk, node->tok);
+    } else {
+      emit_jmp(body, node->tok);
+    }
+
+    // The body runs once per back edge.
+    start_bb(body);
+    set_count(counter(node->tok));
+    cond->count = add_counts(entry_count, body->count);
+    gen_stmt(node->then);
+    if (node->inc && !end)
+      gen_expr(node->inc);
+    for (IVPtr *p = liv ? liv->ptrs : NULL; p; p = p->next)
+      emit(IR_ADD, p->reg, p->reg, emit_imm(p->step, node->tok), node->tok);
+    emit_jmp(cond, node->tok);
+
+    start_bb(brk);
+    set_count(entry_count);
+    return;
+  }
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      gen_stmt(n);
+    return;
+  case ND_RETURN:
+    emit(IR_RET, NULL, gen_expr(node->lhs), NULL, node->tok);
+
+    // Anything that follows a return is unreachable, but it still
+    // needs a block to live in.
+    start_bb(new_bb());
+    set_count(cur_count < 0 ? -1 : 0);
+    return;
+  case ND_EXPR_STMT:
+    gen_expr(node->lhs);
+    return;
+  }
+
+  error_tok(node->tok, "invalid statement");
+}
+
+static void gen_fn(Obj *fn) {
+  current_fn = fn;
+  last_bb = NULL;
+  nreg = 1;
+  profile = opt_profile_use ? find_profile(fn->name) : NULL;
+  cur_count = -1;
+  if (opt_profile_generate) {
+    fn->counters = calloc(1, sizeof(Obj));
+    fn->counters->name = format("__sodium_prof.%s", fn->name);
+    fn->counters->is_static = true;
+  }
+  start_bb(new_bb());
+
+  // Receive all incoming arguments before anything else can
+  // clobber the argument registers, then spill them to the stack.
+  int nparams = 0;
+  for (Obj *var = fn->params; var; var = var->next)
+    nparams++;
+
+  Reg **params = calloc(nparams, sizeof(Reg *));
+  for (int i = 0; i < nparams; i++) {
+    params[i] = new_reg();
+    emit(IR_PARAM, params[i], NULL, NULL, fn->body->tok)->imm = i;
+  }
+
+  set_count(counter(fn->body->tok));
+
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next) {
+    Reg *addr = new_reg();
+    emit(IR_LVAR, addr, NULL, NULL, fn->body->tok)->var = var;
+    store(addr, params[i++], var->ty, fn->body->tok);
+  }
+
+  gen_stmt(fn->body);
+
+  // Falling off the end of a function returns an unspecified value.
+  if (!out->last || !is_terminator(out->last))
+    emit(IR_RET, NULL, NULL, NULL, fn->body->tok);
+
+  if (fn->counters)
+    fn->counters->ty = array_of(ty_long, fn->ncounters);
+
+  if (profile && profile->n != fn->ncounters)
+    error_tok(fn->body->tok, "profile of %s doesn't match the source; "
+              "delete %s and run the program again", fn->name, opt_profile_use);
+
+  // Align functions that contain hot code.
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    if (is_hot_count(bb->count))
+      fn->is_hot = true;
+}
+
+void gen_ir(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      gen_fn(fn);
+
+  if (opt_profile_generate)
+    gen_profile_dump(prog);
+}
+
+//
+// IR dump
+//
+
+static FILE *dump_file;
+
+static void dump(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(dump_file, fmt, ap);
+  va_end(ap);
+}
+
+static char *op_name[] = {
+  [IR_IMM] = "imm",     [IR_MOV] = "mov",       [IR_ADD] = "add",
+  [IR_SUB] = "sub",     [IR_MUL] = "mul",       [IR_DIV] = "div",
+  [IR_MULH] = "mulh",   [IR_SHL] = "shl",       [IR_SHR] = "shr",
+  [IR_SAR] = "sar",
+  [IR_NEG] = "neg",     [IR_EQ] = "eq",         [IR_NE] = "ne",
+  [IR_LT] = "lt",       [IR_LE] = "le",         [IR_SEXT] = "sext",
+  [IR_LVAR] = "lvar",   [IR_GVAR] = "gvar",     [IR_LEA] = "lea",
+  [IR_LOAD] = "load",
+  [IR_STORE] = "store", [IR_MEMCPY] = "memcpy", [IR_VZERO] = "vzero",
+  [IR_VSPLAT] = "vsplat", [IR_VLOAD] = "vload",   [IR_VSTORE] = "vstore",
+  [IR_VADD] = "vadd",   [IR_VSUB] = "vsub",     [IR_VMUL] = "vmul",
+  [IR_VEQ] = "veq",     [IR_VGT] = "vgt",       [IR_VHSUM] = "vhsum",
+  [IR_PARAM] = "param",
+  [IR_CALL] = "call",   [IR_TAILCALL] = "tailcall",
+  [IR_JMP] = "jmp",     [IR_BR] = "br",         [IR_CBR] = "br",
+  [IR_RET] = "ret",
+};
+
+static void dump_mem(Mem *m) {
+  dump("[");
+  if (m->base)
+    dump("v%d", m->base->vn);
+  else if (m->var)
+    dump("%s", m->var->name);
+  if (m->index)
+    dump("+v%d*%d", m->index->vn, m->scale);
+  if (m->disp)
+    dump("%+d", m->disp);
+  dump("]");
+}
+
+// Dump the second operand of a binary operation.
+static void dump_rhs(IR *ir) {
+  if (ir->r2)
+    dump("v%d", ir->r2->vn);
+  else if (ir->mem)
+    dump_mem(ir->mem);
+  else
+    dump("$%ld", ir->imm);
+}
+
+static void dump_arg(IR *ir, int i) {
+  IR *arg = ir->arg_insns ? ir->arg_insns[i] : NULL;
+  if (!arg) {
+    dump("v%d", ir->args[i]->vn);
+    return;
+  }
+
+  switch (arg->op) {
+  case IR_IMM:
+    dump("$%ld", arg->imm);
+    return;
+  case IR_LVAR:
+  case IR_GVAR:
+    dump("&%s", arg->var->name);
+    return;
+  case IR_LEA:
+    dump("&");
+    dump_mem(arg->mem);
+    return;
+  }
+  dump("load.%d ", arg->size);
+  dump_mem(arg->mem);
+}
+
+static void dump_insn(IR *ir) {
+  dump("  ");
+  if (ir->r0)
+    dump("v%d = ", ir->r0->vn);
+  else if (ir->x0)
+    dump("x%d = ", ir->x0);
+
+  dump("%s", op_name[ir->op]);
+
+  switch (ir->op) {
+  case IR_IMM:
+  case IR_PARAM:
+    dump(" %ld", ir->imm);
+    break;
+  case IR_LVAR:
+  case IR_GVAR:
+    dump(" %s", ir->var->name);
+    break;
+  case IR_CALL:
+  case IR_TAILCALL:
+    dump(" %s(", ir->funcname);
+    for (int i = 0; i < ir->nargs; i++) {
+      dump(i ? ", " : "");
+      dump_arg(ir, i);
+    }
+    dump(")");
+    break;
+  case IR_JMP:
+    dump(" .L%d", ir->bb1->label);
+    break;
+  case IR_BR:
+    dump(" v%d, .L%d, .L%d", ir->r1->vn, ir->bb1->label, ir->bb2->label);
+    break;
+  case IR_CBR:
+    dump(".%s.%d v%d, ", op_name[ir->cond], ir->size, ir->r1->vn);
+    dump_rhs(ir);
+    dump(", .L%d, .L%d", ir->bb1->label, ir->bb2->label);
+    break;
+  case IR_LEA:
+    dump(" ");
+    dump_mem(ir->mem);
+    break;
+  case IR_LOAD:
+    dump(".%d ", ir->size);
+    if (ir->mem)
+      dump_mem(ir->mem);
+    else
+      dump("v%d", ir->r1->vn);
+    break;
+  case IR_STORE:
+    dump(".%d ", ir->size);
+    if (ir->mem)
+      dump_mem(ir->mem);
+    else
+      dump("v%d", ir->r1->vn);
+    if (ir->r2)
+      dump(", v%d", ir->r2->vn);
+    else
+      dump(", $%ld", ir->imm);
+    break;
+  case IR_VSPLAT:
+    dump(".%d v%d", ir->size, ir->r1->vn);
+    break;
+  case IR_VLOAD:
+    dump(".%d.%ld ", ir->size, ir->imm);
+    if (ir->mem)
+      dump_mem(ir->mem);
+    else
+      dump("v%d", ir->r1->vn);
+    break;
+  case IR_VSTORE:
+    dump(".%d ", ir->size);
+    if (ir->mem)
+      dump_mem(ir->mem);
+    else
+      dump("v%d", ir->r1->vn);
+    dump(", x%d", ir->x1);
+    break;
+  case IR_VADD:
+  case IR_VSUB:
+  case IR_VMUL:
+  case IR_VEQ:
+  case IR_VGT:
+    dump(".%d x%d, x%d", ir->size, ir->x1, ir->x2);
+    break;
+  case IR_VHSUM:
+    dump(" x%d", ir->x1);
+    break;
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_MULH:
+  case IR_SHL:
+  case IR_SHR:
+  case IR_SAR:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+    dump(".%d v%d, ", ir->size, ir->r1->vn);
+    dump_rhs(ir);
+    break;
+  default:
+    if (ir->op != IR_MOV && ir->op != IR_NEG && ir->op != IR_RET)
+      dump(".%d", ir->size);
+    if (ir->r1)
+      dump(" v%d", ir->r1->vn);
+    if (ir->r2)
+      dump(", v%d", ir->r2->vn);
+  }
+  dump("\n");
+}
+
+void dump_ir(Obj *prog, FILE *out) {
+  dump_file = out;
+
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition)
+      continue;
+
+    dump("%s:\n", fn->name);
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      if (bb->count >= 0)
+        dump(".L%d: count=%ld\n", bb->label, bb->count);
+      else
+        dump(".L%d:\n", bb->label);
+      for (IR *ir = bb->ir; ir; ir = ir->next)
+        dump_insn(ir);
+    }
+  }
+}
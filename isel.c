@@ -0,0 +1,452 @@
+// This file implements instruction selection.
+//
+// ir.c lowers every operation to its own instruction, so even `x + 1`
+// materializes the 1 in a register and `a[i]` computes its address
+// with a multiply and an add before loading from it. Here we match
+// such trees of instructions onto the operand forms x86-64 supports
+// directly:
+//
+//  - a constant second operand becomes an immediate (`add $1, %r10`),
+//  - address arithmetic becomes an addressing mode, so that locals,
+//    struct members and array elements are accessed as
+//    `disp(%rbp)`, `disp(base)` or `disp(base,index,scale)`,
+//  - address arithmetic that is not used for a memory access becomes
+//    a single `lea`,
+//  - a load used only as the second operand of an arithmetic
+//    instruction or a comparison becomes a memory operand,
+//  - a comparison used only by the branch right after it is fused
+//    into the branch, so that it becomes a `cmp` and a conditional
+//    jump instead of materializing a boolean and testing it.
+//
+// We only look through registers that are assigned exactly once, so
+// that moving a computation to its use cannot observe a different
+// value. Instructions whose results are no longer used are deleted
+// at the end.
+
+#include "sodium.h"
+
+static IR **defs;
+static int *ndefs;
+static int *nuses;
+
+// Returns the instruction defining `r` if there is exactly one.
+static IR *get_def(Reg *r) {
+  if (!r || ndefs[r->vn] != 1)
+    return NULL;
+  return defs[r->vn];
+}
+
+static bool is_ssa(Reg *r) {
+  return !r || ndefs[r->vn] == 1;
+}
+
+static bool is_imm32(int64_t val) {
+  return val == (int32_t)val;
+}
+
+// Returns true if `r` holds a known constant, which is stored to *val.
+static bool get_imm(Reg *r, int64_t *val) {
+  IR *def = get_def(r);
+  if (!def || def->op != IR_IMM)
+    return false;
+  *val = def->imm;
+  return true;
+}
+
+// Returns true if the second operand of a given instruction is a
+// known constant, which is stored to *val.
+static bool get_rhs_imm(IR *ir, int64_t *val) {
+  if (!ir->r2 && !ir->mem) {
+    *val = ir->imm;
+    return true;
+  }
+  return get_imm(ir->r2, val);
+}
+
+static void match_addr(Reg *r, Mem *m);
+
+// Try to express the value computed by a 64-bit add or subtract as
+// an addressing mode.
+static bool match_add(IR *ir, Mem *m) {
+  if ((ir->op != IR_ADD && ir->op != IR_SUB) || ir->size != 8)
+    return false;
+  if (!is_ssa(ir->r1) || !is_ssa(ir->r2))
+    return false;
+
+  int64_t val;
+  if (get_rhs_imm(ir, &val)) {
+    if (ir->op == IR_SUB)
+      val = -val;
+    if (!is_imm32(m->disp + val))
+      return false;
+    m->disp += val;
+    match_addr(ir->r1, m);
+    return true;
+  }
+
+  if (ir->op != IR_ADD || !ir->r2 || m->index)
+    return false;
+
+  // base + index * scale
+  m->index = ir->r2;
+  m->scale = 1;
+
+  // Array indices are scaled by a shift, see strength.c.
+  IR *def = get_def(ir->r2);
+  if (def && def->op == IR_SHL && is_ssa(def->r1) && get_rhs_imm(def, &val) &&
+      0 <= val && val <= 3) {
+    m->index = def->r1;
+    m->scale = 1 << val;
+  }
+
+  match_addr(ir->r1, m);
+  return true;
+}
+
+// Express the value of `r` as an addressing mode, folding in as much
+// of the computation of `r` as possible.
+static void match_addr(Reg *r, Mem *m) {
+  IR *def = get_def(r);
+
+  if (def) {
+    switch (def->op) {
+    case IR_LVAR:
+      m->var = def->var;
+      return;
+    case IR_GVAR:
+      // %rip-relative addressing cannot have an index register.
+      if (!m->index) {
+        m->var = def->var;
+        return;
+      }
+      break;
+    case IR_LEA: {
+      Mem *m2 = def->mem;
+      if (def->size != 8)
+        break;
+      bool is_global = m2->var && !m2->var->is_local;
+      if (m2->index && m->index)
+        break;
+      if (is_global && m->index)
+        break;
+      if (!is_imm32((int64_t)m->disp + m2->disp))
+        break;
+      m->base = m2->base;
+      m->var = m2->var;
+      if (m2->index) {
+        m->index = m2->index;
+        m->scale = m2->scale;
+      }
+      m->disp += m2->disp;
+      return;
+    }
+    case IR_ADD:
+    case IR_SUB: {
+      Mem m2 = *m;
+      if (match_add(def, &m2)) {
+        *m = m2;
+        return;
+      }
+      break;
+    }
+    }
+  }
+
+  m->base = r;
+}
+
+static Mem *new_mem(void) {
+  return calloc(1, sizeof(Mem));
+}
+
+static bool is_binop(IROp op) {
+  switch (op) {
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_MULH:
+  case IR_SHL:
+  case IR_SHR:
+  case IR_SAR:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+    return true;
+  }
+  return false;
+}
+
+// `idiv` and the one-operand `imul` used for IR_MULH take no
+// immediate operand.
+static bool has_imm_form(IROp op) {
+  return op != IR_DIV && op != IR_MULH;
+}
+
+// A shift count must be an immediate or %cl.
+static bool has_mem_form(IROp op) {
+  return op != IR_MULH && op != IR_SHL && op != IR_SHR && op != IR_SAR;
+}
+
+static bool is_commutative(IROp op) {
+  return op == IR_ADD || op == IR_MUL || op == IR_EQ || op == IR_NE;
+}
+
+static bool writes_memory(IR *ir) {
+  return ir->op == IR_STORE || ir->op == IR_MEMCPY || ir->op == IR_CALL ||
+         ir->op == IR_TAILCALL || ir->op == IR_VSTORE;
+}
+
+// Returns true if a given register holds the result of a load that
+// may be used as a memory operand of an `size`-byte operation at the
+// current position.
+static bool is_foldable_load(Reg *r, int size, int *load_pos, int clobber_pos) {
+  IR *def = get_def(r);
+  if (!def || def->op != IR_LOAD || !def->mem || nuses[r->vn] != 1)
+    return false;
+
+  // The load must happen after the last memory write in this block,
+  // and reading `size` bytes of the loaded location must give the
+  // same bits as the sign-extended value.
+  if (load_pos[r->vn] <= clobber_pos || def->size < size)
+    return false;
+  return is_ssa(def->mem->base) && is_ssa(def->mem->index);
+}
+
+static void select_binop(IR *ir, int *load_pos, int clobber_pos) {
+  int64_t val;
+
+  if (is_commutative(ir->op) && !get_imm(ir->r2, &val) && get_imm(ir->r1, &val)) {
+    Reg *tmp = ir->r1;
+    ir->r1 = ir->r2;
+    ir->r2 = tmp;
+  }
+
+  if (has_imm_form(ir->op) && get_imm(ir->r2, &val) && is_imm32(val)) {
+    ir->r2 = NULL;
+    ir->imm = val;
+    return;
+  }
+
+  if (is_commutative(ir->op) &&
+      !is_foldable_load(ir->r2, ir->size, load_pos, clobber_pos) &&
+      is_foldable_load(ir->r1, ir->size, load_pos, clobber_pos)) {
+    Reg *tmp = ir->r1;
+    ir->r1 = ir->r2;
+    ir->r2 = tmp;
+  }
+
+  if (has_mem_form(ir->op) &&
+      is_foldable_load(ir->r2, ir->size, load_pos, clobber_pos)) {
+    ir->mem = get_def(ir->r2)->mem;
+    ir->r2 = NULL;
+  }
+}
+
+// Returns the instruction computing a call argument if it can be
+// evaluated right into the argument's register or stack slot at the
+// call: a constant, the address of a variable, or a load from a
+// variable that is not clobbered before the call. None of them reads
+// a register.
+static IR *arg_insn(Reg *r, int *load_pos, int clobber_pos) {
+  IR *def = get_def(r);
+  if (!def)
+    return NULL;
+
+  switch (def->op) {
+  case IR_IMM:
+  case IR_LVAR:
+  case IR_GVAR:
+    return def;
+  case IR_LEA:
+    return (def->mem->base || def->mem->index) ? NULL : def;
+  case IR_LOAD:
+    if (!is_foldable_load(r, 1, load_pos, clobber_pos))
+      return NULL;
+    return (def->mem->base || def->mem->index) ? NULL : def;
+  }
+  return NULL;
+}
+
+static void select_args(IR *ir, int *load_pos, int clobber_pos) {
+  for (int i = 0; i < ir->nargs; i++) {
+    IR *arg = arg_insn(ir->args[i], load_pos, clobber_pos);
+    if (!arg)
+      continue;
+    if (!ir->arg_insns)
+      ir->arg_insns = calloc(ir->nargs, sizeof(IR *));
+    ir->arg_insns[i] = arg;
+    ir->args[i] = NULL;
+  }
+}
+
+static void select_insn(IR *ir, int *load_pos, int clobber_pos) {
+  if (ir->op == IR_CALL || ir->op == IR_TAILCALL) {
+    select_args(ir, load_pos, clobber_pos);
+    return;
+  }
+
+  if (ir->op == IR_LOAD || ir->op == IR_STORE || ir->op == IR_VLOAD ||
+      ir->op == IR_VSTORE) {
+    Mem *m = new_mem();
+    match_addr(ir->r1, m);
+    ir->mem = m;
+    ir->r1 = NULL;
+
+    int64_t val;
+    if (ir->op == IR_STORE && get_imm(ir->r2, &val) && is_imm32(val)) {
+      ir->r2 = NULL;
+      ir->imm = val;
+    }
+    return;
+  }
+
+  if (ir->op == IR_ADD || ir->op == IR_SUB) {
+    // Address arithmetic becomes a single lea if that absorbs
+    // a variable address or a scaled index.
+    Mem *m = new_mem();
+    if (match_add(ir, m) && (m->var || m->index)) {
+      ir->op = IR_LEA;
+      ir->mem = m;
+      ir->r1 = ir->r2 = NULL;
+      return;
+    }
+  }
+
+  if (is_binop(ir->op))
+    select_binop(ir, load_pos, clobber_pos);
+}
+
+static bool is_compare(IROp op) {
+  return op == IR_EQ || op == IR_NE || op == IR_LT || op == IR_LE;
+}
+
+// Fuse a comparison into the branch `ir` right after it. Since they
+// are adjacent, the operands of the comparison still hold the same
+// values at the branch.
+static void fuse_branch(IR *prev, IR *ir) {
+  if (!prev || ir->op != IR_BR || !is_compare(prev->op) ||
+      prev->r0 != ir->r1 || nuses[ir->r1->vn] != 1 || !is_ssa(ir->r1))
+    return;
+
+  ir->op = IR_CBR;
+  ir->cond = prev->op;
+  ir->size = prev->size;
+  ir->r1 = prev->r1;
+  ir->r2 = prev->r2;
+  ir->imm = prev->imm;
+  ir->mem = prev->mem;
+}
+
+static bool is_pure(IR *ir) {
+  switch (ir->op) {
+  case IR_IMM:
+  case IR_MOV:
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_MULH:
+  case IR_SHL:
+  case IR_SHR:
+  case IR_SAR:
+  case IR_NEG:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+  case IR_SEXT:
+  case IR_LVAR:
+  case IR_GVAR:
+  case IR_LEA:
+  case IR_LOAD:
+    return true;
+  }
+  return false;
+}
+
+// Delete instructions whose results are never used.
+static void delete_dead_insns(Obj *fn) {
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      Reg *buf[ir->nargs + 4];
+      int n = ir_uses(ir, buf);
+      for (int i = 0; i < n; i++)
+        nuses[buf[i]->vn]++;
+    }
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      IR head = {.next = bb->ir};
+      IR *prev = &head;
+
+      for (IR *ir = bb->ir; ir; ir = ir->next) {
+        if (ir->r0 && !nuses[ir->r0->vn] && is_pure(ir)) {
+          Reg *buf[ir->nargs + 4];
+          int n = ir_uses(ir, buf);
+          for (int i = 0; i < n; i++)
+            nuses[buf[i]->vn]--;
+          prev->next = ir->next;
+          changed = true;
+          continue;
+        }
+        prev = ir;
+      }
+
+      bb->ir = head.next;
+      bb->last = prev;
+    }
+  }
+}
+
+static void select_fn(Obj *fn) {
+  int nregs = num_regs(fn);
+  defs = calloc(nregs, sizeof(IR *));
+  ndefs = calloc(nregs, sizeof(int));
+  nuses = calloc(nregs, sizeof(int));
+  int *load_pos = calloc(nregs, sizeof(int));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->r0) {
+        defs[ir->r0->vn] = ir;
+        ndefs[ir->r0->vn]++;
+      }
+
+      Reg *buf[ir->nargs + 4];
+      int n = ir_uses(ir, buf);
+      for (int i = 0; i < n; i++)
+        nuses[buf[i]->vn]++;
+    }
+  }
+
+  // Positions are numbered from 1 within each block so that a load
+  // from an earlier block never looks foldable.
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    int pos = 1;
+    int clobber_pos = 0;
+    memset(load_pos, 0, nregs * sizeof(int));
+
+    IR *prev = NULL;
+    for (IR *ir = bb->ir; ir; prev = ir, ir = ir->next, pos++) {
+      select_insn(ir, load_pos, clobber_pos);
+      fuse_branch(prev, ir);
+      if (ir->op == IR_LOAD)
+        load_pos[ir->r0->vn] = pos;
+      if (writes_memory(ir))
+        clobber_pos = pos;
+    }
+  }
+
+  memset(nuses, 0, nregs * sizeof(int));
+  delete_dead_insns(fn);
+}
+
+void select_insns(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      select_fn(fn);
+}
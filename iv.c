@@ -0,0 +1,286 @@
+// This file finds induction variables of `for` loops and the array
+// addresses computed from them.
+//
+// In a loop like
+//
+//   for (i = 0; i < n; i = i + 1)
+//     sum = sum + a[i];
+//
+// `a[i]` is `*(a + i * 4)`, so every iteration multiplies and adds to
+// compute an address that simply advances by 4 bytes per iteration.
+// We look for a local variable `i` that is only changed by `i = i + c`
+// at the end of each iteration and for addresses `base + i * size`
+// whose `base` doesn't change in the loop. ir.c computes each such
+// address into a register once before the loop and adds `c * size`
+// to the register along with the increment of `i`.
+//
+// If `i` is then used for nothing but the exit test `i < n` or
+// `i <= n` with a loop-invariant `n`, and it is assigned right before
+// the loop and not used after it, the exit test compares the pointer
+// against `base + n * size` instead, and `i` is no longer updated.
+
+#include "sodium.h"
+
+// Each pointer takes up a register for the whole loop.
+#define MAX_PTRS 4
+
+static Node *fn_body;
+static Node *loop;
+
+// The variable the predicates below look for
+static Obj *target;
+
+// Returns the number of nodes in a given tree for which `pred` is true.
+static int count(Node *node, bool (*pred)(Node *)) {
+  if (!node)
+    return 0;
+
+  int n = pred(node);
+  n += count(node->lhs, pred);
+  n += count(node->rhs, pred);
+  n += count(node->cond, pred);
+  n += count(node->then, pred);
+  n += count(node->els, pred);
+  n += count(node->init, pred);
+  n += count(node->inc, pred);
+  for (Node *n2 = node->body; n2; n2 = n2->next)
+    n += count(n2, pred);
+  for (Node *n2 = node->args; n2; n2 = n2->next)
+    n += count(n2, pred);
+  return n;
+}
+
+static bool is_use(Node *node) {
+  return node->kind == ND_VAR && node->var == target;
+}
+
+static bool is_assign(Node *node) {
+  return node->kind == ND_ASSIGN && is_use(node->lhs);
+}
+
+// Returns true if `node` is `&x` or `&x.member`.
+static bool is_addr_of(Node *node) {
+  if (node->kind != ND_ADDR)
+    return false;
+  Node *n = node->lhs;
+  while (n->kind == ND_MEMBER || n->kind == ND_COMMA)
+    n = (n->kind == ND_MEMBER) ? n->lhs : n->rhs;
+  return is_use(n);
+}
+
+// Returns true if `var` may change while the loop runs.
+static bool is_modified(Obj *var) {
+  if (!var->is_local)
+    return true;
+
+  Obj *saved = target;
+  target = var;
+  bool modified = count(fn_body, is_addr_of) || count(loop->cond, is_assign) ||
+                  count(loop->then, is_assign) || count(loop->inc, is_assign);
+  target = saved;
+  return modified;
+}
+
+static bool is_scalar(Type *ty) {
+  return is_integer(ty) || ty->kind == TY_PTR;
+}
+
+static bool is_invariant(Node *node);
+
+// Returns true if the address of an lvalue doesn't change in the loop.
+static bool is_invariant_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    return true;
+  case ND_DEREF:
+    return is_invariant(node->lhs);
+  case ND_MEMBER:
+    return is_invariant_addr(node->lhs);
+  }
+  return false;
+}
+
+static bool is_invariant(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+    return true;
+  case ND_VAR:
+    // The value of an array is its address.
+    if (node->ty->kind == TY_ARRAY)
+      return true;
+    return is_scalar(node->ty) && !is_modified(node->var);
+  case ND_DEREF:
+  case ND_MEMBER:
+    return node->ty->kind == TY_ARRAY && is_invariant_addr(node);
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+    return is_invariant(node->lhs) && is_invariant(node->rhs);
+  case ND_CAST:
+    return is_invariant(node->lhs);
+  }
+  return false;
+}
+
+// If `inc` is `i = i + c` or `i = i - c`, returns `i` and sets *step
+// to c or -c.
+static Obj *match_inc(Node *inc, int64_t *step) {
+  if (inc->kind != ND_ASSIGN || inc->lhs->kind != ND_VAR)
+    return NULL;
+
+  Obj *var = inc->lhs->var;
+  Node *rhs = inc->rhs;
+  if (rhs->kind != ND_ADD && rhs->kind != ND_SUB)
+    return NULL;
+  if (rhs->lhs->kind != ND_VAR || rhs->lhs->var != var ||
+      rhs->rhs->kind != ND_NUM)
+    return NULL;
+
+  *step = (rhs->kind == ND_ADD) ? rhs->rhs->val : -rhs->rhs->val;
+  return var;
+}
+
+static bool same_base(Node *x, Node *y) {
+  return x->kind == ND_VAR && y->kind == ND_VAR && x->var == y->var;
+}
+
+static IVPtr *ptrs;
+static int nptrs;
+static int nderived;
+static int64_t iv_step;
+
+// Find addresses `base + i * size` in a given tree.
+static void find_derived(Node *node) {
+  if (!node)
+    return;
+
+  if (node->kind == ND_ADD && node->lhs->ty->base &&
+      node->rhs->kind == ND_MUL && is_use(node->rhs->lhs) &&
+      node->rhs->rhs->kind == ND_NUM && is_invariant(node->lhs)) {
+    int64_t size = node->rhs->rhs->val;
+
+    IVPtr *ptr = NULL;
+    for (IVPtr *p = ptrs; p; p = p->next)
+      if (same_base(p->base, node->lhs) && p->size == size)
+        ptr = p;
+
+    if (!ptr && nptrs < MAX_PTRS) {
+      ptr = calloc(1, sizeof(IVPtr));
+      ptr->addr = node;
+      ptr->base = node->lhs;
+      ptr->size = size;
+      ptr->step = iv_step * size;
+      ptr->next = ptrs;
+      ptrs = ptr;
+      nptrs++;
+    }
+
+    if (ptr) {
+      node->ivptr = ptr;
+      nderived++;
+      return;
+    }
+  }
+
+  find_derived(node->lhs);
+  find_derived(node->rhs);
+  find_derived(node->cond);
+  find_derived(node->then);
+  find_derived(node->els);
+  find_derived(node->init);
+  find_derived(node->inc);
+  for (Node *n = node->body; n; n = n->next)
+    find_derived(n);
+  for (Node *n = node->args; n; n = n->next)
+    find_derived(n);
+}
+
+// Returns true if the exit test of the loop can compare a pointer
+// derived from `iv` instead of `iv` itself.
+static bool can_rewrite_exit(Obj *iv) {
+  if (!ptrs || iv_step <= 0)
+    return false;
+
+  // `i = ...` right before the loop
+  Node *init = loop->init;
+  if (!init || init->kind != ND_EXPR_STMT || !is_assign(init->lhs) ||
+      count(init->lhs->rhs, is_use))
+    return false;
+
+  // `i < n` or `i <= n`
+  Node *cond = loop->cond;
+  if (!cond || (cond->kind != ND_LT && cond->kind != ND_LE) ||
+      !is_use(cond->lhs))
+    return false;
+
+  Node *bound = cond->rhs;
+  if (bound->kind != ND_NUM &&
+      (bound->kind != ND_VAR || !is_integer(bound->ty) || !is_invariant(bound)))
+    return false;
+
+  // Every use of `i` is one of the above, the increment or a derived
+  // address.
+  target = iv;
+  return count(fn_body, is_use) == 4 + nderived;
+}
+
+// Returns the induction variable of a `for` loop in a function with a
+// given body, and sets *step to its increment.
+Obj *loop_counter(Node *body, Node *node, int64_t *step) {
+  if (!node->inc)
+    return NULL;
+
+  fn_body = body;
+  loop = node;
+
+  Obj *iv = match_inc(node->inc, step);
+  if (!iv || !iv->is_local || !is_integer(iv->ty) || iv->ty->size < 4)
+    return NULL;
+
+  target = iv;
+  if (count(fn_body, is_addr_of) || count(node->cond, is_assign) ||
+      count(node->then, is_assign))
+    return NULL;
+  return iv;
+}
+
+// Returns true if `expr` has the same value in every iteration of
+// a loop.
+bool is_loop_invariant(Node *body, Node *node, Node *expr) {
+  fn_body = body;
+  loop = node;
+  return is_invariant(expr);
+}
+
+// Returns true if the address of a local variable is taken anywhere
+// in a function.
+bool is_addr_taken(Node *body, Obj *var) {
+  target = var;
+  return count(body, is_addr_of);
+}
+
+// Analyze a `for` loop in a function with a given body.
+LoopIV *find_ivs(Node *body, Node *node) {
+  Obj *iv = loop_counter(body, node, &iv_step);
+  if (!iv)
+    return NULL;
+
+  ptrs = NULL;
+  nptrs = 0;
+  nderived = 0;
+  find_derived(node->cond);
+  find_derived(node->then);
+  if (!ptrs)
+    return NULL;
+
+  LoopIV *liv = calloc(1, sizeof(LoopIV));
+  liv->ptrs = ptrs;
+  if (can_rewrite_exit(iv)) {
+    liv->bound = node->cond->rhs;
+    liv->inclusive = (node->cond->kind == ND_LE);
+  }
+
+  opt_info(node->tok, "replaced %d array indexes by %s with pointer increments%s",
+           nderived, iv->name, liv->bound ? " and rewrote the exit test" : "");
+  return liv;
+}
@@ -0,0 +1,607 @@
+// This file moves loop-invariant computations out of loops.
+//
+// A loop is found from a back edge, that is, a jump to a block that
+// dominates the jumping block. The dominating block is the loop
+// header, and the loop consists of the header and every block that
+// can reach the back edge without passing through the header. Each
+// loop gets a preheader, a block that jumps to the header and that
+// every entry into the loop passes through, and we move instructions
+// whose operands don't change within the loop to the end of it. Inner
+// loops are processed first, so that an expression invariant in a
+// whole loop nest moves all the way out.
+//
+// All loops are found up front from one computation of dominators,
+// and a new preheader is added to the loops enclosing it, so that the
+// pass takes time roughly linear in the size of the function even if
+// it has many loops.
+//
+// An instruction is moved only if it assigns the only definition of
+// its destination, so that every use still sees the same value. It
+// may be executed even if the loop body never runs, so it must not
+// trap. This excludes division and most loads. A load is moved only
+// if it reads a variable's own storage, which is always accessible,
+// and nothing in the loop may write to the variable. A store through
+// a pointer of unknown origin or a call may write to any global
+// variable and to any local variable whose address escapes.
+//
+// Constants and addresses of local variables are only copied into
+// the preheader when a moved instruction needs them. Instruction
+// selection folds them into their uses anyway.
+
+#include "sodium.h"
+
+// A register that may hold the address of more than one variable
+static Obj many;
+
+static int nregs;
+static int capacity; // Number of registers the arrays below have room for
+static IR **defs;
+static int *ndefs;
+
+// For each virtual register, the variable whose address it may hold
+// or points into, or `&many`.
+static Obj **var_of;
+
+// A natural loop
+typedef struct Loop Loop;
+struct Loop {
+  BB *header;
+  BB **body; // Blocks of the loop, the header first
+  int size;
+  int capacity;
+  Loop *parent; // The smallest loop enclosing this one
+};
+
+static int nbbs;
+static BB **bbs;
+static BB ***preds;
+static int *npreds;
+static int *post;  // Postorder number of each block, or 0 if unreachable
+static BB **idom;  // Immediate dominator of each block
+static bool *in_loop;
+static int *ndefs_in_loop;
+
+static void *grow(void *p, int size) {
+  p = realloc(p, size * capacity * 2);
+  memset((char *)p + size * capacity, 0, size * capacity);
+  return p;
+}
+
+static Reg *new_reg(void) {
+  // Make room in the per-register arrays for the new register.
+  if (nregs == capacity) {
+    defs = grow(defs, sizeof(IR *));
+    ndefs = grow(ndefs, sizeof(int));
+    var_of = grow(var_of, sizeof(Obj *));
+    ndefs_in_loop = grow(ndefs_in_loop, sizeof(int));
+    capacity *= 2;
+  }
+
+  Reg *r = calloc(1, sizeof(Reg));
+  r->vn = nregs++;
+  r->rn = -1;
+  return r;
+}
+
+static IR *get_def(Reg *r) {
+  return (ndefs[r->vn] == 1) ? defs[r->vn] : NULL;
+}
+
+static bool escapes(Obj *var) {
+  return var == &many || !var->is_local || var->is_escaped;
+}
+
+// Merge `var` into what is known about the address held by `r`.
+// Returns true if that changes.
+static bool merge_var(Reg *r, Obj *var) {
+  Obj *old = var_of[r->vn];
+  if (!var || old == var || old == &many)
+    return false;
+  if (!old) {
+    var_of[r->vn] = var;
+    return true;
+  }
+  // The register may point into either variable, so we can no longer
+  // tell which one a store through it writes to.
+  old->is_escaped = true;
+  if (var != &many)
+    var->is_escaped = true;
+  var_of[r->vn] = &many;
+  return true;
+}
+
+// Track which variable each address points into, and find local
+// variables whose address is stored, passed to a function, returned
+// or otherwise used as a value.
+static void find_escaping_vars(Obj *fn) {
+  for (Obj *var = fn->locals; var; var = var->next)
+    var->is_escaped = false;
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      for (IR *ir = bb->ir; ir; ir = ir->next) {
+        switch (ir->op) {
+        case IR_LVAR:
+        case IR_GVAR:
+          changed |= merge_var(ir->r0, ir->var);
+          break;
+        case IR_MOV:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_LEA: {
+          Reg *buf[4];
+          int n = ir_uses(ir, buf);
+          for (int i = 0; i < n; i++)
+            changed |= merge_var(ir->r0, var_of[buf[i]->vn]);
+          break;
+        }
+        }
+      }
+    }
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      switch (ir->op) {
+      case IR_MOV:
+      case IR_ADD:
+      case IR_SUB:
+      case IR_LEA:
+      case IR_EQ:
+      case IR_NE:
+      case IR_LT:
+      case IR_LE:
+      case IR_LOAD:
+      case IR_MEMCPY:
+      case IR_VLOAD:
+      case IR_VSTORE:
+        continue;
+      case IR_STORE:
+        // Storing to a variable is fine, storing its address is not.
+        if (ir->r2 && var_of[ir->r2->vn] && var_of[ir->r2->vn] != &many)
+          var_of[ir->r2->vn]->is_escaped = true;
+        continue;
+      }
+
+      Reg *buf[ir->nargs + 4];
+      int n = ir_uses(ir, buf);
+      for (int i = 0; i < n; i++) {
+        Obj *var = var_of[buf[i]->vn];
+        if (var && var != &many)
+          var->is_escaped = true;
+      }
+    }
+  }
+}
+
+static void add_pred(BB *bb, BB *pred) {
+  if (!bb)
+    return;
+  int i = bb->index;
+  preds[i] = realloc(preds[i], sizeof(BB *) * (npreds[i] + 1));
+  preds[i][npreds[i]++] = pred;
+}
+
+static void number_blocks(BB *bb, int *n) {
+  post[bb->index] = -1;
+  IR *last = bb->last;
+  if (last->bb1 && !post[last->bb1->index])
+    number_blocks(last->bb1, n);
+  if (last->bb2 && !post[last->bb2->index])
+    number_blocks(last->bb2, n);
+  post[bb->index] = ++*n;
+  bbs[*n - 1] = bb;
+}
+
+static BB *intersect(BB *a, BB *b) {
+  while (a != b) {
+    while (post[a->index] < post[b->index])
+      a = idom[a->index];
+    while (post[b->index] < post[a->index])
+      b = idom[b->index];
+  }
+  return a;
+}
+
+// Compute the predecessors and the immediate dominator of each block.
+// Every loop may get a new block as its preheader, so the arrays have
+// room for twice as many blocks.
+static void build_cfg(Obj *fn) {
+  nbbs = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    bb->index = nbbs++;
+
+  bbs = calloc(nbbs * 2, sizeof(BB *));
+  preds = calloc(nbbs * 2, sizeof(BB **));
+  npreds = calloc(nbbs * 2, sizeof(int));
+  post = calloc(nbbs * 2, sizeof(int));
+  idom = calloc(nbbs * 2, sizeof(BB *));
+  in_loop = calloc(nbbs * 2, sizeof(bool));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    add_pred(bb->last->bb1, bb);
+    if (bb->last->bb2 != bb->last->bb1)
+      add_pred(bb->last->bb2, bb);
+  }
+
+  // `bbs` temporarily holds the reachable blocks in postorder.
+  int n = 0;
+  number_blocks(fn->bbs, &n);
+
+  // Compute dominators with the iterative algorithm of Cooper, Harvey
+  // and Kennedy, visiting blocks in reverse postorder.
+  idom[fn->bbs->index] = fn->bbs;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = n - 2; i >= 0; i--) {
+      BB *bb = bbs[i];
+      BB *new_idom = NULL;
+      for (int j = 0; j < npreds[bb->index]; j++) {
+        BB *pred = preds[bb->index][j];
+        if (idom[pred->index])
+          new_idom = new_idom ? intersect(pred, new_idom) : pred;
+      }
+      if (idom[bb->index] != new_idom) {
+        idom[bb->index] = new_idom;
+        changed = true;
+      }
+    }
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    bbs[bb->index] = bb;
+}
+
+static bool dominates(BB *a, BB *b) {
+  if (!post[b->index])
+    return false;
+  while (b != a && idom[b->index] != b)
+    b = idom[b->index];
+  return b == a;
+}
+
+static void add_block(Loop *loop, BB *bb) {
+  if (loop->size == loop->capacity) {
+    loop->capacity = loop->capacity ? loop->capacity * 2 : 8;
+    loop->body = realloc(loop->body, sizeof(BB *) * loop->capacity);
+  }
+  loop->body[loop->size++] = bb;
+}
+
+// Returns the loop whose back edges jump to `header`, or NULL.
+// The loop consists of the header and the reachable blocks that reach
+// a back edge without passing through the header. Blocks are marked
+// with `id` in `mark` as they are added.
+static Loop *find_loop(BB *header, int *mark, int id) {
+  Loop *loop = NULL;
+  for (int i = 0; i < npreds[header->index]; i++) {
+    BB *pred = preds[header->index][i];
+    if (!dominates(header, pred))
+      continue;
+    if (!loop) {
+      loop = calloc(1, sizeof(Loop));
+      loop->header = header;
+      add_block(loop, header);
+      mark[header->index] = id;
+    }
+    if (mark[pred->index] != id) {
+      add_block(loop, pred);
+      mark[pred->index] = id;
+    }
+  }
+  if (!loop)
+    return NULL;
+
+  for (int i = 1; i < loop->size; i++) {
+    BB *bb = loop->body[i];
+    for (int j = 0; j < npreds[bb->index]; j++) {
+      BB *pred = preds[bb->index][j];
+      if (post[pred->index] && mark[pred->index] != id) {
+        add_block(loop, pred);
+        mark[pred->index] = id;
+      }
+    }
+  }
+  return loop;
+}
+
+static int cmp_size(const void *a, const void *b) {
+  Loop *x = *(Loop **)a;
+  Loop *y = *(Loop **)b;
+  if (x->size != y->size)
+    return x->size - y->size;
+  return x->header->index - y->header->index;
+}
+
+// Find every natural loop of the function and return them from the
+// smallest to the largest, so that inner loops come before the loops
+// enclosing them.
+static Loop **find_loops(int *nloops) {
+  Loop **loops = calloc(nbbs, sizeof(Loop *));
+  int *mark = calloc(nbbs, sizeof(int));
+  int n = 0;
+
+  // The entry block has no place for a preheader, so it is not
+  // taken as a loop header.
+  for (int i = 1; i < nbbs; i++) {
+    Loop *loop = find_loop(bbs[i], mark, n + 1);
+    if (loop)
+      loops[n++] = loop;
+  }
+  qsort(loops, n, sizeof(Loop *), cmp_size);
+
+  // Two natural loops with different headers are either disjoint or
+  // one contains the other, so the smallest loop containing a loop's
+  // header that is larger than the loop is its parent.
+  Loop **innermost = calloc(nbbs, sizeof(Loop *));
+  for (int i = n - 1; i >= 0; i--) {
+    Loop *loop = loops[i];
+    loop->parent = innermost[loop->header->index];
+    for (int j = 0; j < loop->size; j++)
+      innermost[loop->body[j]->index] = loop;
+  }
+
+  *nloops = n;
+  return loops;
+}
+
+// Returns the preheader of a loop, creating one if needed.
+static BB *get_preheader(Obj *fn, Loop *loop) {
+  BB *header = loop->header;
+  int h = header->index;
+
+  // If the only block entering the loop just jumps to the header,
+  // it can serve as the preheader.
+  BB **outside = calloc(npreds[h], sizeof(BB *));
+  BB **inside = calloc(npreds[h] + 1, sizeof(BB *));
+  int nout = 0;
+  int nin = 0;
+  for (int i = 0; i < npreds[h]; i++) {
+    BB *pred = preds[h][i];
+    if (in_loop[pred->index])
+      inside[nin++] = pred;
+    else
+      outside[nout++] = pred;
+  }
+  if (nout == 1 && outside[0]->last->op == IR_JMP)
+    return outside[0];
+
+  BB *pre = new_bb();
+  pre->ir = pre->last = calloc(1, sizeof(IR));
+  pre->ir->op = IR_JMP;
+  pre->ir->bb1 = header;
+  pre->ir->tok = header->ir->tok;
+
+  for (int i = 0; i < nout; i++) {
+    IR *last = outside[i]->last;
+    if (last->bb1 == header)
+      last->bb1 = pre;
+    if (last->bb2 == header)
+      last->bb2 = pre;
+  }
+
+  // Keep the CFG up to date: the preheader takes over the entries
+  // into the loop and becomes part of the loops enclosing this one.
+  pre->index = nbbs++;
+  bbs[pre->index] = pre;
+  preds[pre->index] = outside;
+  npreds[pre->index] = nout;
+  inside[nin++] = pre;
+  preds[h] = inside;
+  npreds[h] = nin;
+  post[pre->index] = post[h];
+  idom[pre->index] = idom[h];
+  idom[h] = pre;
+  for (Loop *outer = loop->parent; outer; outer = outer->parent)
+    add_block(outer, pre);
+
+  // Lay it out right before the header so that its jump falls through.
+  BB *prev = fn->bbs;
+  while (prev->next != header)
+    prev = prev->next;
+  pre->next = header;
+  prev->next = pre;
+  return pre;
+}
+
+// Returns true if `r` holds a constant or the address of a local
+// variable that we can copy to the preheader.
+static bool is_rematerializable(Reg *r) {
+  IR *def = get_def(r);
+  return def && (def->op == IR_IMM || def->op == IR_LVAR);
+}
+
+static bool is_invariant(Reg *r) {
+  return !ndefs_in_loop[r->vn] || is_rematerializable(r);
+}
+
+// Returns the variable whose storage a load from `r` of `size` bytes
+// reads, or NULL if it is not known to read within a variable.
+static Obj *load_var(Reg *r, int size) {
+  int64_t offset = 0;
+  for (;;) {
+    IR *def = get_def(r);
+    if (!def)
+      return NULL;
+    if (def->op == IR_LVAR || def->op == IR_GVAR) {
+      if (offset < 0 || def->var->ty->size < offset + size)
+        return NULL;
+      return def->var;
+    }
+    if (def->op != IR_ADD || !def->r2 || !get_def(def->r2) ||
+        get_def(def->r2)->op != IR_IMM)
+      return NULL;
+    offset += get_def(def->r2)->imm;
+    r = def->r1;
+  }
+}
+
+// Returns true if nothing in the loop may write to `var`.
+static bool is_read_only(Loop *loop, Obj *var) {
+  for (int i = 0; i < loop->size; i++) {
+    for (IR *ir = loop->body[i]->ir; ir; ir = ir->next) {
+      if (ir->op == IR_CALL && escapes(var))
+        return false;
+      if (ir->op != IR_STORE && ir->op != IR_MEMCPY && ir->op != IR_VSTORE)
+        continue;
+      Obj *dest = var_of[ir->r1->vn];
+      if (dest == var || ((!dest || dest == &many) && escapes(var)))
+        return false;
+    }
+  }
+  return true;
+}
+
+static bool can_hoist(Loop *loop, IR *ir) {
+  if (!ir->r0 || ndefs[ir->r0->vn] != 1)
+    return false;
+
+  switch (ir->op) {
+  case IR_MOV:
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_MULH:
+  case IR_SHL:
+  case IR_SHR:
+  case IR_SAR:
+  case IR_NEG:
+  case IR_SEXT:
+  case IR_GVAR:
+  case IR_LEA:
+    break;
+  case IR_LOAD: {
+    Obj *var = load_var(ir->r1, ir->size);
+    if (!var || !is_read_only(loop, var))
+      return false;
+    break;
+  }
+  default:
+    return false;
+  }
+
+  Reg *buf[4];
+  int n = ir_uses(ir, buf);
+  for (int i = 0; i < n; i++)
+    if (!is_invariant(buf[i]))
+      return false;
+  return true;
+}
+
+// Insert `ir` before the jump that ends the preheader.
+static void append(BB *pre, IR *ir) {
+  IR head = {.next = pre->ir};
+  IR *prev = &head;
+  while (prev->next != pre->last)
+    prev = prev->next;
+  ir->next = pre->last;
+  prev->next = ir;
+  pre->ir = head.next;
+}
+
+// Returns a register holding the same value as `r` in the preheader.
+static Reg *hoist_operand(BB *pre, Reg *r) {
+  if (!ndefs_in_loop[r->vn])
+    return r;
+
+  IR *copy = calloc(1, sizeof(IR));
+  *copy = *get_def(r);
+  copy->r0 = new_reg();
+  defs[copy->r0->vn] = copy;
+  ndefs[copy->r0->vn] = 1;
+  var_of[copy->r0->vn] = var_of[r->vn];
+  append(pre, copy);
+  return copy->r0;
+}
+
+// Move loop-invariant instructions out of a loop. Returns the number
+// of moved instructions.
+static int hoist(Loop *loop, BB *pre) {
+  for (int i = 0; i < loop->size; i++)
+    for (IR *ir = loop->body[i]->ir; ir; ir = ir->next)
+      if (ir->r0)
+        ndefs_in_loop[ir->r0->vn]++;
+
+  int n = 0;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < loop->size; i++) {
+      BB *bb = loop->body[i];
+      IR head = {.next = bb->ir};
+      for (IR *prev = &head; prev->next;) {
+        IR *ir = prev->next;
+        if (!can_hoist(loop, ir)) {
+          prev = ir;
+          continue;
+        }
+
+        prev->next = ir->next;
+        bb->ir = head.next;
+        if (ir->r1)
+          ir->r1 = hoist_operand(pre, ir->r1);
+        if (ir->r2)
+          ir->r2 = hoist_operand(pre, ir->r2);
+        if (ir->mem && ir->mem->base)
+          ir->mem->base = hoist_operand(pre, ir->mem->base);
+        if (ir->mem && ir->mem->index)
+          ir->mem->index = hoist_operand(pre, ir->mem->index);
+        append(pre, ir);
+        ndefs_in_loop[ir->r0->vn] = 0;
+        changed = true;
+        n++;
+      }
+    }
+  }
+
+  for (int i = 0; i < loop->size; i++)
+    for (IR *ir = loop->body[i]->ir; ir; ir = ir->next)
+      if (ir->r0)
+        ndefs_in_loop[ir->r0->vn] = 0;
+  return n;
+}
+
+static void licm_fn(Obj *fn) {
+  nregs = num_regs(fn);
+  capacity = nregs + 1;
+  defs = calloc(capacity, sizeof(IR *));
+  ndefs = calloc(capacity, sizeof(int));
+  var_of = calloc(capacity, sizeof(Obj *));
+  ndefs_in_loop = calloc(capacity, sizeof(int));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->r0) {
+        defs[ir->r0->vn] = ir;
+        ndefs[ir->r0->vn]++;
+      }
+    }
+  }
+  find_escaping_vars(fn);
+
+  build_cfg(fn);
+
+  int nloops;
+  Loop **loops = find_loops(&nloops);
+  int nmoved = 0;
+
+  for (int i = 0; i < nloops; i++) {
+    Loop *loop = loops[i];
+    for (int j = 0; j < loop->size; j++)
+      in_loop[loop->body[j]->index] = true;
+    BB *pre = get_preheader(fn, loop);
+    for (int j = 0; j < loop->size; j++)
+      in_loop[loop->body[j]->index] = false;
+    nmoved += hoist(loop, pre);
+  }
+
+  if (nmoved)
+    opt_info(fn->bbs->ir->tok, "%s: moved %d loop-invariant instructions",
+             fn->name, nmoved);
+}
+
+void hoist_loop_invariants(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      licm_fn(fn);
+}
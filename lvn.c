@@ -0,0 +1,324 @@
+// This file implements local value numbering, which removes
+// computations whose value is already in a register.
+//
+// ir.c lowers every expression on its own, so `p->a->b + p->a->c`
+// loads `p` and `p->a` twice, `x[i] * x[i]` computes the address of
+// `x[i]` twice, and every access to a variable materializes its
+// address and loads it from the stack even if it has just been
+// stored. Within each basic block, we record for every pure
+// computation and every load the register holding its result, and
+//
+//  - reuse that register for a later instruction computing the same
+//    operation on the same operands, and
+//  - reuse the value stored to or loaded from a location for a later
+//    load from it, unless memory may have changed in between.
+//
+// A store or a call may write to any memory, except that if the
+// address of every local variable is only used to access it directly,
+// the locals can only be written through their own addresses and
+// their values survive stores through pointers and calls.
+//
+// A register is replaced by another throughout the function if both
+// are assigned exactly once. Otherwise, or if a stored value needs to
+// be sign-extended like a load would do, the instruction is turned
+// into a move or an IR_SEXT.
+//
+// The number of reused values is reported with -fopt-info.
+
+#include "sodium.h"
+
+// A value available in a register
+typedef struct Value Value;
+struct Value {
+  Value *next;
+  IROp op;
+  int size;
+  Reg *r1;
+  Reg *r2;
+  int64_t imm;
+  Obj *var;
+  Reg *reg;
+
+  // IR_LOAD: true if `reg` holds the stored value rather than the
+  // sign-extended one
+  bool is_stored;
+};
+
+static IR **defs;
+static int *ndefs;
+
+// The register each register is replaced with, or NULL
+static Reg **repl;
+
+static Value *values;
+static int nvalues;
+static int nloads;
+
+static Reg *find(Reg *r) {
+  while (r && repl[r->vn])
+    r = repl[r->vn];
+  return r;
+}
+
+static void rename_uses(IR *ir) {
+  ir->r1 = find(ir->r1);
+  ir->r2 = find(ir->r2);
+  if (ir->mem) {
+    ir->mem->base = find(ir->mem->base);
+    ir->mem->index = find(ir->mem->index);
+  }
+  for (int i = 0; i < ir->nargs; i++)
+    ir->args[i] = find(ir->args[i]);
+}
+
+static IR *get_def(Reg *r) {
+  return (ndefs[r->vn] == 1) ? defs[r->vn] : NULL;
+}
+
+// Returns the local variable `r` points to if it is not escaped.
+static Obj *local_var(Reg *r) {
+  IR *def = get_def(r);
+  if (def && def->op == IR_LVAR && !def->var->is_escaped)
+    return def->var;
+  return NULL;
+}
+
+// A local variable escapes if its address is used other than as the
+// address of a load or a store. Pointer arithmetic on that address may
+// reach the other variables in the frame, so then they all escape.
+static void find_escaping_vars(Obj *fn) {
+  bool escaped = false;
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      Reg *buf[ir->nargs + 4];
+      int n = ir_uses(ir, buf);
+      for (int i = 0; i < n; i++) {
+        IR *def = get_def(buf[i]);
+        if (!def || def->op != IR_LVAR)
+          continue;
+        if ((ir->op == IR_LOAD || ir->op == IR_STORE) && buf[i] == ir->r1 &&
+            buf[i] != ir->r2)
+          continue;
+        escaped = true;
+      }
+    }
+  }
+
+  for (Obj *var = fn->locals; var; var = var->next)
+    var->is_escaped = escaped;
+}
+
+static bool is_pure(IROp op) {
+  switch (op) {
+  case IR_IMM:
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_MULH:
+  case IR_SHL:
+  case IR_SHR:
+  case IR_SAR:
+  case IR_NEG:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+  case IR_SEXT:
+  case IR_LVAR:
+  case IR_GVAR:
+    return true;
+  }
+  return false;
+}
+
+static bool is_commutative(IROp op) {
+  return op == IR_ADD || op == IR_MUL || op == IR_EQ || op == IR_NE;
+}
+
+// Returns true if a load from `v` reads the same location as a load
+// of `size` bytes from `addr`.
+static bool same_location(Value *v, Reg *addr, Obj *var, int size) {
+  if (v->op != IR_LOAD || v->size != size)
+    return false;
+  return var ? v->var == var : v->r1 == addr;
+}
+
+static Value *find_value(IR *ir) {
+  Obj *var = (ir->op == IR_LOAD) ? local_var(ir->r1) : ir->var;
+  for (Value *v = values; v; v = v->next) {
+    if (ir->op == IR_LOAD) {
+      if (same_location(v, ir->r1, var, ir->size))
+        return v;
+      continue;
+    }
+    if (v->op != ir->op || v->size != ir->size || v->imm != ir->imm ||
+        v->var != var)
+      continue;
+    if (v->r1 == ir->r1 && v->r2 == ir->r2)
+      return v;
+    if (is_commutative(ir->op) && v->r1 == ir->r2 && v->r2 == ir->r1)
+      return v;
+  }
+  return NULL;
+}
+
+static void add_value(IROp op, int size, Reg *r1, Reg *r2, int64_t imm,
+                      Obj *var, Reg *reg, bool is_stored) {
+  Value *v = calloc(1, sizeof(Value));
+  v->op = op;
+  v->size = size;
+  v->r1 = r1;
+  v->r2 = r2;
+  v->imm = imm;
+  v->var = var;
+  v->reg = reg;
+  v->is_stored = is_stored;
+  v->next = values;
+  values = v;
+}
+
+// Forget the values for which `pred` returns true.
+static void kill(bool (*pred)(Value *v, void *arg), void *arg) {
+  Value head = {.next = values};
+  for (Value *v = &head; v->next;) {
+    if (pred(v->next, arg))
+      v->next = v->next->next;
+    else
+      v = v->next;
+  }
+  values = head.next;
+}
+
+static bool uses_reg(Value *v, void *arg) {
+  return v->r1 == arg || v->r2 == arg || v->reg == arg;
+}
+
+// A store through a pointer of unknown origin or a call may write to
+// any memory except a local variable that is not escaped.
+static bool is_memory(Value *v, void *arg) {
+  return v->op == IR_LOAD && !v->var;
+}
+
+static bool is_var(Value *v, void *arg) {
+  return v->op == IR_LOAD && v->var == arg;
+}
+
+static void number_insn(IR *ir) {
+  rename_uses(ir);
+
+  if (ir->op == IR_STORE) {
+    Obj *var = local_var(ir->r1);
+    if (var)
+      kill(is_var, var);
+    else
+      kill(is_memory, NULL);
+    add_value(IR_LOAD, ir->size, ir->r1, NULL, 0, var, ir->r2, true);
+    return;
+  }
+
+  if (ir->op == IR_MEMCPY || ir->op == IR_VSTORE || ir->op == IR_CALL)
+    kill(is_memory, NULL);
+
+  Reg *r0 = ir->r0;
+  if (!r0)
+    return;
+
+  // The old value of a register assigned more than once is gone.
+  if (ndefs[r0->vn] > 1)
+    kill(uses_reg, r0);
+
+  if (!is_pure(ir->op) && ir->op != IR_LOAD)
+    return;
+
+  Value *v = find_value(ir);
+  if (!v) {
+    // Skip `r = r op x`, whose operand is gone.
+    if (ir->r1 == r0 || ir->r2 == r0)
+      return;
+    if (ir->op == IR_LOAD)
+      add_value(IR_LOAD, ir->size, ir->r1, NULL, 0, local_var(ir->r1), r0, false);
+    else
+      add_value(ir->op, ir->size, ir->r1, ir->r2, ir->imm, ir->var, r0, false);
+    return;
+  }
+
+  if (ir->op == IR_LOAD)
+    nloads++;
+  else
+    nvalues++;
+
+  // A load sign-extends what was stored.
+  if (v->is_stored && ir->size < 8) {
+    ir->op = IR_SEXT;
+    ir->r1 = v->reg;
+    v->reg = r0;
+    v->is_stored = false;
+    return;
+  }
+
+  if (ndefs[r0->vn] == 1 && ndefs[v->reg->vn] == 1) {
+    repl[r0->vn] = v->reg;
+    ir->op = IR_MOV;
+    ir->r0 = NULL;
+    return;
+  }
+
+  ir->op = IR_MOV;
+  ir->size = 8;
+  ir->r1 = v->reg;
+  ir->r2 = NULL;
+  ir->var = NULL;
+}
+
+static void number_fn(Obj *fn) {
+  int nregs = num_regs(fn);
+  defs = calloc(nregs, sizeof(IR *));
+  ndefs = calloc(nregs, sizeof(int));
+  repl = calloc(nregs, sizeof(Reg *));
+  nvalues = nloads = 0;
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->r0) {
+        defs[ir->r0->vn] = ir;
+        ndefs[ir->r0->vn]++;
+      }
+    }
+  }
+
+  find_escaping_vars(fn);
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    values = NULL;
+    for (IR *ir = bb->ir; ir; ir = ir->next)
+      number_insn(ir);
+  }
+
+  // Delete the instructions whose results were replaced, and rename
+  // uses that come before their definitions in the block order.
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    IR head = {.next = bb->ir};
+    IR *prev = &head;
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->op == IR_MOV && !ir->r0)
+        continue;
+
+      rename_uses(ir);
+      prev = prev->next = ir;
+    }
+    bb->ir = head.next;
+    bb->last = prev;
+  }
+
+  if (nvalues || nloads)
+    opt_info(fn->bbs->ir->tok, "%s: value numbering reused %d values and %d loads",
+             fn->name, nvalues, nloads);
+}
+
+void number_values(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      number_fn(fn);
+}
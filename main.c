@@ -1,11 +1,24 @@
 #include "sodium.h"
 
+bool opt_g = true;
+bool opt_fopt_info;
+int opt_inline_limit = 40;
+char *opt_profile_generate;
+char *opt_profile_use;
+bool opt_pg;
+bool opt_finstrument_functions;
+
 static char *opt_o;
+static bool opt_emit_ir;
+static bool opt_c;
 
 static char *input_path;
 
 static void usage(int status) {
-  fprintf(stderr, "chibicc [ -o <path> ] <file>\n");
+  fprintf(stderr, "sodium [ -o <path> ] [ -c ] [ -emit-ir ] [ -g0 ] [ -fopt-info ]\n"
+          "       [ -finline-limit=<n> ] [ -fprofile-generate[=<path>] ]\n"
+          "       [ -fprofile-use[=<path>] ] [ -pg ] [ -finstrument-functions ]\n"
+          "       <file>\n");
   exit(status);
 }
 
@@ -21,6 +34,66 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-c")) {
+      opt_c = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-emit-ir")) {
+      opt_emit_ir = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-g")) {
+      opt_g = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-g0")) {
+      opt_g = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fopt-info")) {
+      opt_fopt_info = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-finline-limit=", 15)) {
+      opt_inline_limit = atoi(argv[i] + 15);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fprofile-generate")) {
+      opt_profile_generate = "sodium.prof";
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fprofile-generate=", 19)) {
+      opt_profile_generate = argv[i] + 19;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fprofile-use")) {
+      opt_profile_use = "sodium.prof";
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+      opt_profile_use = argv[i] + 14;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-pg")) {
+      opt_pg = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-finstrument-functions")) {
+      opt_finstrument_functions = true;
+      continue;
+    }
+
     if (!strncmp(argv[i], "-o", 2)) {
       opt_o = argv[i] + 2;
       continue;
@@ -49,13 +122,54 @@ static FILE *open_file(char *path) {
 int main(int argc, char **argv) {
   parse_args(argc, argv);
 
+  if (opt_profile_use)
+    read_profile(opt_profile_use);
+
   // Tokenize and parse.
   Token *tok = tokenize_file(input_path);
   Obj *prog = parse(tok);
 
-  // Traverse the AST to emit assembly.
+  // Lower the AST to the intermediate representation.
+  gen_ir(prog);
+  inline_functions(prog);
+  optimize_tail_calls(prog);
+  remove_dead_code(prog);
+  promote_locals(prog);
+  number_values(prog);
+  remove_extensions(prog);
+  hoist_loop_invariants(prog);
+  reduce_strength(prog);
+  select_insns(prog);
+
   FILE *out = open_file(opt_o);
-  fprintf(out, ".file 1 \"%s\"\n", input_path);
+  if (opt_emit_ir) {
+    dump_ir(prog, out);
+    return 0;
+  }
+
+  // Translate the IR to assembly.
+  alloc_regs(prog);
+
+  // Live intervals cover every block between the first and last use
+  // of a register, so moving cold blocks to the end of a function
+  // before register allocation would lengthen them. The allocation
+  // stays valid in any block order.
+  if (opt_profile_use)
+    layout_blocks(prog);
+
+  // With -c, assemble the output ourselves into an object file.
+  if (opt_c) {
+    char *buf;
+    size_t buflen;
+    FILE *asm_out = open_memstream(&buf, &buflen);
+    codegen(prog, asm_out);
+    fclose(asm_out);
+    assemble(buf, out);
+    return 0;
+  }
+
+  if (opt_g)
+    fprintf(out, ".file 1 \"%s\"\n", input_path);
   codegen(prog, out);
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,255 @@
+// This file promotes local variables to virtual registers.
+//
+// ir.c keeps every local variable in its stack slot, so each access
+// computes the variable's address and loads or stores through it, and
+// even parameters are stored to the stack on entry. A scalar variable
+// whose address is only used to load and store its whole value can
+// live in a register instead: we give it a virtual register that is
+// assigned by every store, turning
+//
+//   store.4 [x], v1   =>   vx = sext.4 v1
+//   v2 = load.4 [x]   =>   v2 = mov vx
+//
+// Since a load sign-extends the stored value, the register holds the
+// sign-extended value and the sign extension is done at the store.
+// The register is assigned more than once, so later passes treat it
+// like the other multiply-assigned registers. The register allocator
+// decides whether it ends up in a machine register or a stack slot.
+//
+// Most copies made for loads are used right away in the same block
+// before the variable is assigned again, so we use the variable's
+// register directly in that case.
+//
+// A variable whose address is used for anything else, such as being
+// stored, passed to a function or offset, stays in its stack slot.
+
+#include "sodium.h"
+
+static IR **defs;
+static int *ndefs;
+static int *nuses;
+
+// The number of registers before and after adding the registers of
+// promoted variables
+static int nregs;
+static int nregs2;
+
+// True for the registers of promoted variables
+static bool *promoted;
+
+static Reg *new_reg(void) {
+  Reg *r = calloc(1, sizeof(Reg));
+  r->vn = nregs2++;
+  r->rn = -1;
+  return r;
+}
+
+static bool is_scalar(Type *ty) {
+  return is_integer(ty) || ty->kind == TY_PTR;
+}
+
+// Returns the variable whose address `r` holds, or NULL.
+static Obj *lvar(Reg *r) {
+  if (!r || r->vn >= nregs || ndefs[r->vn] != 1 || defs[r->vn]->op != IR_LVAR)
+    return NULL;
+  return defs[r->vn]->var;
+}
+
+// Returns true if `ir` reads or writes the whole value of `var`
+// through the address in `r`.
+static bool is_access(IR *ir, Reg *r, Obj *var) {
+  if (ir->op == IR_LOAD)
+    return ir->r1 == r && ir->size == var->ty->size;
+  if (ir->op == IR_STORE)
+    return ir->r1 == r && ir->r2 != r && ir->size == var->ty->size;
+  return false;
+}
+
+// Give every scalar local that is accessed and whose address doesn't
+// escape a register. Returns the number of them.
+static int find_vars(Obj *fn) {
+  for (Obj *var = fn->locals; var; var = var->next) {
+    var->reg = NULL;
+    var->is_escaped = false;
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      Reg *buf[ir->nargs + 4];
+      int n = ir_uses(ir, buf);
+      for (int i = 0; i < n; i++) {
+        Obj *var = lvar(buf[i]);
+        if (var && !is_access(ir, buf[i], var))
+          var->is_escaped = true;
+      }
+    }
+  }
+
+  int n = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      Obj *var = ir->var;
+      if (ir->op == IR_LVAR && is_scalar(var->ty) && !var->is_escaped &&
+          !var->reg) {
+        var->reg = new_reg();
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+static void rewrite(Obj *fn) {
+  // Variables that are never stored to are read uninitialized, which
+  // can give any value.
+  bool *stored = calloc(nregs2, sizeof(bool));
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    for (IR *ir = bb->ir; ir; ir = ir->next)
+      if (ir->op == IR_STORE && lvar(ir->r1) && lvar(ir->r1)->reg)
+        stored[lvar(ir->r1)->reg->vn] = true;
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    IR head = {.next = bb->ir};
+    IR *prev = &head;
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->op == IR_LVAR && ir->var->reg)
+        continue;
+      prev = prev->next = ir;
+
+      Obj *var = lvar(ir->r1);
+      if (!var || !var->reg)
+        continue;
+
+      if (ir->op == IR_LOAD && !stored[var->reg->vn]) {
+        ir->op = IR_IMM;
+        ir->r1 = NULL;
+        ir->imm = 0;
+      } else if (ir->op == IR_LOAD) {
+        ir->op = IR_MOV;
+        ir->r1 = var->reg;
+      } else {
+        ir->op = (ir->size < 8) ? IR_SEXT : IR_MOV;
+        ir->r0 = var->reg;
+        ir->r1 = ir->r2;
+        ir->r2 = NULL;
+      }
+      ir->size = (ir->op == IR_SEXT) ? var->ty->size : 8;
+    }
+    bb->ir = head.next;
+    bb->last = prev;
+  }
+}
+
+// Replace the uses of a copy `ir` of a variable's register by the
+// register itself if they are all in the same block and come before
+// the variable is assigned again. Returns true if it does.
+static bool propagate(IR *ir) {
+  Reg *r = ir->r0;
+  Reg *var = ir->r1;
+  if (ndefs[r->vn] != 1)
+    return false;
+
+  // A copy whose value is discarded, as in `x;`, is just deleted.
+  if (!nuses[r->vn])
+    return true;
+
+  int n = 0;
+  IR *last = ir;
+  for (IR *ir2 = ir->next; ir2 && n < nuses[r->vn]; ir2 = ir2->next) {
+    Reg *buf[ir2->nargs + 4];
+    int nbuf = ir_uses(ir2, buf);
+    for (int i = 0; i < nbuf; i++)
+      if (buf[i] == r)
+        n++;
+    last = ir2;
+    if (ir2->r0 == var)
+      break;
+  }
+  if (n != nuses[r->vn])
+    return false;
+
+  for (IR *ir2 = ir->next;; ir2 = ir2->next) {
+    if (ir2->r1 == r)
+      ir2->r1 = var;
+    if (ir2->r2 == r)
+      ir2->r2 = var;
+    if (ir2->mem && ir2->mem->base == r)
+      ir2->mem->base = var;
+    if (ir2->mem && ir2->mem->index == r)
+      ir2->mem->index = var;
+    for (int i = 0; i < ir2->nargs; i++)
+      if (ir2->args[i] == r)
+        ir2->args[i] = var;
+    if (ir2 == last)
+      return true;
+  }
+}
+
+static int propagate_copies(Obj *fn) {
+  int n = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    IR head = {.next = bb->ir};
+    IR *prev = &head;
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->op == IR_MOV && promoted[ir->r1->vn] && propagate(ir)) {
+        n++;
+        continue;
+      }
+      prev = prev->next = ir;
+    }
+    bb->ir = head.next;
+    bb->last = prev;
+  }
+  return n;
+}
+
+static void promote_fn(Obj *fn) {
+  nregs = num_regs(fn);
+  defs = calloc(nregs, sizeof(IR *));
+  ndefs = calloc(nregs, sizeof(int));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->r0) {
+        defs[ir->r0->vn] = ir;
+        ndefs[ir->r0->vn]++;
+      }
+    }
+  }
+
+  nregs2 = nregs;
+  int nvars = find_vars(fn);
+  if (!nvars)
+    return;
+
+  rewrite(fn);
+
+  promoted = calloc(nregs2, sizeof(bool));
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (var->reg)
+      promoted[var->reg->vn] = true;
+
+  // Recount the definitions and uses of the rewritten code.
+  ndefs = calloc(nregs2, sizeof(int));
+  nuses = calloc(nregs2, sizeof(int));
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->r0)
+        ndefs[ir->r0->vn]++;
+      Reg *buf[ir->nargs + 4];
+      int n = ir_uses(ir, buf);
+      for (int i = 0; i < n; i++)
+        nuses[buf[i]->vn]++;
+    }
+  }
+
+  int ncopies = propagate_copies(fn);
+  opt_info(fn->bbs->ir->tok, "%s: promoted %d variables to registers, removed %d copies",
+           fn->name, nvars, ncopies);
+}
+
+void promote_locals(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      promote_fn(fn);
+}
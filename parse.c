@@ -58,8 +58,15 @@ static Obj *locals;
 // 同樣，全域變數也累積到該列表中。 Likewise, global variables are accumulated to this list.
 static Obj *globals;
 
+// String literals by contents
+static HashMap literals;
+
 static Scope *scope = &(Scope){};
 
+// Incremented each time a local variable is declared or a scope is
+// closed, to compute the lifetimes of local variables.
+static int scope_clock;
+
 static bool is_typename(Token *tok);
 static Type *declspec(Token **rest, Token *tok, VarAttr *attr);
 static Type *declarator(Token **rest, Token *tok, Type *ty);
@@ -68,6 +75,7 @@ static Node *compound_stmt(Token **rest, Token *tok);
 static Node *stmt(Token **rest, Token *tok);
 static Node *expr_stmt(Token **rest, Token *tok);
 static Node *expr(Token **rest, Token *tok);
+static int64_t const_expr(Token **rest, Token *tok);
 static Node *assign(Token **rest, Token *tok);
 static Node *equality(Token **rest, Token *tok);
 static Node *relational(Token **rest, Token *tok);
@@ -88,6 +96,10 @@ static void enter_scope(void) {
 }
 
 static void leave_scope(void) {
+  for (VarScope *sc = scope->vars; sc; sc = sc->next)
+    if (sc->var && sc->var->is_local)
+      sc->var->live_end = scope_clock;
+  scope_clock++;
   scope = scope->next;
 }
 
@@ -170,6 +182,7 @@ static Obj *new_var(char *name, Type *ty) {
 static Obj *new_lvar(char *name, Type *ty) {
   Obj *var = new_var(name, ty);
   var->is_local = true;
+  var->live_begin = scope_clock++;
   var->next = locals;
   locals = var;
   return var;
@@ -191,9 +204,16 @@ static Obj *new_anon_gvar(Type *ty) {
   return new_gvar(new_unique_name(), ty);
 }
 
+// String literals with the same contents share a single object.
 static Obj *new_string_literal(char *p, Type *ty) {
-  Obj *var = new_anon_gvar(ty);
+  Obj *var = hashmap_get(&literals, p, ty->size);
+  if (var)
+    return var;
+
+  var = new_anon_gvar(ty);
   var->init_data = p;
+  var->is_literal = true;
+  hashmap_put(&literals, p, ty->size, var);
   return var;
 }
 
@@ -212,12 +232,6 @@ static Type *find_typedef(Token *tok) {
   return NULL;
 }
 
-static long get_number(Token *tok) {
-  if (tok->kind != TK_NUM)
-    error_tok(tok, "expected a number");
-  return tok->val;
-}
-
 static void push_tag_scope(Token *tok, Type *ty) {
   TagScope *sc = calloc(1, sizeof(TagScope));
   sc->name = strndup(tok->loc, tok->len);
@@ -332,15 +346,24 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
   return ty;
 }
 
-// func-params = (param ("," param)*)? ")"
+// func-params = (param ("," param)* ("," "...")?)? ")"
 // param       = declspec declarator
 static Type *func_params(Token **rest, Token *tok, Type *ty) {
   Type head = {};
   Type *cur = &head;
+  bool is_variadic = false;
 
   while (!equal(tok, ")")) {
     if (cur != &head)
       tok = skip(tok, ",");
+
+    if (equal(tok, "...")) {
+      is_variadic = true;
+      tok = tok->next;
+      skip(tok, ")");
+      break;
+    }
+
     Type *basety = declspec(&tok, tok, NULL);
     Type *ty = declarator(&tok, tok, basety);
     cur = cur->next = copy_type(ty);
@@ -348,21 +371,27 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
 
   ty = func_type(ty);
   ty->params = head.next;
+  ty->is_variadic = is_variadic;
   *rest = tok->next;
   return ty;
 }
 
 // type-suffix = "(" func-params
-//             | "[" num "]" type-suffix
+//             | "[" const-expr "]" type-suffix
 //             | ε
 static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
   if (equal(tok, "("))
     return func_params(rest, tok->next, ty);
 
   if (equal(tok, "[")) {
-    int sz = get_number(tok->next);
-    tok = skip(tok->next->next, "]");
+    Token *start = tok->next;
+    int64_t sz = const_expr(&tok, tok->next);
+    if (sz < 0 || sz > INT32_MAX)
+      error_tok(start, "invalid array size");
+    tok = skip(tok, "]");
     ty = type_suffix(rest, tok, ty);
+    if (ty->size && sz > INT32_MAX / ty->size)
+      error_tok(start, "array is too large");
     return array_of(ty, sz);
   }
 
@@ -575,6 +604,133 @@ static Node *expr(Token **rest, Token *tok) {
     return node;
 }
 
+// Truncate `val` to `size` bytes and sign-extend it back, which is
+// what happens to a value of that size in the generated code.
+static int64_t wrap(int size, int64_t val) {
+  switch (size) {
+  case 1:
+    return (int8_t)val;
+  case 2:
+    return (int16_t)val;
+  case 4:
+    return (int32_t)val;
+  }
+  return val;
+}
+
+// Arithmetic is done in 64 bits if the left-hand side is a long or
+// a pointer and in 32 bits otherwise. This must match ir.c.
+static int op_size(Type *ty) {
+  return (ty->kind == TY_LONG || ty->base) ? 8 : 4;
+}
+
+static int64_t eval(Node *node);
+
+// Returns true if a given node can be evaluated at compile-time
+// with the same result as the generated code would compute.
+static bool is_const_expr(Node *node) {
+  add_type(node);
+  if (!is_integer(node->ty))
+    return false;
+
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_COMMA:
+    return is_const_expr(node->lhs) && is_const_expr(node->rhs);
+  case ND_DIV: {
+    if (!is_const_expr(node->lhs) || !is_const_expr(node->rhs))
+      return false;
+
+    // Leave division by zero and overflowing division to runtime.
+    int sz = op_size(node->lhs->ty);
+    int64_t lhs = wrap(sz, eval(node->lhs));
+    int64_t rhs = wrap(sz, eval(node->rhs));
+    return rhs != 0 && !(rhs == -1 && lhs == wrap(sz, (int64_t)1 << (sz * 8 - 1)));
+  }
+  case ND_NEG:
+  case ND_CAST:
+    return is_const_expr(node->lhs);
+  case ND_NUM:
+    return true;
+  }
+  return false;
+}
+
+// Evaluate a given node as a constant expression. The node must
+// satisfy is_const_expr().
+static int64_t eval(Node *node) {
+  int sz = node->lhs ? op_size(node->lhs->ty) : 8;
+
+  switch (node->kind) {
+  case ND_ADD:
+    return wrap(sz, eval(node->lhs) + eval(node->rhs));
+  case ND_SUB:
+    return wrap(sz, eval(node->lhs) - eval(node->rhs));
+  case ND_MUL:
+    return wrap(sz, eval(node->lhs) * eval(node->rhs));
+  case ND_DIV:
+    return wrap(sz, wrap(sz, eval(node->lhs)) / wrap(sz, eval(node->rhs)));
+  case ND_NEG:
+    return -eval(node->lhs);
+  case ND_EQ:
+    return wrap(sz, eval(node->lhs)) == wrap(sz, eval(node->rhs));
+  case ND_NE:
+    return wrap(sz, eval(node->lhs)) != wrap(sz, eval(node->rhs));
+  case ND_LT:
+    return wrap(sz, eval(node->lhs)) < wrap(sz, eval(node->rhs));
+  case ND_LE:
+    return wrap(sz, eval(node->lhs)) <= wrap(sz, eval(node->rhs));
+  case ND_COMMA:
+    return eval(node->rhs);
+  case ND_CAST:
+    return wrap(node->ty->size, eval(node->lhs));
+  case ND_NUM:
+    return node->val;
+  }
+
+  unreachable();
+}
+
+// const-expr = equality
+static int64_t const_expr(Token **rest, Token *tok) {
+  Node *node = equality(rest, tok);
+  if (!is_const_expr(node))
+    error_tok(node->tok, "not a compile-time constant");
+  return eval(node);
+}
+
+// Replace constant subexpressions with their values. A folded node
+// keeps its type so that, for example, sizeof((char)1) is still 1.
+static void fold(Node *node) {
+  if (!node)
+    return;
+
+  fold(node->lhs);
+  fold(node->rhs);
+  fold(node->cond);
+  fold(node->then);
+  fold(node->els);
+  fold(node->init);
+  fold(node->inc);
+  for (Node *n = node->body; n; n = n->next)
+    fold(n);
+  for (Node *n = node->args; n; n = n->next)
+    fold(n);
+
+  if (node->kind == ND_NUM || !node->ty || !is_const_expr(node))
+    return;
+
+  node->val = eval(node);
+  node->kind = ND_NUM;
+  node->lhs = node->rhs = NULL;
+}
+
 // assign = equality ("=" assign)?
 static Node *assign(Token **rest, Token *tok) {
   Node *node = equality(&tok, tok);
@@ -931,6 +1087,10 @@ static Node *funcall(Token **rest, Token *tok) {
   Node *node = new_node(ND_FUNCALL, start);
   node->funcname = strndup(start->loc, start->len);
   node->args = head.next;
+
+  VarScope *sc = find_var(start);
+  if (sc && sc->var && sc->var->ty->kind == TY_FUNC)
+    node->func_ty = sc->var->ty;
   return node;
 }
 
@@ -1037,6 +1197,7 @@ static Token *function(Token *tok, Type *basety) {
   tok = skip(tok, "{");
   fn->body = compound_stmt(&tok, tok);
   fn->locals = locals;
+  fold(fn->body);
   leave_scope();
   return tok;
 }
@@ -0,0 +1,320 @@
+// This file implements a peephole optimizer over the assembly of a
+// function.
+//
+// codegen.c translates one IR instruction at a time, so adjacent
+// instructions often do redundant work: a value is spilled to a slot
+// and reloaded right away, a register is set and then overwritten
+// before it is read, and so on. codegen.c buffers the lines of each
+// function, which we parse into a mnemonic and operands, and we run a
+// table of rules over each pair of adjacent instructions until none
+// applies. Labels end a window, because another path may jump to
+// them; .loc directives are skipped.
+//
+// With -fopt-info we report how often each rule fired in a function.
+
+#include "sodium.h"
+
+static char **regs[] = {reg8, reg16, reg32, reg64};
+
+// Returns the number of a register operand and stores its size to
+// *size, or returns -1 if `arg` is not a register.
+static int reg_number(char *arg, int *size) {
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 16; j++) {
+      if (!strcmp(arg, regs[i][j])) {
+        *size = 1 << i;
+        return j;
+      }
+    }
+  }
+  return -1;
+}
+
+static char *reg_name(int rn, int size) {
+  switch (size) {
+  case 1:
+    return reg8[rn];
+  case 2:
+    return reg16[rn];
+  case 4:
+    return reg32[rn];
+  }
+  return reg64[rn];
+}
+
+// Returns true if an operand reads any part of register `rn`,
+// including as the base or index of a memory operand.
+static bool mentions(char *arg, int rn) {
+  for (int i = 0; i < 4; i++) {
+    char *name = regs[i][rn];
+    for (char *p = strstr(arg, name); p; p = strstr(p + 1, name))
+      if (!isalnum(p[strlen(name)]))
+        return true;
+  }
+  return false;
+}
+
+static bool is_mem(char *arg) {
+  return strchr(arg, '(') != NULL;
+}
+
+static bool is_op(AsmInsn *insn, char *op) {
+  return insn->op && !strcmp(insn->op, op);
+}
+
+// The size of the memory operand of a sign-extending load, or 0 if
+// `insn` is not one.
+static int sext_size(AsmInsn *insn) {
+  if (is_op(insn, "movsbq"))
+    return 1;
+  if (is_op(insn, "movswq"))
+    return 2;
+  if (is_op(insn, "movslq"))
+    return 4;
+  return 0;
+}
+
+// Returns the next instruction in the same window, or NULL.
+static AsmInsn *next_insn(AsmInsn *insns, int n, int i) {
+  for (i++; i < n; i++) {
+    if (insns[i].deleted)
+      continue;
+    if (insns[i].op)
+      return &insns[i];
+    if (strncmp(insns[i].line, "  .loc ", 7))
+      return NULL;
+  }
+  return NULL;
+}
+
+static void set_insn(AsmInsn *insn, char *op, char *arg0, char *arg1) {
+  insn->op = op;
+  insn->args[0] = arg0;
+  insn->args[1] = arg1;
+  insn->nargs = 2;
+}
+
+// Returns the register written by a side-effect-free instruction that
+// computes a value from its source operand, or -1.
+static int written_reg(AsmInsn *insn) {
+  if (insn->nargs != 2)
+    return -1;
+  if (!is_op(insn, "mov") && !is_op(insn, "lea") && !is_op(insn, "movzb") &&
+      !sext_size(insn))
+    return -1;
+  int size;
+  return reg_number(insn->args[1], &size);
+}
+
+// Returns true if `insn` overwrites all 64 bits of register `rn`
+// without reading it. Writing a 32-bit register clears the upper half.
+static bool overwrites(AsmInsn *insn, int rn) {
+  int size;
+  if (written_reg(insn) != rn || mentions(insn->args[0], rn))
+    return false;
+  reg_number(insn->args[1], &size);
+  return size >= 4;
+}
+
+// `cmp $0, %reg` => `test %reg, %reg`, which has a shorter encoding.
+static bool test_zero(AsmInsn *insns, int n, int i) {
+  AsmInsn *insn = &insns[i];
+  int size;
+  if (!is_op(insn, "cmp") || strcmp(insn->args[0], "$0") ||
+      reg_number(insn->args[1], &size) == -1)
+    return false;
+  set_insn(insn, "test", insn->args[1], insn->args[1]);
+  return true;
+}
+
+// Delete a register write that the next instruction overwrites.
+static bool dead_move(AsmInsn *insns, int n, int i) {
+  AsmInsn *insn = &insns[i];
+  AsmInsn *next = next_insn(insns, n, i);
+  int rn = written_reg(insn);
+  if (rn == -1 || !next || !overwrites(next, rn))
+    return false;
+  insn->deleted = true;
+  return true;
+}
+
+// Returns true if the flags are overwritten after `insns[i]` before
+// anything reads them. codegen.c emits a jump right after the
+// instruction that sets its flags, so no flags are live across a jump
+// or a return.
+static bool flags_dead(AsmInsn *insns, int n, int i) {
+  static char *writers[] = {"call", "jmp", "ret", "cmp", "test", "add", "sub", "imul", "neg", "xor"};
+  static char *others[] = {"mov", "lea", "movzb", "movsbq", "movswq", "movslq"};
+
+  for (AsmInsn *insn = next_insn(insns, n, i); insn;
+       insn = next_insn(insns, n, insn - insns)) {
+    for (int j = 0; j < sizeof(writers) / sizeof(*writers); j++)
+      if (is_op(insn, writers[j]))
+        return true;
+
+    bool found = false;
+    for (int j = 0; j < sizeof(others) / sizeof(*others); j++)
+      if (is_op(insn, others[j]))
+        found = true;
+    if (!found)
+      return false;
+  }
+  return false;
+}
+
+// `mov $0, %reg` => `xor %reg32, %reg32`, which is shorter and breaks
+// the dependency on the old value, if nothing reads the flags that
+// xor clobbers.
+static bool zero_idiom(AsmInsn *insns, int n, int i) {
+  AsmInsn *insn = &insns[i];
+  int size;
+  if (!is_op(insn, "mov") || strcmp(insn->args[0], "$0"))
+    return false;
+  int rn = reg_number(insn->args[1], &size);
+  if (rn == -1 || size != 8 || !flags_dead(insns, n, i))
+    return false;
+
+  set_insn(insn, "xor", reg32[rn], reg32[rn]);
+  return true;
+}
+
+// A store to a stack slot followed by a load from it: load from the
+// stored register instead, or delete the load if it is a no-op.
+static bool store_reload(AsmInsn *insns, int n, int i) {
+  AsmInsn *insn = &insns[i];
+  AsmInsn *next = next_insn(insns, n, i);
+  int size;
+  if (!next || !is_op(insn, "mov") || insn->nargs != 2 || !is_mem(insn->args[1]) ||
+      next->nargs != 2 || strcmp(insn->args[1], next->args[0]))
+    return false;
+
+  int src = reg_number(insn->args[0], &size);
+  if (src == -1)
+    return false;
+
+  int dst_size;
+  int dst = reg_number(next->args[1], &dst_size);
+  int load_size = sext_size(next);
+  if (is_op(next, "mov"))
+    load_size = dst_size;
+  if (dst == -1 || !load_size || load_size > size)
+    return false;
+
+  if (is_op(next, "mov") && dst == src && dst_size == 8) {
+    next->deleted = true;
+    return true;
+  }
+  next->args[0] = reg_name(src, load_size);
+  return true;
+}
+
+// A sign extension of a register that already holds a value
+// sign-extended from the same or a smaller size.
+static bool redundant_sext(AsmInsn *insns, int n, int i) {
+  AsmInsn *insn = &insns[i];
+  AsmInsn *next = next_insn(insns, n, i);
+  int size;
+  if (!next || !sext_size(insn) || !sext_size(next) || sext_size(next) < sext_size(insn))
+    return false;
+
+  int rn = reg_number(insn->args[1], &size);
+  if (rn == -1 || strcmp(next->args[0], reg_name(rn, sext_size(next))) ||
+      strcmp(next->args[1], insn->args[1]))
+    return false;
+  next->deleted = true;
+  return true;
+}
+
+static struct {
+  char *name;
+  bool (*fn)(AsmInsn *insns, int n, int i);
+  int count;
+} rules[] = {
+  {"test-zero", test_zero},
+  {"dead-move", dead_move},
+  {"zero-idiom", zero_idiom},
+  {"store-reload", store_reload},
+  {"redundant-sext", redundant_sext},
+};
+
+#define NUM_RULES (sizeof(rules) / sizeof(*rules))
+
+// Parse a line printed by codegen.c.
+AsmInsn parse_asm(char *line) {
+  AsmInsn insn = {.line = line};
+  char *p = line;
+  while (*p == ' ')
+    p++;
+  if (*p == '.' || line[strlen(line) - 1] == ':')
+    return insn;
+
+  char *end = p;
+  while (*end && *end != ' ')
+    end++;
+  insn.op = strndup(p, end - p);
+
+  // Operands are separated by commas outside parentheses.
+  p = end;
+  while (*p == ' ')
+    p++;
+  while (*p && insn.nargs < 3) {
+    int depth = 0;
+    end = p;
+    while (*end && (depth || *end != ',')) {
+      depth += (*end == '(') - (*end == ')');
+      end++;
+    }
+    insn.args[insn.nargs++] = strndup(p, end - p);
+    p = *end ? end + 1 : end;
+    while (*p == ' ')
+      p++;
+  }
+  return insn;
+}
+
+void print_asm(FILE *out, AsmInsn *insn) {
+  if (!insn->op) {
+    fprintf(out, "%s\n", insn->line);
+    return;
+  }
+
+  fprintf(out, "  %s", insn->op);
+  for (int i = 0; i < insn->nargs; i++)
+    fprintf(out, "%s%s", i ? ", " : " ", insn->args[i]);
+  fprintf(out, "\n");
+}
+
+void optimize_asm(Obj *fn, AsmInsn *insns, int n) {
+  for (int k = 0; k < NUM_RULES; k++)
+    rules[k].count = 0;
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < n; i++) {
+      AsmInsn *insn = &insns[i];
+      if (insn->deleted || !insn->op)
+        continue;
+
+      for (int k = 0; k < NUM_RULES; k++) {
+        if (!rules[k].fn(insns, n, i))
+          continue;
+
+        rules[k].count++;
+        changed = true;
+        if (insn->deleted)
+          break;
+      }
+    }
+  }
+
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+  for (int k = 0; k < NUM_RULES; k++)
+    if (rules[k].count)
+      fprintf(out, ", %s %d", rules[k].name, rules[k].count);
+  fclose(out);
+
+  if (*buf)
+    opt_info(fn->bbs->ir->tok, "%s: peephole rules fired:%s", fn->name, buf + 1);
+}
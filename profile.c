@@ -0,0 +1,325 @@
+// This file implements the runtime side of profile-guided
+// optimization and the optimizations that use a profile.
+//
+// With -fprofile-generate, ir.c gives every function an array of
+// counters and increments them as the code runs. We add a function
+// that is called at exit through .fini_array and appends a line for
+// each function to the profile file:
+//
+//   <function name> <number of counters> <count> <count> ...
+//
+// Lines for the same function are summed when the profile is read, so
+// a profile can accumulate several runs and several object files.
+//
+// Functions are identified by name alone. This is only right as long
+// as function names are unique in the program. The parser doesn't
+// accept `static` yet, but two static functions with the same name in
+// different translation units would share one entry. Their counts
+// would be added together, or rejected as conflicting if the
+// functions have different numbers of counters. The file name can't
+// tell them apart either, since the input is often read from stdin.
+//
+// With -fprofile-use, ir.c derives the execution count of each block
+// from the profile. Blocks run much less often than the hottest block
+// of their function are moved to the end of the function, so that the
+// hot path falls through and the cold code doesn't take up space in
+// the instruction cache. inline.c inlines more at hot call sites and
+// not at all at call sites that never ran, and codegen.c aligns the
+// functions that contain hot code.
+
+#include "sodium.h"
+
+static HashMap profiles;
+
+// Counts at least this large are hot.
+static int64_t hot_count;
+
+void read_profile(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open profile: %s: %s", path, strerror(errno));
+
+  int64_t max = 0;
+  char *name;
+  int n;
+  while (fscanf(fp, "%ms %d", &name, &n) == 2) {
+    Profile *prof = hashmap_get(&profiles, name, strlen(name));
+    if (!prof) {
+      prof = calloc(1, sizeof(Profile));
+      prof->counts = calloc(n, sizeof(int64_t));
+      prof->n = n;
+      hashmap_put(&profiles, name, strlen(name), prof);
+    } else if (prof->n != n) {
+      error("%s: conflicting profiles of %s; delete the file and run the "
+            "program again", path, name);
+    }
+
+    for (int i = 0; i < n; i++) {
+      long val;
+      if (fscanf(fp, "%ld", &val) != 1)
+        error("%s: malformed profile of %s", path, name);
+      prof->counts[i] += val;
+      if (max < prof->counts[i])
+        max = prof->counts[i];
+    }
+  }
+
+  if (!feof(fp))
+    error("%s: malformed profile", path);
+  fclose(fp);
+
+  // Code is hot if it runs at least 1/1000 as often as the hottest
+  // code in the program.
+  hot_count = max / 1000;
+  if (hot_count < 1)
+    hot_count = 1;
+}
+
+// Returns the profile of a function, or NULL if it was not run.
+Profile *find_profile(char *name) {
+  return hashmap_get(&profiles, name, strlen(name));
+}
+
+bool is_hot_count(int64_t count) {
+  return opt_profile_use && count >= hot_count;
+}
+
+//
+// Dumping counters at exit
+//
+
+static int nregs;
+static Token *dump_tok;
+
+static Reg *new_reg(void) {
+  Reg *r = calloc(1, sizeof(Reg));
+  r->vn = nregs++;
+  r->rn = -1;
+  return r;
+}
+
+static IR *emit(BB *bb, IROp op, Reg *r0, Reg *r1, Reg *r2) {
+  IR *ir = calloc(1, sizeof(IR));
+  ir->op = op;
+  ir->size = 8;
+  ir->r0 = r0;
+  ir->r1 = r1;
+  ir->r2 = r2;
+  ir->tok = dump_tok;
+
+  if (bb->last)
+    bb->last = bb->last->next = ir;
+  else
+    bb->ir = bb->last = ir;
+  return ir;
+}
+
+static Reg *emit_imm(BB *bb, int64_t val) {
+  Reg *r = new_reg();
+  emit(bb, IR_IMM, r, NULL, NULL)->imm = val;
+  return r;
+}
+
+static Reg *emit_gvar(BB *bb, Obj *var) {
+  Reg *r = new_reg();
+  emit(bb, IR_GVAR, r, NULL, NULL)->var = var;
+  return r;
+}
+
+static void emit_jmp(BB *bb, BB *dest) {
+  emit(bb, IR_JMP, NULL, NULL, NULL)->bb1 = dest;
+}
+
+static void emit_br(BB *bb, Reg *cond, BB *then, BB *els) {
+  IR *ir = emit(bb, IR_BR, NULL, cond, NULL);
+  ir->bb1 = then;
+  ir->bb2 = els;
+}
+
+// Emit a call to a libc function that takes `nargs` registers.
+static Reg *emit_call(BB *bb, char *funcname, int nargs, ...) {
+  Reg **args = calloc(nargs, sizeof(Reg *));
+  va_list ap;
+  va_start(ap, nargs);
+  for (int i = 0; i < nargs; i++)
+    args[i] = va_arg(ap, Reg *);
+  va_end(ap);
+
+  Reg *r = new_reg();
+  IR *ir = emit(bb, IR_CALL, r, NULL, NULL);
+  ir->funcname = funcname;
+  ir->args = args;
+  ir->nargs = nargs;
+  ir->is_variadic = true;
+  return r;
+}
+
+static Obj *prog_tail;
+
+static void add_global(Obj *var) {
+  prog_tail = prog_tail->next = var;
+}
+
+static Obj *new_literal(char *str) {
+  static int id;
+  Obj *var = calloc(1, sizeof(Obj));
+  var->name = format(".L.prof.%d", id++);
+  var->ty = array_of(ty_char, strlen(str) + 1);
+  var->init_data = str;
+  var->is_literal = true;
+  add_global(var);
+  return var;
+}
+
+static void start_bb(Obj *fn, BB **last, BB *bb) {
+  if (*last)
+    (*last)->next = bb;
+  else
+    fn->bbs = bb;
+  *last = bb;
+}
+
+// Add a function that appends the counters of this translation unit
+// to the profile file. It is equivalent to
+//
+//   void __sodium_prof_dump() {
+//     FILE *fp = fopen(<path>, "a");
+//     if (!fp)
+//       return;
+//     for each function with counters:
+//       fprintf(fp, "%s %d", <name>, <ncounters>);
+//       for (long i = 0; i < <ncounters>; i++)
+//         fprintf(fp, " %ld", <counters>[i]);
+//       fprintf(fp, "\n");
+//     fclose(fp);
+//   }
+void gen_profile_dump(Obj *prog) {
+  Obj *first = NULL;
+  for (Obj *fn = prog; fn && !first; fn = fn->next)
+    if (fn->counters)
+      first = fn;
+  if (!first)
+    return;
+
+  // New objects are appended to `prog`, so remember where it ends.
+  Obj *end = prog;
+  while (end->next)
+    end = end->next;
+  prog_tail = end;
+
+  Obj *dump = calloc(1, sizeof(Obj));
+  dump->name = "__sodium_prof_dump";
+  dump->ty = func_type(ty_void);
+  dump->is_function = true;
+  dump->is_definition = true;
+  dump->is_static = true;
+  dump->is_destructor = true;
+  nregs = 1;
+  dump_tok = first->body->tok;
+
+  BB *last = NULL;
+  BB *entry = new_bb();
+  BB *ret = new_bb();
+  start_bb(dump, &last, entry);
+
+  Reg *fp = emit_call(entry, "fopen", 2, emit_gvar(entry, new_literal(opt_profile_generate)),
+                      emit_gvar(entry, new_literal("a")));
+  Reg *is_null = new_reg();
+  emit(entry, IR_EQ, is_null, fp, emit_imm(entry, 0));
+  BB *bb = new_bb();
+  emit_br(entry, is_null, ret, bb);
+
+  Obj *header = new_literal("%s %d");
+  Obj *count = new_literal(" %ld");
+  Obj *newline = new_literal("\n");
+
+  for (Obj *fn = prog;; fn = fn->next) {
+    if (fn->counters) {
+      add_global(fn->counters);
+
+      start_bb(dump, &last, bb);
+      Reg *n = emit_imm(bb, fn->ncounters);
+      emit_call(bb, "fprintf", 4, fp, emit_gvar(bb, header),
+                emit_gvar(bb, new_literal(fn->name)), n);
+      Reg *i = emit_imm(bb, 0);
+      BB *cond = new_bb();
+      emit_jmp(bb, cond);
+
+      start_bb(dump, &last, cond);
+      BB *body = new_bb();
+      BB *next = new_bb();
+      Reg *lt = new_reg();
+      emit(cond, IR_LT, lt, i, n);
+      emit_br(cond, lt, body, next);
+
+      start_bb(dump, &last, body);
+      Reg *off = new_reg();
+      emit(body, IR_MUL, off, i, emit_imm(body, 8));
+      Reg *addr = new_reg();
+      emit(body, IR_ADD, addr, emit_gvar(body, fn->counters), off);
+      Reg *val = new_reg();
+      emit(body, IR_LOAD, val, addr, NULL);
+      emit_call(body, "fprintf", 3, fp, emit_gvar(body, count), val);
+      emit(body, IR_ADD, i, i, emit_imm(body, 1));
+      emit_jmp(body, cond);
+
+      start_bb(dump, &last, next);
+      emit_call(next, "fprintf", 2, fp, emit_gvar(next, newline));
+      bb = new_bb();
+      emit_jmp(next, bb);
+    }
+    if (fn == end)
+      break;
+  }
+
+  start_bb(dump, &last, bb);
+  emit_call(bb, "fclose", 1, fp);
+  emit_jmp(bb, ret);
+
+  start_bb(dump, &last, ret);
+  emit(ret, IR_RET, NULL, NULL, NULL);
+
+  add_global(dump);
+}
+
+//
+// Block layout
+//
+
+static void layout_fn(Obj *fn) {
+  int64_t max = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    if (max < bb->count)
+      max = bb->count;
+  if (max == 0)
+    return;
+
+  // A block is cold if it runs less than 1% as often as the hottest
+  // block of the function. The entry block stays first.
+  BB hot_head = {};
+  BB cold_head = {};
+  BB *hot = &hot_head;
+  BB *cold = &cold_head;
+  int n = 0;
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (bb != fn->bbs && bb->count >= 0 && bb->count * 100 < max) {
+      cold = cold->next = bb;
+      n++;
+    } else {
+      hot = hot->next = bb;
+    }
+  }
+  hot->next = cold_head.next;
+  cold->next = NULL;
+  fn->bbs = hot_head.next;
+
+  if (n)
+    opt_info(fn->bbs->ir->tok, "%s: moved %d cold blocks out of line", fn->name, n);
+}
+
+void layout_blocks(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      layout_fn(fn);
+}
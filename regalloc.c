@@ -0,0 +1,264 @@
+// This file assigns real registers to virtual registers using the
+// linear scan algorithm by Poletto and Sarkar.
+//
+// We first compute which virtual registers are live at the entry and
+// exit of each basic block by the usual backward dataflow analysis.
+// Each virtual register then gets a single live interval, from the
+// first to the last instruction at which it is live. Intervals are
+// visited in order of their start points and greedily assigned a
+// free register. If no register is free, the interval that ends
+// last is spilled to a stack slot.
+//
+// The allocatable registers are the ones that codegen.c never uses
+// as scratch registers. Caller-saved registers are clobbered by a
+// function call, so an interval that spans a call can only be given
+// a callee-saved register. Callee-saved registers are saved and
+// restored by the function prologue and epilogue.
+
+#include "sodium.h"
+
+static int caller_saved[] = {R10, R11};
+static int callee_saved[] = {RBX, R12, R13, R14, R15};
+
+#define NUM_CALLER_SAVED (sizeof(caller_saved) / sizeof(*caller_saved))
+#define NUM_CALLEE_SAVED (sizeof(callee_saved) / sizeof(*callee_saved))
+
+// Live interval of a virtual register
+typedef struct {
+  Reg *reg;
+  int start;
+  int end;
+  bool across_call;
+} Interval;
+
+static int nregs;
+static Reg **regs;
+static Interval *intervals;
+
+static int nbbs;
+static BB **bbs;
+
+static bool **live_in;
+static bool **live_out;
+
+static int *call_pos;
+static int ncalls;
+
+static void add_reg(Reg *r) {
+  if (r)
+    regs[r->vn] = r;
+}
+
+static void collect(Obj *fn) {
+  nregs = num_regs(fn);
+  nbbs = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    bb->index = nbbs++;
+
+  regs = calloc(nregs, sizeof(Reg *));
+  bbs = calloc(nbbs, sizeof(BB *));
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    bbs[bb->index] = bb;
+    for (IR *ir = bb->ir; ir; ir = ir->next)
+      add_reg(ir->r0);
+  }
+}
+
+// Compute live-in and live-out sets of each basic block.
+static void compute_liveness(void) {
+  live_in = calloc(nbbs, sizeof(bool *));
+  live_out = calloc(nbbs, sizeof(bool *));
+  bool **use = calloc(nbbs, sizeof(bool *));
+  bool **def = calloc(nbbs, sizeof(bool *));
+
+  for (int i = 0; i < nbbs; i++) {
+    live_in[i] = calloc(nregs, sizeof(bool));
+    live_out[i] = calloc(nregs, sizeof(bool));
+    use[i] = calloc(nregs, sizeof(bool));
+    def[i] = calloc(nregs, sizeof(bool));
+
+    for (IR *ir = bbs[i]->ir; ir; ir = ir->next) {
+      Reg *buf[ir->nargs + 4];
+      int n = ir_uses(ir, buf);
+      for (int j = 0; j < n; j++)
+        if (!def[i][buf[j]->vn])
+          use[i][buf[j]->vn] = true;
+      if (ir->r0)
+        def[i][ir->r0->vn] = true;
+    }
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+
+    for (int i = nbbs - 1; i >= 0; i--) {
+      IR *last = bbs[i]->last;
+      BB *succ[] = {last->bb1, last->bb2};
+
+      for (int j = 0; j < 2; j++) {
+        if (!succ[j])
+          continue;
+        bool *in = live_in[succ[j]->index];
+        for (int k = 0; k < nregs; k++)
+          live_out[i][k] |= in[k];
+      }
+
+      for (int k = 0; k < nregs; k++) {
+        bool v = use[i][k] || (live_out[i][k] && !def[i][k]);
+        if (v && !live_in[i][k]) {
+          live_in[i][k] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+static void extend(int vn, int pos) {
+  Interval *it = &intervals[vn];
+  if (it->start == -1 || pos < it->start)
+    it->start = pos;
+  if (it->end < pos)
+    it->end = pos;
+}
+
+// Build a live interval for each virtual register by numbering the
+// instructions in layout order. Instruction i reads its operands at
+// position 2*i and writes its result at position 2*i+1, so that an
+// operand and the result of the same instruction don't overlap.
+static void build_intervals(void) {
+  intervals = calloc(nregs, sizeof(Interval));
+  for (int i = 0; i < nregs; i++) {
+    intervals[i].reg = regs[i];
+    intervals[i].start = -1;
+    intervals[i].end = -1;
+  }
+
+  int ninsns = 0;
+  for (int i = 0; i < nbbs; i++)
+    for (IR *ir = bbs[i]->ir; ir; ir = ir->next)
+      ninsns++;
+  call_pos = calloc(ninsns, sizeof(int));
+  ncalls = 0;
+
+  int pos = 0;
+  for (int i = 0; i < nbbs; i++) {
+    int start = pos;
+
+    for (IR *ir = bbs[i]->ir; ir; ir = ir->next) {
+      Reg *buf[ir->nargs + 4];
+      int n = ir_uses(ir, buf);
+      for (int j = 0; j < n; j++)
+        extend(buf[j]->vn, pos);
+      if (ir->r0)
+        extend(ir->r0->vn, pos + 1);
+      if (ir->op == IR_CALL)
+        call_pos[ncalls++] = pos;
+      pos += 2;
+    }
+
+    int end = pos - 1;
+    for (int k = 0; k < nregs; k++) {
+      if (live_in[i][k])
+        extend(k, start);
+      if (live_out[i][k])
+        extend(k, end);
+    }
+  }
+
+  // A call clobbers caller-saved registers after reading its
+  // arguments and before writing its result.
+  for (int i = 0; i < nregs; i++) {
+    Interval *it = &intervals[i];
+    for (int j = 0; j < ncalls; j++)
+      if (it->start <= call_pos[j] && call_pos[j] < it->end)
+        it->across_call = true;
+  }
+}
+
+static int cmp_start(const void *a, const void *b) {
+  Interval *x = *(Interval **)a;
+  Interval *y = *(Interval **)b;
+  return x->start - y->start;
+}
+
+static bool is_callee_saved(int rn) {
+  for (int i = 0; i < NUM_CALLEE_SAVED; i++)
+    if (callee_saved[i] == rn)
+      return true;
+  return false;
+}
+
+static void linear_scan(void) {
+  Interval **sorted = calloc(nregs, sizeof(Interval *));
+  int n = 0;
+  for (int i = 0; i < nregs; i++)
+    if (regs[i] && intervals[i].start != -1)
+      sorted[n++] = &intervals[i];
+  qsort(sorted, n, sizeof(Interval *), cmp_start);
+
+  Interval **active = calloc(nregs, sizeof(Interval *));
+  int nactive = 0;
+  bool used[16] = {};
+
+  for (int i = 0; i < n; i++) {
+    Interval *cur = sorted[i];
+
+    // Expire intervals that ended before this one starts.
+    int j = 0;
+    for (int k = 0; k < nactive; k++) {
+      if (active[k]->end < cur->start)
+        used[active[k]->reg->rn] = false;
+      else
+        active[j++] = active[k];
+    }
+    nactive = j;
+
+    int rn = -1;
+    if (!cur->across_call)
+      for (int k = 0; k < NUM_CALLER_SAVED && rn == -1; k++)
+        if (!used[caller_saved[k]])
+          rn = caller_saved[k];
+    for (int k = 0; k < NUM_CALLEE_SAVED && rn == -1; k++)
+      if (!used[callee_saved[k]])
+        rn = callee_saved[k];
+
+    if (rn == -1) {
+      // No register is free. Spill whichever of the current interval
+      // and the active intervals whose register it could use ends
+      // last.
+      Interval *victim = NULL;
+      for (int k = 0; k < nactive; k++) {
+        if (cur->across_call && !is_callee_saved(active[k]->reg->rn))
+          continue;
+        if (!victim || victim->end < active[k]->end)
+          victim = active[k];
+      }
+
+      if (!victim || victim->end <= cur->end)
+        continue;
+
+      rn = victim->reg->rn;
+      victim->reg->rn = -1;
+      for (int k = 0; k < nactive; k++)
+        if (active[k] == victim)
+          active[k] = active[--nactive];
+    }
+
+    cur->reg->rn = rn;
+    used[rn] = true;
+    active[nactive++] = cur;
+  }
+}
+
+void alloc_regs(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition)
+      continue;
+
+    collect(fn);
+    compute_liveness();
+    build_intervals();
+    linear_scan();
+  }
+}
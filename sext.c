@@ -0,0 +1,145 @@
+// This file removes sign extensions that can't change a value.
+//
+// A register holding a char, short or int value is only meaningful
+// in its low bytes, so ir.c sign-extends whenever a value is widened:
+// casts from int to long, loads of narrow variables and the stores
+// that mem2reg.c turns into register assignments. Many of these
+// extend values that are already sign-extended, such as a value just
+// loaded with `movslq`, a small constant or another extension.
+//
+// We compute for each register the smallest width w such that the
+// whole 64-bit register is known to equal its low w bytes
+// sign-extended, and delete IR_SEXT instructions that extend from w
+// or more bytes. Registers assigned more than once get the largest
+// width among their definitions. Loops make a register depend on
+// itself, so we start from the smallest width and widen until
+// nothing changes.
+//
+// The number of removed extensions is reported with -fopt-info.
+
+#include "sodium.h"
+
+static int nregs;
+static int *ndefs;
+static int *width;
+
+// The register each register is replaced with, or NULL
+static Reg **repl;
+
+static Reg *find(Reg *r) {
+  while (r && repl[r->vn])
+    r = repl[r->vn];
+  return r;
+}
+
+static int width_of(Reg *r) {
+  return (r->vn < nregs && ndefs[r->vn]) ? width[r->vn] : 8;
+}
+
+static int imm_width(int64_t val) {
+  if (val == (int8_t)val)
+    return 1;
+  if (val == (int16_t)val)
+    return 2;
+  if (val == (int32_t)val)
+    return 4;
+  return 8;
+}
+
+// Returns the width of the value an instruction assigns.
+static int def_width(IR *ir) {
+  switch (ir->op) {
+  case IR_IMM:
+    return imm_width(ir->imm);
+  case IR_LOAD:
+    return ir->size;
+  case IR_SEXT: {
+    int w = width_of(ir->r1);
+    return (w < ir->size) ? w : ir->size;
+  }
+  case IR_MOV:
+    return width_of(ir->r1);
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+    // 0 or 1 by `movzb`
+    return 1;
+  }
+  return 8;
+}
+
+static void sext_fn(Obj *fn) {
+  nregs = num_regs(fn);
+  ndefs = calloc(nregs, sizeof(int));
+  width = calloc(nregs, sizeof(int));
+  repl = calloc(nregs, sizeof(Reg *));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->r0) {
+        ndefs[ir->r0->vn]++;
+        width[ir->r0->vn] = 1;
+      }
+    }
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      for (IR *ir = bb->ir; ir; ir = ir->next) {
+        if (!ir->r0)
+          continue;
+        int w = def_width(ir);
+        if (width[ir->r0->vn] < w) {
+          width[ir->r0->vn] = w;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  int n = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    IR head = {.next = bb->ir};
+    IR *prev = &head;
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->op == IR_SEXT && width_of(ir->r1) <= ir->size) {
+        n++;
+        if (ndefs[ir->r0->vn] == 1 && ndefs[ir->r1->vn] == 1) {
+          repl[ir->r0->vn] = ir->r1;
+          continue;
+        }
+        ir->op = IR_MOV;
+        ir->size = 8;
+      }
+      prev = prev->next = ir;
+    }
+    bb->ir = head.next;
+    bb->last = prev;
+  }
+
+  if (!n)
+    return;
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      ir->r1 = find(ir->r1);
+      ir->r2 = find(ir->r2);
+      if (ir->mem) {
+        ir->mem->base = find(ir->mem->base);
+        ir->mem->index = find(ir->mem->index);
+      }
+      for (int i = 0; i < ir->nargs; i++)
+        ir->args[i] = find(ir->args[i]);
+    }
+  }
+
+  opt_info(fn->bbs->ir->tok, "%s: removed %d sign extensions", fn->name, n);
+}
+
+void remove_extensions(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      sext_fn(fn);
+}
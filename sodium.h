@@ -12,6 +12,21 @@
 typedef struct Type Type;
 typedef struct Node Node;
 typedef struct Member Member;
+typedef struct BB BB;
+typedef struct IVPtr IVPtr;
+typedef struct Reg Reg;
+
+//
+// main.c
+//
+
+extern bool opt_g;
+extern bool opt_fopt_info;
+extern int opt_inline_limit;
+extern char *opt_profile_generate;
+extern char *opt_profile_use;
+extern bool opt_pg;
+extern bool opt_finstrument_functions;
 
 //
 // strings.c
@@ -50,6 +65,7 @@ struct Token {
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
+void opt_info(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
@@ -73,18 +89,41 @@ struct Obj {
   // Local variable
   int offset;
 
+  // Lifetime of a local variable in the order scopes are opened and
+  // closed. Variables whose lifetimes don't overlap can share a slot.
+  int live_begin;
+  int live_end;
+
+  // True if the address of the variable may be used other than to
+  // access it directly. Computed by mem2reg.c, licm.c and lvn.c.
+  bool is_escaped;
+
+  // Register the variable lives in if mem2reg.c promoted it
+  Reg *reg;
+
   // Global variable or function
   bool is_function;
   bool is_definition;
+  bool is_static; // Not visible outside the translation unit
 
   // Global variable
   char *init_data;
+  bool is_literal; // String literal, which is read-only
 
   // Function
   Obj *params;
   Node *body;
   Obj *locals;
   int stack_size;
+
+  // Intermediate representation
+  BB *bbs;
+
+  // Profile-guided optimization
+  Obj *counters;      // Counter array with -fprofile-generate
+  int ncounters;
+  bool is_destructor; // Called at exit through .fini_array
+  bool is_hot;        // Aligned to 16 bytes
 };
 
 // AST node
@@ -140,10 +179,14 @@ struct Node {
 
   // Function call
   char *funcname;
+  Type *func_ty; // NULL if the function is not declared
   Node *args;
 
   Obj *var;      // Used if kind == ND_VAR
   int64_t val;       // Used if kind == ND_NUM
+
+  // Address derived from an induction variable, see iv.c
+  IVPtr *ivptr;
 };
 
 Obj *parse(Token *tok);
@@ -192,6 +235,7 @@ struct Type {
   // Function type
   Type *return_ty;
   Type *params;
+  bool is_variadic;
   Type *next;
 };
 
@@ -216,9 +260,405 @@ Type *func_type(Type *return_ty);
 Type *array_of(Type *base, int size);
 void add_type(Node *node);
 
+//
+// ir.c
+//
+
+typedef enum {
+  IR_IMM,    // r0 = imm
+  IR_MOV,    // r0 = r1
+  IR_ADD,    // r0 = r1 + r2
+  IR_SUB,    // r0 = r1 - r2
+  IR_MUL,    // r0 = r1 * r2
+  IR_DIV,    // r0 = r1 / r2
+  IR_MULH,   // r0 = high 64 bits of the 128-bit product r1 * r2
+  IR_SHL,    // r0 = r1 << r2
+  IR_SHR,    // r0 = r1 >> r2 (logical)
+  IR_SAR,    // r0 = r1 >> r2 (arithmetic)
+  IR_NEG,    // r0 = -r1
+  IR_EQ,     // r0 = r1 == r2
+  IR_NE,     // r0 = r1 != r2
+  IR_LT,     // r0 = r1 < r2
+  IR_LE,     // r0 = r1 <= r2
+  IR_SEXT,   // r0 = r1 sign-extended from `size` bytes
+  IR_LVAR,   // r0 = address of local variable `var`
+  IR_GVAR,   // r0 = address of global variable `var`
+  IR_LEA,    // r0 = address of mem, truncated to `size` bytes
+  IR_LOAD,   // r0 = *r1, sign-extended from `size` bytes
+  IR_STORE,  // *r1 = r2, truncated to `size` bytes
+  IR_MEMCPY, // copy `size` bytes from *r2 to *r1
+  IR_VZERO,  // x0 = 0
+  IR_VSPLAT, // x0 = r1 in every lane
+  IR_VLOAD,  // x0 = `imm`-byte elements at *r1, sign-extended to lanes
+  IR_VSTORE, // *r1 = x1
+  IR_VADD,   // x0 = x1 + x2
+  IR_VSUB,   // x0 = x1 - x2
+  IR_VMUL,   // x0 = x1 * x2, for 2-byte lanes only
+  IR_VEQ,    // x0 = x1 == x2, as -1 or 0 in each lane
+  IR_VGT,    // x0 = x1 > x2, as -1 or 0 in each lane
+  IR_VHSUM,  // r0 = sum of the 4-byte lanes of x1
+  IR_PARAM,  // r0 = incoming argument number `imm`
+  IR_CALL,   // r0 = funcname(args...)
+  IR_TAILCALL, // return funcname(args...), reusing the current frame
+  IR_JMP,    // goto bb1
+  IR_BR,     // if (r1) goto bb1 else goto bb2
+  IR_CBR,    // if (r1 `cond` r2) goto bb1 else goto bb2
+  IR_RET,    // return r1
+} IROp;
+
+// Virtual register
+struct Reg {
+  int vn;     // Virtual register number
+  int rn;     // Real register number, or -1 if it lives in memory
+  int offset; // Stack slot offset from %rbp if it lives in memory
+};
+
+// Memory operand: base + index * scale + disp, where the base is
+// either a register or the address of a variable.
+typedef struct {
+  Reg *base;
+  Obj *var;
+  Reg *index;
+  int scale;
+  int disp;
+} Mem;
+
+// Three-address instruction
+//
+// Instruction selection may replace an operand with a memory operand
+// or an immediate. A load or store through `mem` has no r1. An
+// arithmetic instruction or a comparison without r2 reads its second
+// operand from `mem` if it is set, or from `imm` otherwise. Likewise
+// a store without r2 stores `imm`.
+//
+// Vector instructions (IR_V*) work on lanes of `size` bytes in the
+// SSE registers %xmm1 to %xmm15, which are not register-allocated:
+// ir.c numbers them directly in x0, x1 and x2.
+typedef struct IR IR;
+struct IR {
+  IR *next;
+  IROp op;
+  int size;   // Operand width in bytes
+
+  Reg *r0;    // Destination
+  Reg *r1;    // Operands
+  Reg *r2;
+
+  int x0;     // Vector registers
+  int x1;
+  int x2;
+
+  int64_t imm;
+  Obj *var;   // IR_LVAR or IR_GVAR
+  Mem *mem;
+
+  // Branch targets
+  BB *bb1;
+  BB *bb2;
+  IROp cond; // IR_CBR: one of IR_EQ, IR_NE, IR_LT and IR_LE
+
+  // Function call
+  //
+  // Instruction selection may replace an argument with the constant,
+  // address or load that computes it, which is then evaluated right
+  // into the argument's register or stack slot. Its register in
+  // `args` is NULL then.
+  char *funcname;
+  Reg **args;
+  IR **arg_insns;
+  int nargs;
+  bool is_variadic; // %al must hold the number of vector arguments
+
+  Token *tok; // Representative token for line info
+};
+
+// Basic block
+struct BB {
+  BB *next;
+  int label;
+  IR *ir;     // Instructions; the last one is always a branch or return
+  IR *last;
+
+  int index;  // Position in the function's block list
+
+  // Execution count from -fprofile-use, or -1 if unknown
+  int64_t count;
+};
+
+BB *new_bb(void);
+bool is_terminator(IR *ir);
+int num_regs(Obj *fn);
+int ir_uses(IR *ir, Reg **buf);
+void gen_ir(Obj *prog);
+void dump_ir(Obj *prog, FILE *out);
+
+//
+// iv.c
+//
+
+// An address `base + i * size` computed in a loop from an induction
+// variable `i`. Addresses with the same base and size share one.
+struct IVPtr {
+  IVPtr *next;
+  Node *addr;   // One of the addresses, to compute the initial value
+  Node *base;
+  int64_t size;
+  int64_t step; // Bytes to add after each iteration
+  Reg *reg;     // Register holding the address while the loop runs
+};
+
+typedef struct {
+  IVPtr *ptrs;
+
+  // If set, the loop runs while ptrs->reg < ptrs->base + bound * size
+  // (or <= if `inclusive`) and the induction variable is dead.
+  Node *bound;
+  bool inclusive;
+} LoopIV;
+
+Obj *loop_counter(Node *body, Node *node, int64_t *step);
+bool is_loop_invariant(Node *body, Node *node, Node *expr);
+bool is_addr_taken(Node *body, Obj *var);
+LoopIV *find_ivs(Node *body, Node *node);
+
+//
+// vectorize.c
+//
+
+// SSE registers available to a vectorized loop. %xmm0 is reserved
+// for codegen.
+#define NUM_XMM 15
+
+// An array indexed by the loop counter in a vectorized loop. Accesses
+// with the same base variable and element size share one.
+typedef struct VecArray VecArray;
+struct VecArray {
+  VecArray *next;
+  Node *base;
+  int size;      // Element size
+  bool is_stored;
+  Reg *reg;      // Address of the current element while the loop runs
+};
+
+// A pair of arrays that may overlap, which must be checked before
+// entering the vector loop
+typedef struct VecCheck VecCheck;
+struct VecCheck {
+  VecCheck *next;
+  VecArray *x;
+  VecArray *y;
+};
+
+// A loop invariant value broadcast to every lane before the loop
+typedef struct VecSplat VecSplat;
+struct VecSplat {
+  VecSplat *next;
+  Node *node;
+  int xmm;
+};
+
+typedef struct {
+  Node *counter;  // The loop counter `i`
+  Node *bound;    // The loop runs while i < bound, or i <= bound
+  bool inclusive; // if `inclusive`
+  int lane;       // Bytes per lane
+  int nsums;      // Number of `sum = sum + ...` statements
+  Node **stmts;
+  int nstmts;
+  VecArray *arrays;
+  VecCheck *checks;
+  VecSplat *splats;
+} LoopVec;
+
+LoopVec *vectorize(Node *body, Node *node);
+VecArray *find_array(LoopVec *vec, Node *node);
+VecSplat *find_splat(LoopVec *vec, Node *node);
+
+//
+// profile.c
+//
+
+// Execution counts of the counters of a function in a profile
+typedef struct {
+  int64_t *counts;
+  int n;
+} Profile;
+
+void read_profile(char *path);
+Profile *find_profile(char *name);
+bool is_hot_count(int64_t count);
+void gen_profile_dump(Obj *prog);
+void layout_blocks(Obj *prog);
+
+//
+// inline.c
+//
+
+void inline_functions(Obj *prog);
+
+//
+// tailcall.c
+//
+
+void optimize_tail_calls(Obj *prog);
+
+//
+// licm.c
+//
+
+void hoist_loop_invariants(Obj *prog);
+
+//
+// dce.c
+//
+
+void remove_dead_code(Obj *prog);
+
+//
+// mem2reg.c
+//
+
+void promote_locals(Obj *prog);
+
+//
+// lvn.c
+//
+
+void number_values(Obj *prog);
+
+//
+// sext.c
+//
+
+void remove_extensions(Obj *prog);
+
+//
+// strength.c
+//
+
+void reduce_strength(Obj *prog);
+
+//
+// isel.c
+//
+
+void select_insns(Obj *prog);
+
+//
+// regalloc.c
+//
+
+void alloc_regs(Obj *prog);
+
 //
 // codegen.c
 //
 
+// x86-64 general-purpose registers in hardware encoding order.
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+extern char *reg64[];
+extern char *reg32[];
+extern char *reg16[];
+extern char *reg8[];
+
+// The number of integer arguments passed in registers. The rest are
+// passed on the stack.
+#define MAX_REG_ARGS 6
+
 void codegen(Obj *prog, FILE *out);
-int align_to(int n, int align);
\ No newline at end of file
+int align_to(int n, int align);
+
+//
+// peephole.c
+//
+
+// A line of assembly
+typedef struct {
+  char *op;      // Mnemonic, or NULL for labels and directives
+  char *args[3]; // Operands in AT&T order
+  int nargs;
+  char *line;    // The line as printed
+  bool deleted;
+} AsmInsn;
+
+AsmInsn parse_asm(char *line);
+void print_asm(FILE *out, AsmInsn *insn);
+void optimize_asm(Obj *fn, AsmInsn *insns, int n);
+
+//
+// asm.c
+//
+
+typedef struct Symbol Symbol;
+typedef struct Reloc Reloc;
+
+// Section of an object file
+typedef struct {
+  char *name;
+  char *buf;       // Contents, or NULL for .bss
+  int size;
+  int capacity;
+  int align;
+  bool is_alloc;
+  bool is_writable;
+  bool is_exec;
+  bool is_strings; // Mergeable strings, as in .rodata.str1.1
+  Reloc *relocs;
+  int index;       // Section header index in the object file
+} Section;
+
+struct Symbol {
+  Symbol *next;
+  char *name;
+  Section *sec;    // NULL if undefined
+  int64_t value;
+  bool is_global;
+  bool is_function; // `.type name, @function`
+  int index;       // Symbol table index in the object file
+
+  // `.set name, alias+offset`
+  Symbol *alias;
+  int64_t offset;
+};
+
+typedef enum {
+  RELOC_PC32,  // S + A - P, for %rip-relative operands
+  RELOC_PLT32, // Like RELOC_PC32, for call and jmp targets
+  RELOC_64,    // S + A, for .quad
+} RelocKind;
+
+struct Reloc {
+  Reloc *next;
+  int offset;
+  Symbol *sym;
+  RelocKind kind;
+  int64_t addend;
+};
+
+void assemble(char *text, FILE *out);
+
+//
+// elf.c
+//
+
+void write_elf(FILE *out, Section **secs, int nsecs, Symbol *syms);
+
+//
+// hashmap.c
+//
+
+typedef struct {
+  char *key;
+  int keylen;
+  void *val;
+} HashEntry;
+
+typedef struct {
+  HashEntry *buckets;
+  int capacity;
+  int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, int keylen, void *val);
@@ -0,0 +1,268 @@
+// This file replaces multiplications and divisions by constants with
+// cheaper instructions.
+//
+// `imul` has a latency of 3 cycles and `idiv` of 20 to 90 cycles,
+// while shifts, adds and `lea` take 1. We rewrite
+//
+//  - x * 2^k as x << k,
+//  - x * c * 2^k for c = 3, 5 or 9 as a `lea` computing x + x * (c-1)
+//    followed by a shift,
+//  - x / 2^k as a shift, after adding 2^k - 1 to negative dividends
+//    so that the quotient is rounded toward zero,
+//  - x / d for other constants as a multiplication by a "magic"
+//    number approximating 2^n / d, followed by a shift and a
+//    correction for negative dividends. See Hacker's Delight,
+//    chapter 10.
+//
+// Negative divisors are handled by negating the quotient.
+//
+// Constants are left in registers; instruction selection turns them
+// into immediates where possible.
+
+#include "sodium.h"
+
+static IR **defs;
+static int *ndefs;
+static int nregs;
+
+// New instructions are inserted after this one.
+static IR *pos;
+static Token *tok;
+
+static Reg *new_reg(void) {
+  Reg *r = calloc(1, sizeof(Reg));
+  r->vn = nregs++;
+  r->rn = -1;
+  return r;
+}
+
+static IR *insert(IROp op, int size, Reg *r1, Reg *r2) {
+  IR *ir = calloc(1, sizeof(IR));
+  ir->op = op;
+  ir->size = size;
+  ir->r0 = new_reg();
+  ir->r1 = r1;
+  ir->r2 = r2;
+  ir->tok = tok;
+  ir->next = pos->next;
+  pos->next = ir;
+  pos = ir;
+  return ir;
+}
+
+static Reg *imm(int64_t val) {
+  IR *ir = insert(IR_IMM, 8, NULL, NULL);
+  ir->imm = val;
+  return ir->r0;
+}
+
+static Reg *binop(IROp op, int size, Reg *r1, Reg *r2) {
+  return insert(op, size, r1, r2)->r0;
+}
+
+// Turn `ir` in place into `r0 = r1 op r2`, which finishes the
+// replacement sequence.
+static void replace(IR *ir, IROp op, Reg *r1, Reg *r2) {
+  ir->op = op;
+  ir->r1 = r1;
+  ir->r2 = r2;
+}
+
+// Returns true if `r` always holds a constant, which is stored to *val.
+static bool get_imm(Reg *r, int64_t *val) {
+  if (ndefs[r->vn] != 1 || defs[r->vn]->op != IR_IMM)
+    return false;
+  *val = defs[r->vn]->imm;
+  return true;
+}
+
+// Returns k if val is 2^k, or -1 otherwise.
+static int log2_exact(uint64_t val) {
+  if (val == 0 || (val & (val - 1)))
+    return -1;
+  int k = 0;
+  while (val > 1) {
+    val >>= 1;
+    k++;
+  }
+  return k;
+}
+
+static bool reduce_mul(IR *ir) {
+  int64_t val;
+  Reg *x;
+  if (get_imm(ir->r2, &val))
+    x = ir->r1;
+  else if (get_imm(ir->r1, &val))
+    x = ir->r2;
+  else
+    return false;
+
+  if (ir->size == 4)
+    val = (int32_t)val;
+  if (val <= 1)
+    return false;
+
+  int k = 0;
+  while (!(val & 1)) {
+    val >>= 1;
+    k++;
+  }
+
+  if (val == 1) {
+    replace(ir, IR_SHL, x, imm(k));
+    return true;
+  }
+
+  if (val != 3 && val != 5 && val != 9)
+    return false;
+
+  // x + x * (val - 1)
+  IR *lea = insert(IR_LEA, ir->size, NULL, NULL);
+  lea->mem = calloc(1, sizeof(Mem));
+  lea->mem->base = x;
+  lea->mem->index = x;
+  lea->mem->scale = val - 1;
+
+  if (k)
+    replace(ir, IR_SHL, lea->r0, imm(k));
+  else
+    replace(ir, IR_MOV, lea->r0, NULL);
+  return true;
+}
+
+// Compute the magic number and the shift amount for signed division
+// of `bits`-bit integers by d >= 2 (Hacker's Delight, figure 10-1).
+// The magic number is returned as an unsigned `bits`-bit value.
+static uint64_t magic(uint64_t d, int bits, int *shift) {
+  uint64_t two = (uint64_t)1 << (bits - 1);
+  uint64_t anc = two - 1 - two % d;
+  int p = bits - 1;
+  uint64_t q1 = two / anc;
+  uint64_t r1 = two - q1 * anc;
+  uint64_t q2 = two / d;
+  uint64_t r2 = two - q2 * d;
+  uint64_t delta;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= d) {
+      q2++;
+      r2 -= d;
+    }
+    delta = d - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *shift = p - bits;
+  return q2 + 1;
+}
+
+static bool reduce_div(IR *ir) {
+  int64_t d;
+  if (!get_imm(ir->r2, &d))
+    return false;
+
+  int bits = ir->size * 8;
+  int size = ir->size;
+  if (size == 4)
+    d = (int32_t)d;
+
+  // INT_MIN can't be negated, and dividing by 1 or -1 is left to
+  // constant folding.
+  int64_t min = (size == 4) ? INT32_MIN : INT64_MIN;
+  if (d == min || d == 1 || d == -1 || d == 0)
+    return false;
+
+  bool neg = d < 0;
+  uint64_t ad = neg ? -d : d;
+  Reg *x = ir->r1;
+
+  // The quotient is computed as q = t - sign, where sign is -1 for
+  // negative dividends and 0 otherwise. For a negative divisor we
+  // compute sign - t instead.
+  int k = log2_exact(ad);
+  if (k != -1) {
+    // Add 2^k - 1 to negative dividends before shifting.
+    Reg *t = x;
+    if (k > 1)
+      t = binop(IR_SAR, size, x, imm(bits - 1));
+    t = binop(IR_SHR, size, t, imm(bits - k));
+    t = binop(IR_ADD, size, x, t);
+    if (!neg) {
+      replace(ir, IR_SAR, t, imm(k));
+    } else {
+      t = binop(IR_SAR, size, t, imm(k));
+      replace(ir, IR_SUB, imm(0), t);
+    }
+    return true;
+  }
+
+  int shift;
+  uint64_t m = magic(ad, bits, &shift);
+  Reg *t;
+
+  if (size == 4) {
+    // The product of a 32-bit dividend and a 32-bit magic number fits
+    // in 63 bits, so a 64-bit multiply gives the high half directly.
+    Reg *x64 = binop(IR_SEXT, 4, x, NULL);
+    t = binop(IR_MUL, 8, x64, imm(m));
+    t = binop(IR_SAR, 8, t, imm(32 + shift));
+  } else {
+    t = binop(IR_MULH, 8, x, imm(m));
+    if ((int64_t)m < 0)
+      t = binop(IR_ADD, 8, t, x);
+    if (shift)
+      t = binop(IR_SAR, 8, t, imm(shift));
+  }
+
+  Reg *sign = binop(IR_SAR, size, x, imm(bits - 1));
+  if (!neg)
+    replace(ir, IR_SUB, t, sign);
+  else
+    replace(ir, IR_SUB, sign, t);
+  return true;
+}
+
+static void reduce_fn(Obj *fn) {
+  nregs = num_regs(fn);
+  defs = calloc(nregs, sizeof(IR *));
+  ndefs = calloc(nregs, sizeof(int));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->r0) {
+        defs[ir->r0->vn] = ir;
+        ndefs[ir->r0->vn]++;
+      }
+    }
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    IR head = {.next = bb->ir};
+    IR *prev = &head;
+
+    for (IR *ir = bb->ir; ir; prev = ir, ir = ir->next) {
+      pos = prev;
+      tok = ir->tok;
+      if (ir->op == IR_MUL)
+        reduce_mul(ir);
+      else if (ir->op == IR_DIV)
+        reduce_div(ir);
+    }
+    bb->ir = head.next;
+  }
+}
+
+void reduce_strength(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      reduce_fn(fn);
+}
@@ -0,0 +1,202 @@
+// This file turns calls in tail position into jumps.
+//
+// A call whose result is returned right away doesn't need a frame of
+// its own. If the callee is the function itself, we assign the
+// arguments to the incoming parameters and jump back to the code
+// following IR_PARAM, which turns tail recursion into a loop.
+// Otherwise the call becomes IR_TAILCALL, which codegen emits as the
+// epilogue followed by a `jmp` to the callee, so the callee returns
+// straight to our caller.
+//
+// Both reuse the current frame, so they are not done if the address
+// of a local variable may have escaped: the callee could still be
+// using it after the frame is gone or reused.
+
+#include "sodium.h"
+
+// Returns true if the address of a local variable may be stored
+// somewhere, passed to a function or returned.
+static bool addr_escapes(Obj *fn) {
+  int nregs = num_regs(fn);
+  bool *is_addr = calloc(nregs, sizeof(bool));
+
+  // A register holds an address if it is an IR_LVAR or is computed
+  // from one. Iterate because blocks are not in dominator order.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      for (IR *ir = bb->ir; ir; ir = ir->next) {
+        if (!ir->r0 || is_addr[ir->r0->vn] || ir->op == IR_LOAD)
+          continue;
+
+        bool addr = (ir->op == IR_LVAR);
+        Reg *buf[ir->nargs + 4];
+        int n = ir_uses(ir, buf);
+        for (int i = 0; i < n; i++)
+          if (is_addr[buf[i]->vn])
+            addr = true;
+
+        if (addr) {
+          is_addr[ir->r0->vn] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (ir->op == IR_STORE && ir->r2 && is_addr[ir->r2->vn])
+        return true;
+      if (ir->op == IR_RET && ir->r1 && is_addr[ir->r1->vn])
+        return true;
+      for (int i = 0; i < ir->nargs; i++)
+        if (is_addr[ir->args[i]->vn])
+          return true;
+    }
+  }
+  return false;
+}
+
+static IR *new_insn(IROp op, Reg *r0, Reg *r1, Token *tok) {
+  IR *ir = calloc(1, sizeof(IR));
+  ir->op = op;
+  ir->size = 8;
+  ir->r0 = r0;
+  ir->r1 = r1;
+  ir->tok = tok;
+  return ir;
+}
+
+// Split the entry block after its IR_PARAM instructions and return
+// the new block, which tail-recursive calls jump to. The registers
+// defined by IR_PARAM are stored to `params`.
+static BB *split_entry(Obj *fn, Reg **params, int nparams) {
+  BB *entry = fn->bbs;
+  IR *last = NULL;
+  for (IR *ir = entry->ir; ir && ir->op == IR_PARAM; ir = ir->next) {
+    if (ir->imm < nparams)
+      params[ir->imm] = ir->r0;
+    last = ir;
+  }
+
+  BB *body = new_bb();
+  body->ir = last ? last->next : entry->ir;
+  body->last = entry->last;
+  body->next = entry->next;
+  entry->next = body;
+
+  IR *jmp = new_insn(IR_JMP, NULL, NULL, entry->ir->tok);
+  jmp->bb1 = body;
+  if (last)
+    last->next = jmp;
+  else
+    entry->ir = jmp;
+  entry->last = jmp;
+  return body;
+}
+
+// Returns true if the instructions starting at `ir` return `r`
+// without doing anything else. Copies of `r` and jumps to other
+// blocks are followed, because inlining a function that ends with a
+// call leaves the call's result to be moved into a register that is
+// returned after a jump.
+static bool returns(IR *ir, Reg *r) {
+  for (int i = 0; i < 8 && ir; i++) {
+    if (ir->op == IR_RET)
+      return ir->r1 == r;
+    if (ir->op == IR_MOV && ir->r1 == r) {
+      r = ir->r0;
+      ir = ir->next;
+    } else if (ir->op == IR_JMP) {
+      ir = ir->bb1->ir;
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
+
+// Arguments passed on the stack would have to go where our caller
+// put ours, which may not have room for them, so such calls are only
+// turned into loops.
+static bool is_tail_call(Obj *fn, IR *ir) {
+  if (ir->op != IR_CALL || !returns(ir->next, ir->r0))
+    return false;
+  return ir->nargs <= MAX_REG_ARGS || !strcmp(ir->funcname, fn->name);
+}
+
+static void optimize_fn(Obj *fn) {
+  bool found = false;
+  bool recursive = false;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (is_tail_call(fn, ir)) {
+        found = true;
+        if (!strcmp(ir->funcname, fn->name))
+          recursive = true;
+      }
+    }
+  }
+  if (!found || addr_escapes(fn))
+    return;
+
+  int nparams = 0;
+  for (Obj *var = fn->params; var; var = var->next)
+    nparams++;
+  Reg **params = calloc(nparams, sizeof(Reg *));
+  BB *body = NULL;
+  if (recursive)
+    body = split_entry(fn, params, nparams);
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    IR head = {.next = bb->ir};
+    IR *prev = &head;
+    IR *call = bb->ir;
+    while (call && !is_tail_call(fn, call)) {
+      prev = call;
+      call = call->next;
+    }
+    if (!call)
+      continue;
+
+    // Drop the call and everything after it.
+    IR *last = prev;
+    last->next = NULL;
+
+    if (strcmp(call->funcname, fn->name)) {
+      call->op = IR_TAILCALL;
+      call->r0 = NULL;
+      call->next = NULL;
+      last = last->next = call;
+      opt_info(call->tok, "%s: tail call to %s", fn->name, call->funcname);
+    } else {
+      // The arguments are computed into fresh registers, none of
+      // which is a parameter, so the moves can be done in any order.
+      for (int i = 0; i < call->nargs && i < nparams; i++) {
+        if (!params[i])
+          continue;
+        last->next = new_insn(IR_MOV, params[i], call->args[i], call->tok);
+        last = last->next;
+      }
+
+      IR *jmp = new_insn(IR_JMP, NULL, NULL, call->tok);
+      jmp->bb1 = body;
+      last = last->next = jmp;
+      opt_info(call->tok, "%s: turned tail recursion into a loop", fn->name);
+    }
+
+    bb->ir = head.next;
+    bb->last = last;
+  }
+}
+
+void optimize_tail_calls(Obj *prog) {
+  // The exit hook of -finstrument-functions must run after the call.
+  if (opt_finstrument_functions)
+    return;
+
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      optimize_fn(fn);
+}
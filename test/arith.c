@@ -11,6 +11,8 @@ int main() {
   ASSERT(10, -10+20);
   ASSERT(10, - -10);
   ASSERT(10, - - +10);
+  ASSERT(136, 1+(2+(3+(4+(5+(6+(7+(8+(9+(10+(11+(12+(13+(14+(15+16)))))))))))))));
+  ASSERT(-8, 1-(2-(3-(4-(5-(6-(7-(8-(9-(10-(11-(12-(13-(14-(15-16)))))))))))))));
 
   ASSERT(0, 0==1);
   ASSERT(1, 42==42);
@@ -5,6 +5,11 @@ int main() {
     ASSERT(513, (short)8590066177);
     ASSERT(1, (char)8590066177);
     ASSERT(1, (long)1);
+    ASSERT(1, sizeof((char)8590066177));
+    ASSERT(-56, (char)(100+100));
+    ASSERT(1, (char)100+(char)100==200);
+    ASSERT(-1, (int)4294967295);
+    ASSERT(0, (int)2147483648+(int)2147483648);
     ASSERT(0, (long)&*(int *)0);
     ASSERT(513, ({ int x=512; *(char *)&x=1; x; }));
     ASSERT(5, ({ int x=5; long y=(long)&x; *(int*)y; }));
@@ -4,11 +4,39 @@
  * This is a block comment.
  */
 
+int limit;
+
+int set_limit(int n) {
+  limit = n;
+  return 0;
+}
+
+// Loop-invariant operands at several nesting levels
+int nested(int n, int m, int *a) {
+  int s=0, i, j, k;
+  for (i=0; i<n; i=i+1) {
+    s = s + a[i] * m;
+    for (j=0; j<n; j=j+1) {
+      s = s + n * m;
+      for (k=0; k<n; k=k+1)
+        s = s + a[j] + n * 4 + m * 8;
+    }
+  }
+  return s;
+}
+
 int main() {
   ASSERT(3, ({ int x; if (0) x=2; else x=3; x; }));
   ASSERT(3, ({ int x; if (1-1) x=2; else x=3; x; }));
   ASSERT(2, ({ int x; if (1) x=2; else x=3; x; }));
   ASSERT(2, ({ int x; if (2-1) x=2; else x=3; x; }));
+  ASSERT(4, ({ int x=1; if (0) { if (x) x=2; else x=3; } else x=4; x; }));
+  ASSERT(7, ({ int x=7; while (0) x=1; x; }));
+  ASSERT(3, ({ int i=3, x=0; if (i==3) x=3; x; }));
+  ASSERT(0, ({ int i=3, x=0; if (i!=3) x=3; x; }));
+  ASSERT(2, ({ int i=3, x=0; if (i>3) x=1; else x=2; x; }));
+  ASSERT(1, ({ int i=3, x=0; if (i>=3) x=1; else x=2; x; }));
+  ASSERT(1, ({ long i=-1, x=0; if (i<0) x=1; x; }));
 
   ASSERT(55, ({ int i=0; int j=0; for (i=0; i<=10; i=i+1) j=i+j; j; }));
 
@@ -20,6 +48,32 @@ int main() {
   ASSERT(10, ({ int i=0; while(i<10) i=i+1; i; }));
   ASSERT(55, ({ int i=0; int j=0; while(i<=10) {j=i+j; i=i+1;} j; }));
 
+  ASSERT(60, ({ int n=3, m=4, s=0, i; for (i=0; i<n*m; i=i+1) s=s+5; s; }));
+  ASSERT(3, ({ int n=5, c=0, i; int *p=&n; for (i=0; i<n; i=i+1) { c=c+1; *p=3; } c; }));
+  ASSERT(4, ({ int c=0, i; limit=8; for (i=0; i<limit; i=i+1) { c=c+1; set_limit(4); } c; }));
+  ASSERT(4, ({ int c=0, i; int *p=&limit; limit=8; for (i=0; i<limit; i=i+1) { c=c+1; *p=4; } c; }));
+  ASSERT(6, ({ int x[3], c=0, i; x[1]=6; for (i=0; i<x[1]; i=i+1) c=c+1; c; }));
+  ASSERT(2, ({ int x[3], c=0, i; x[1]=6; for (i=0; i<x[1]; i=i+1) { c=c+1; x[i]=0; } c; }));
+
+  ASSERT(45, ({ int a[10], s=0, i; for (i=0; i<10; i=i+1) a[i]=i; for (i=0; i<10; i=i+1) s=s+a[i]; s; }));
+  ASSERT(10, ({ int a[5], s=0, i, k; for (i=0; i<5; i=i+1) a[i]=2; for (k=0; k<=4; k=k+1) s=s+a[k]; s; }));
+  ASSERT(0, ({ int a[3], s=0, k; for (k=5; k<3; k=k+1) s=s+a[k]; s; }));
+  ASSERT(12, ({ int a[12], i; for (i=0; i<12; i=i+1) a[i]=0; i; }));
+  ASSERT(6, ({ int a[4], s=0, i; for (i=0; i<4; i=i+1) a[i]=i; for (i=3; 0<i; i=i-1) s=s+a[i]; s; }));
+  ASSERT(30, ({ int m[3][4], s=0, i, j; for (i=0; i<3; i=i+1) for (j=0; j<4; j=j+1) m[i][j]=i+j; for (i=0; i<3; i=i+1) for (j=0; j<4; j=j+1) s=s+m[i][j]; s; }));
+  ASSERT(6, ({ int a[3], *p=a, s=0, i; a[0]=1; a[1]=2; a[2]=3; for (i=0; i<3; i=i+1) s=s+p[i]; s; }));
+  ASSERT(4, ({ int a[8], s=0, i; for (i=0; i<8; i=i+1) a[i]=1; for (i=0; i<8; i=i+2) s=s+a[i]; s; }));
+
+  ASSERT(1275, ({ int a[51], s=0, i; for (i=0; i<51; i=i+1) a[i]=i; for (i=1; i<=50; i=i+1) s=s+a[i]; s; }));
+  ASSERT(-66, ({ char c[30], s=0, i; for (i=0; i<30; i=i+1) c[i]=i*9; for (i=0; i<30; i=i+1) c[i]=c[i]+c[i]; s=c[10]+c[29]; s; }));
+  ASSERT(296, ({ char c[37]; int s=0, i; for (i=0; i<37; i=i+1) c[i]=i-100; for (i=0; i<37; i=i+1) s=s+c[i]; s+3330; }));
+  ASSERT(72, ({ short a[19], b[19], i; for (i=0; i<19; i=i+1) a[i]=i+1; for (i=0; i<19; i=i+1) b[i]=a[i]*a[i]-a[i]; b[8]; }));
+  ASSERT(7, ({ int a[21], s=0, i; for (i=0; i<21; i=i+1) a[i]=i-3; for (i=0; i<21; i=i+1) s=s+(a[i]<4); s; }));
+  ASSERT(19, ({ short a[20]; int s=0, i; for (i=0; i<20; i=i+1) a[i]=i; for (i=0; i<20; i=i+1) s=s+(a[i]!=5); s; }));
+  ASSERT(9, ({ int a[20], *p=a, *q=a+1, i; for (i=0; i<20; i=i+1) a[i]=1; for (i=0; i<19; i=i+1) q[i]=p[i]+1; a[8]; }));
+  ASSERT(9, ({ int a[20], i; for (i=0; i<20; i=i+1) a[i]=1; for (i=1; i<20; i=i+1) a[i]=a[i]+7; a[5]+a[0]; }));
+  ASSERT(1581, ({ int a[3], i; for (i=0; i<3; i=i+1) a[i]=i; nested(3, 5, a); }));
+
   ASSERT(3,(1,2,3));
   ASSERT(5, ({ int i=2, j=3; (i=5,j)=6; i; }));
   ASSERT(6, ({ int i=2, j=3; (i=5,j)=6; j; }));
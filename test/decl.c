@@ -10,6 +10,10 @@ int main() {
 
   ASSERT(8, ({ long long x; sizeof(x); })); 
 
+  ASSERT(128, ({ int x[4*8]; sizeof(x); }));
+  ASSERT(24, ({ char x[sizeof(int)*2+(3-1)*8]; sizeof(x); }));
+  ASSERT(3, ({ long x[(char)259]; sizeof(x)/sizeof(x[0]); }));
+
   printf("OK\n");
   return 0;
 }
\ No newline at end of file
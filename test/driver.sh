@@ -22,4 +22,224 @@ check -o
 ./sodium --help 2>&1 | grep -q sodium
 check --help
 
+# -c
+echo 'int x; int main() { char *s = "ab"; x = 3; return x + s[1] - 98; }' > $tmp/obj.c
+./sodium -c -o $tmp/obj.o $tmp/obj.c
+[ "`head -c 4 $tmp/obj.o | tail -c 3`" = ELF ] && cc -o $tmp/obj $tmp/obj.o
+$tmp/obj
+[ $? = 3 ]
+check -c
+
+# statement expressions must end with an expression statement
+echo 'int main() { int x; x = 0; return ({ x = 1; if (x) x = 2; }); }' > $tmp/stmt_expr.c
+./sodium -o $tmp/out $tmp/stmt_expr.c 2>&1 | grep -q 'statement expression returning void' &&
+  echo 'int main() { return ({ return 5; }); }' > $tmp/stmt_expr.c &&
+  ./sodium -o $tmp/out $tmp/stmt_expr.c 2>&1 | grep -q 'statement expression returning void' &&
+  echo 'int main() { return ({ }); }' > $tmp/stmt_expr.c &&
+  ./sodium -o $tmp/out $tmp/stmt_expr.c 2>&1 | grep -q 'statement expression returning void'
+check 'statement expressions without a value'
+
+# array sizes
+echo 'int main() { int a[0-1]; return sizeof(a); }' > $tmp/arr.c
+./sodium -o $tmp/out $tmp/arr.c 2>&1 | grep -q 'invalid array size' &&
+  echo 'int main() { int a[4294967297]; return 0; }' > $tmp/arr.c &&
+  ./sodium -o $tmp/out $tmp/arr.c 2>&1 | grep -q 'invalid array size' &&
+  echo 'int main() { long a[1000000000]; return 0; }' > $tmp/arr.c &&
+  ./sodium -o $tmp/out $tmp/arr.c 2>&1 | grep -q 'array is too large'
+check 'array sizes'
+
+# -emit-ir
+echo 'int main() { return 3; }' > $tmp/ret.c
+./sodium -emit-ir -o $tmp/out $tmp/ret.c
+grep -q 'imm 3' $tmp/out && grep -q 'ret v' $tmp/out
+check -emit-ir
+
+# instruction selection
+echo 'int f(int *a, int i) { return a[i] + 1; }' > $tmp/isel.c
+./sodium -o $tmp/out $tmp/isel.c
+grep -q '(%r[0-9a-z]*,%r[0-9a-z]*,4)' $tmp/out && grep -q 'add \$1,' $tmp/out
+check 'instruction selection'
+
+# string literals
+echo 'char *f() { return "foo"; } char *g() { return "foo"; } char *h() { return "oo"; }' > $tmp/str.c
+./sodium -o $tmp/out $tmp/str.c
+[ "$(grep -c '\.ascii "foo' $tmp/out)" = 1 ] && grep -q 'rodata\.str1\.1' $tmp/out &&
+  grep -q '\.set .*+1' $tmp/out
+check 'string literal pool'
+
+# -g0
+echo 'int x; int main() {
+  x = 1; x = x + 2; x = x * 3;
+  return x; }' > $tmp/g.c
+./sodium -o $tmp/out $tmp/g.c
+[ -z "$(grep '\.loc' $tmp/out | uniq -d)" ] && grep -q '\.bss' $tmp/out
+check '.loc and .bss'
+./sodium -g0 -o $tmp/out $tmp/g.c
+! grep -q '\.loc\|\.file' $tmp/out
+check -g0
+
+# -fopt-info
+echo 'int main() { if (0) return 1; return 2; return 3; }' > $tmp/dce.c
+./sodium -fopt-info -o $tmp/out $tmp/dce.c 2>&1 | grep -q 'dce.c:1: optimized: main: folded 1'
+check -fopt-info
+! grep -q '\$1\|\$3' $tmp/out
+check 'dead code elimination'
+
+# compare and branch
+echo 'int f(int a, int b) { if (a < b) return 1; return 2; }' > $tmp/cbr.c
+./sodium -o $tmp/out $tmp/cbr.c
+grep -q 'jge' $tmp/out && ! grep -q 'setl' $tmp/out
+check 'compare and branch'
+
+# leaf functions
+echo 'int f(int *p, int i) { int x[2]; x[0] = p[i]; return x[0]; } int h(); int g() { return h() + 1; }' > $tmp/leaf.c
+./sodium -g0 -o $tmp/out $tmp/leaf.c
+sed -n '/^f:/,/^g:/p' $tmp/out | grep -q '(%rsp)' &&
+  ! sed -n '/^f:/,/^g:/p' $tmp/out | grep -q 'push' &&
+  sed -n '/^g:/,$p' $tmp/out | grep -q 'push %rbp'
+check 'leaf functions'
+echo 'int f(int *p, int i) { int x = p[i]; return x; }' > $tmp/leaf.c
+./sodium -g0 -o $tmp/out $tmp/leaf.c
+! grep -q 'push\|(%rsp)' $tmp/out
+check 'leaf functions with promoted locals'
+
+# stack slot sharing
+echo 'int main() { { long a[8]; a[0]=1; } { long b[8]; b[0]=2; } char c; long d; return 0; }' > $tmp/slot.c
+./sodium -fopt-info -o $tmp/out $tmp/slot.c 2>&1 | grep -q 'frame size 144 -> 64 bytes'
+check 'stack slot sharing'
+
+# inlining
+echo 'int sq(int x) { return x * x; } int main() { return sq(3) + 1; }' > $tmp/inl.c
+./sodium -fopt-info -o $tmp/out $tmp/inl.c 2> $tmp/log
+grep -q 'inlined sq into main' $tmp/log &&
+  ! grep -q 'call sq' $tmp/out
+check inlining
+./sodium -finline-limit=0 -o $tmp/out $tmp/inl.c
+grep -q 'call sq' $tmp/out
+check -finline-limit
+
+# tail calls
+echo 'int h(int x); int g(int x) { return h(x + 1); } int f(int n) { if (n) return f(n - 1); return 0; }' > $tmp/tail.c
+./sodium -fopt-info -o $tmp/out $tmp/tail.c 2> $tmp/log
+grep -q 'tail call to h' $tmp/log &&
+  grep -q 'jmp h' $tmp/out && ! grep -q 'call f' $tmp/out
+check 'tail calls'
+
+# argument passing
+echo 'int printf(char *fmt, ...); int h(int a, int b, int c, int d, int e, int f, int g); int x; int f() { h(x, 2, 3, 4, 5, 6, 7); return printf("%d", x); }' > $tmp/args.c
+./sodium -o $tmp/out $tmp/args.c
+grep -q 'push \$7' $tmp/out && grep -q 'add \$16, %rsp' $tmp/out &&
+  grep -q 'movslq x(%rip), %rdi' $tmp/out && grep -q 'mov \$2, %rsi' $tmp/out &&
+  [ $(grep -cE 'xor %eax|\$0, %rax' $tmp/out) = 1 ]
+check 'argument passing'
+
+# loop-invariant code motion
+echo 'int f(int n, int m) { int i; int s = 0; for (i = 0; i < n * m; i = i + 1) s = s + 1; return s; }' > $tmp/licm.c
+./sodium -fopt-info -o $tmp/out $tmp/licm.c 2>&1 | grep -q 'moved 1 loop-invariant'
+check 'loop-invariant code motion'
+
+# loop-invariant loads of globals and address-taken locals, which stay
+# in memory
+echo 'int n; int m; int f() { int i; int s = 0; for (i = 0; i < n * m; i = i + 1) s = s + 1; return s; }' > $tmp/licm.c
+./sodium -fopt-info -o $tmp/out $tmp/licm.c 2>&1 | grep -q 'moved 5 loop-invariant'
+check 'loop-invariant code motion of globals'
+echo 'int f(int n, int m, int **q) { int i; int s = 0; *q = &m; for (i = 0; i < n * m; i = i + 1) s = s + 1; return s; }' > $tmp/licm.c
+./sodium -fopt-info -o $tmp/out $tmp/licm.c 2>&1 | grep -q 'moved 2 loop-invariant'
+check 'loop-invariant code motion of address-taken locals'
+
+# loop-invariant code motion takes time roughly linear in the number of loops
+{
+  echo 'int f(int n, int *a) { int s = 0; int i;'
+  for i in $(seq 400); do echo "for (i = 0; i < n; i = i + 1) s = s + a[i] * $i;"; done
+  echo 'return s; }'
+} > $tmp/loops.c
+timeout 10 ./sodium -o $tmp/out $tmp/loops.c
+check 'loop-invariant code motion of many loops'
+
+# induction variables
+echo 'int a[10]; int f(int n) { int i; int s = 0; for (i = 0; i < n; i = i + 1) s = s + a[i]; return s; }' > $tmp/iv.c
+./sodium -fopt-info -o $tmp/out $tmp/iv.c 2> $tmp/log
+grep -q 'replaced 1 array indexes by i with pointer increments and rewrote the exit test' $tmp/log
+check 'induction variables'
+
+# vectorization
+echo 'void f(int *a, int *b, int n) { int i; for (i = 0; i < n; i = i + 1) a[i] = a[i] + b[i]; }' > $tmp/vec.c
+./sodium -fopt-info -o $tmp/out $tmp/vec.c 2> $tmp/log
+grep -q 'vectorized loop with 4 lanes and a runtime alias check' $tmp/log && grep -q paddd $tmp/out
+check 'vectorization'
+
+echo 'void f(int *a, int n) { int i; for (i = 0; i < n; i = i + 1) a[i] = a[i] / 3; }' > $tmp/vec.c
+./sodium -fopt-info -o $tmp/out $tmp/vec.c 2> $tmp/log
+grep -q 'loop not vectorized: SSE2 has no integer division' $tmp/log
+check 'vectorization remarks'
+
+# peephole optimizer
+echo 'int g(); int f(int x) { if (x == 0) return g(); return x; }' > $tmp/peep.c
+./sodium -fopt-info -o $tmp/out $tmp/peep.c 2> $tmp/log
+grep -q 'f: peephole rules fired: test-zero 1, zero-idiom 1' $tmp/log &&
+  grep -q 'xor %eax, %eax' $tmp/out && ! grep -q 'cmp \$0' $tmp/out
+check 'peephole optimizer'
+
+# value numbering
+echo 'struct A { int b; int c; }; int f(struct A **p) { return p[0]->b * p[0]->c; }' > $tmp/lvn.c
+./sodium -fopt-info -o $tmp/out $tmp/lvn.c 2> $tmp/log
+grep -q 'f: value numbering reused 3 values and 1 loads' $tmp/log
+check 'value numbering'
+echo 'struct A { int b; int c; }; struct A *g; int f() { return g->b * g->c + g->b; }' > $tmp/lvn.c
+./sodium -fopt-info -o $tmp/out $tmp/lvn.c 2> $tmp/log
+grep -q 'f: value numbering reused 4 values and 3 loads' $tmp/log
+check 'value numbering of globals'
+
+# promoting locals to registers
+echo 'int f(int n) { int i; int s = 0; for (i = 0; i < n; i = i + 1) s = s * 3 + i; return s; }' > $tmp/mem2reg.c
+./sodium -fopt-info -o $tmp/out $tmp/mem2reg.c 2> $tmp/log
+grep -q 'f: promoted 3 variables to registers' $tmp/log && ! grep -q 'movslq .*(%rsp)' $tmp/out
+check 'promoting locals to registers'
+echo 'void g(int *p); int f(int n) { int i; int s = 0; int t = 0; g(&t); for (i = 0; i < n; i = i + 1) s = s * 3 + t; return s; }' > $tmp/mem2reg.c
+./sodium -fopt-info -o $tmp/out $tmp/mem2reg.c 2> $tmp/log
+grep -q 'f: promoted 3 variables to registers' $tmp/log
+check 'promoting locals next to an escaping local'
+echo 'long f(long a) { a; return 3; } int g() { long x; x = 1; x; return (x, 2); }' > $tmp/mem2reg.c
+./sodium -o $tmp/out $tmp/mem2reg.c
+check 'promoting locals whose values are discarded'
+
+# redundant sign extensions
+echo 'long f(int *p, char c) { int x = p[0]; return (long)x + (long)(int)c; }' > $tmp/sext.c
+./sodium -fopt-info -o $tmp/out $tmp/sext.c 2> $tmp/log
+grep -q 'f: removed 3 sign extensions' $tmp/log && ! grep -q 'movslq %' $tmp/out
+check 'redundant sign extensions'
+
+# profile-guided optimization
+echo 'int f(int x) { if (x < 0) return -x; return x; }
+int main() { int i; int s = 0; for (i = 0; i < 10; i = i + 1) s = s + f(i); return s; }' > $tmp/pgo.c
+./sodium -c -fprofile-generate=$tmp/prof -o $tmp/pgo.o $tmp/pgo.c && cc -o $tmp/pgo $tmp/pgo.o
+$tmp/pgo; $tmp/pgo
+[ $? = 45 ] && grep -q '^f 3 10 0 10$' $tmp/prof && [ `grep -c '^main 2 1 10$' $tmp/prof` = 2 ] &&
+  ./sodium -fprofile-use=$tmp/prof -fopt-info -o $tmp/out $tmp/pgo.c 2> $tmp/log &&
+  grep -q 'f: moved 1 cold blocks out of line' $tmp/log && grep -q '.align 16' $tmp/out &&
+  sed -i 's/return x;/if (x > 5) x = x + 1; return x;/' $tmp/pgo.c &&
+  ! ./sodium -fprofile-use=$tmp/prof -o $tmp/out $tmp/pgo.c 2> $tmp/log &&
+  grep -q "profile of f doesn't match the source" $tmp/log
+check 'profile-guided optimization'
+
+# -pg
+echo 'int f(int x) { return x + 1; } int main() { return f(2); }' > $tmp/pg.c
+./sodium -pg -o $tmp/pg.s $tmp/pg.c && [ `grep -c 'call mcount' $tmp/pg.s` = 2 ] &&
+  cc -pg -o $tmp/pg $tmp/pg.s && (cd $tmp && ./pg; [ $? = 3 ] && [ -f gmon.out ])
+check -pg
+
+# -finstrument-functions
+echo 'int f(int a, int b, int c, int d, int e, int g, int h) { return a + b * 2 + c + d + e + g + h; }
+int fact(int n) { if (n <= 1) return 1; return n * fact(n - 1); }
+int main() { return f(1, 2, 3, 4, 5, 6, 7) + fact(4); }' > $tmp/cyg.c
+echo '#include <stdio.h>
+int f(); int fact(); int calls, depth, nf, nfact;
+void __cyg_profile_func_enter(void *fn, void *site) { calls++; depth++; nf += fn == f; nfact += fn == fact; }
+void __cyg_profile_func_exit(void *fn, void *site) { depth--; }
+__attribute__((destructor)) static void fin(void) { printf("%d %d %d %d\n", calls, depth, nf, nfact); }' > $tmp/hooks.c
+./sodium -c -finstrument-functions -o $tmp/cyg.o $tmp/cyg.c && cc -o $tmp/cyg $tmp/cyg.o $tmp/hooks.c
+$tmp/cyg > $tmp/log
+[ $? = 54 ] && [ "`cat $tmp/log`" = '6 0 1 4' ]
+check -finstrument-functions
+
 echo OK
\ No newline at end of file
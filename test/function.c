@@ -39,6 +39,92 @@ int sub_short(short a, short b, short c) {
   return a -b - c;
 }
 
+long sum_to(long n, long acc) {
+  if (n == 0)
+    return acc;
+  return sum_to(n - 1, acc + n);
+}
+
+int is_even(int n);
+
+int is_odd(int n) {
+  if (n == 0)
+    return 0;
+  return is_even(n - 1);
+}
+
+int is_even(int n) {
+  if (n == 0)
+    return 1;
+  return is_odd(n - 1);
+}
+
+int first_of(int *p, int n) {
+  int x = n;
+  if (n == 0)
+    return *p;
+  return first_of(&x, n - 1);
+}
+
+char ret_char(int x) {
+  return x;
+}
+
+int ret_int(long x) {
+  return x;
+}
+
+int narrow(int x) {
+  char c = x;
+  short s = x;
+  int i;
+  int n = 0;
+  for (i = 0; i < 3; i = i + 1) {
+    c = c + 100;
+    s = s + c;
+    n = n + s;
+  }
+  return n;
+}
+
+// Reads of promoted locals whose values are discarded
+long discard(long a) {
+  long x;
+  x = a + 1;
+  a;
+  x;
+  return (a, x);
+}
+
+void set_int(int *p, int val) {
+  *p = val;
+}
+
+// Locals that are promoted next to one whose address escapes
+int partly_escaped(int n) {
+  int i, s = 0, t = 0;
+  set_int(&t, 5);
+  for (i = 0; i < n; i = i + 1) {
+    s = s + t;
+    set_int(&t, t + 1);
+  }
+  return s + t;
+}
+
+long add10_weighted(long a, long b, long c, long d, long e, long f, long g, long h, long i, long j);
+
+int sub8(int a, int b, int c, int d, int e, int f, int g, int h) {
+  return a - b - c - d - e - f - g - h;
+}
+
+int count7(int n, int a, int b, int c, int d, int e, int f) {
+  if (n == 0)
+    return a - b + c - d + e - f;
+  return count7(n - 1, a, b, c, d, e, f + 1);
+}
+
+char g_char;
+
 int main() {
   ASSERT(3, ret3());
   ASSERT(8, add2(3, 5));
@@ -50,12 +136,34 @@ int main() {
   ASSERT(7, add2(3,4));
   ASSERT(1, sub2(4,3));
   ASSERT(55, fib(9));
+  ASSERT(85, add2(1,2)+(add2(3,4)+(add2(5,6)+(add2(7,8)+(add2(9,10)+(add2(11,12)+(add2(2,1)+add2(2,2))))))));
 
   ASSERT(1, ({ sub_char(7, 3, 3); }));
   
   ASSERT(1, sub_long(7, 3, 3));
   ASSERT(1, sub_short(7, 3, 3));
 
+  ASSERT(500000500000, sum_to(1000000, 0));
+  ASSERT(1, is_even(1000000));
+  ASSERT(0, is_odd(1000000));
+  ASSERT(1, first_of(0, 3));
+  ASSERT(628, narrow(300));
+  ASSERT(-98081, narrow(32767));
+  ASSERT(44, ret_char(300));
+  ASSERT(-56, ret_char(200) + 0);
+  ASSERT(1, sizeof(ret_char(0)));
+  ASSERT(4, sizeof(ret3()));
+  ASSERT(1, ({ long x = (long)ret_int(4294967295); x < 0; }));
+  ASSERT(-34, sub8(1, 2, 3, 4, 5, 6, 7, 8));
+  ASSERT(9, ({ int x = 3; sub8(50, 1, 2, 3, 4, 5, x, 23); }));
+  ASSERT(-21, ({ g_char = -5; sub8(1, 2, 3, 4, 5, 6, add2(3, 4), g_char); }));
+  ASSERT(-13, count7(10, 1, 2, 3, 4, 5, 6));
+  ASSERT(385, add10_weighted(1, 2, 3, 4, 5, 6, 7, 8, 9, 10));
+  ASSERT(-10, add10_weighted(0, 0, 0, 0, 0, 0, 0, 0, 0, -1));
+  ASSERT(1, ({ long x[2]; x[1] = 3; add10_weighted(0, 0, 0, 0, 0, 0, 0, 0, 0, x[1]) == 30; }));
+  ASSERT(4, discard(3));
+  ASSERT(26, partly_escaped(3));
+
   printf("OK\n");
   return 0;
 }
\ No newline at end of file
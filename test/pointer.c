@@ -3,12 +3,12 @@
 int main() {
   ASSERT(3, ({ int x=3; *&x; }));
   ASSERT(3, ({ int x=3; int *y=&x; int **z=&y; **z; }));
-  ASSERT(5, ({ int x=3; int y=5; *(&x+1); }));
-  ASSERT(3, ({ int x=3; int y=5; *(&y-1); }));
-  ASSERT(5, ({ int x=3; int y=5; *(&x-(-1)); }));
+  ASSERT(5, ({ int x=3; int y=5; int *p=&y; *(&x+1); }));
+  ASSERT(3, ({ int x=3; int y=5; int *p=&x; *(&y-1); }));
+  ASSERT(5, ({ int x=3; int y=5; int *p=&y; *(&x-(-1)); }));
   ASSERT(5, ({ int x=3; int *y=&x; *y=5; x; }));
-  ASSERT(7, ({ int x=3; int y=5; *(&x+1)=7; y; }));
-  ASSERT(7, ({ int x=3; int y=5; *(&y-2+1)=7; x; }));
+  ASSERT(7, ({ int x=3; int y=5; int *p=&y; *(&x+1)=7; y; }));
+  ASSERT(7, ({ int x=3; int y=5; int *p=&x; *(&y-2+1)=7; x; }));
   ASSERT(5, ({ int x=3; (&x+2)-&x+3; }));
   ASSERT(8, ({ int x, y; x=3; y=5; x+y; }));
   ASSERT(8, ({ int x=3, y=5; x+y; }));
@@ -39,6 +39,10 @@ int main() {
   ASSERT(4, ({ int x[2][3]; int *y=x; y[4]=4; x[1][1]; }));
   ASSERT(5, ({ int x[2][3]; int *y=x; y[5]=5; x[1][2]; }));
 
+  ASSERT(8, ({ int x=3; int *p=&x; int y=x; *p=5; y+x; }));
+  ASSERT(9, ({ int x[2]; int *p=x; x[0]=2; p[0]=7; x[0]+x[0]-p[0]+2; }));
+  ASSERT(10, ({ int x=3; int y=x*x; x=4; y=x*x-y+8; y-5; }));
+
   printf("OK\n");
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,255 @@
+#include "test.h"
+
+// Multiplications and divisions by constants are strength-reduced
+// (see strength.c). Check them against imul and idiv by the same
+// values loaded from memory, over small dividends, extreme ones and a
+// pseudo-random sample of the whole range.
+
+int v32[60000];
+long v64[60000];
+int n;
+int d32;
+long d64;
+int fails;
+
+int report(long x, long d, long got, long want) {
+  printf("%ld, %ld => %ld expected but got %ld\n", x, d, want, got);
+  fails = fails + 1;
+  return 0;
+}
+
+#define CHECK32(d) \
+  d32 = d; \
+  for (i = 0; i < n; i = i + 1) { \
+    x = v32[i]; \
+    if (x * (int)(d) != x * d32) report(x, d, x * (int)(d), x * d32); \
+    if (x / (int)(d) != x / d32) report(x, d, x / (int)(d), x / d32); \
+  }
+
+#define CHECK64(d) \
+  d64 = d; \
+  for (i = 0; i < n; i = i + 1) { \
+    y = v64[i]; \
+    if (y * (d) != y * d64) report(y, d, y * (d), y * d64); \
+    if (y / (d) != y / d64) report(y, d, y / (d), y / d64); \
+  }
+
+int main() {
+  int i;
+  int x;
+  long y;
+
+  n = 0;
+  for (i = -20000; i <= 20000; i = i + 1) {
+    v32[n] = i;
+    v64[n] = i;
+    n = n + 1;
+  }
+  for (i = 0; i < 19990; i = i + 1) {
+    v32[n] = i * 214013 + 2531011;
+    v64[n] = i * 6364136223846793005 + 1442695040888963407;
+    n = n + 1;
+  }
+  v32[n] = 2147483647;
+  v64[n] = 9223372036854775807;
+  n = n + 1;
+  v32[n] = 2147483646;
+  v64[n] = 9223372036854775806;
+  n = n + 1;
+  v32[n] = -2147483647;
+  v64[n] = -9223372036854775807;
+  n = n + 1;
+  v32[n] = -2147483647 - 1;
+  v64[n] = -9223372036854775807 - 1;
+  n = n + 1;
+  CHECK32(2)
+  CHECK32(3)
+  CHECK32(4)
+  CHECK32(5)
+  CHECK32(6)
+  CHECK32(7)
+  CHECK32(8)
+  CHECK32(9)
+  CHECK32(10)
+  CHECK32(11)
+  CHECK32(12)
+  CHECK32(13)
+  CHECK32(14)
+  CHECK32(15)
+  CHECK32(16)
+  CHECK32(17)
+  CHECK32(18)
+  CHECK32(19)
+  CHECK32(20)
+  CHECK32(21)
+  CHECK32(22)
+  CHECK32(23)
+  CHECK32(24)
+  CHECK32(25)
+  CHECK32(26)
+  CHECK32(27)
+  CHECK32(28)
+  CHECK32(29)
+  CHECK32(30)
+  CHECK32(31)
+  CHECK32(32)
+  CHECK32(33)
+  CHECK32(34)
+  CHECK32(35)
+  CHECK32(36)
+  CHECK32(37)
+  CHECK32(38)
+  CHECK32(39)
+  CHECK32(40)
+  CHECK32(64)
+  CHECK32(65)
+  CHECK32(66)
+  CHECK32(100)
+  CHECK32(127)
+  CHECK32(128)
+  CHECK32(255)
+  CHECK32(256)
+  CHECK32(641)
+  CHECK32(1000)
+  CHECK32(1024)
+  CHECK32(4096)
+  CHECK32(65535)
+  CHECK32(65536)
+  CHECK32(65537)
+  CHECK32(1000000)
+  CHECK32(16777216)
+  CHECK32(1000000007)
+  CHECK32(1073741824)
+  CHECK32(2147483647)
+  CHECK32(-2)
+  CHECK32(-3)
+  CHECK32(-4)
+  CHECK32(-5)
+  CHECK32(-6)
+  CHECK32(-7)
+  CHECK32(-8)
+  CHECK32(-9)
+  CHECK32(-10)
+  CHECK32(-11)
+  CHECK32(-12)
+  CHECK32(-13)
+  CHECK32(-14)
+  CHECK32(-15)
+  CHECK32(-16)
+  CHECK32(-17)
+  CHECK32(-18)
+  CHECK32(-19)
+  CHECK32(-20)
+  CHECK32(-64)
+  CHECK32(-128)
+  CHECK32(-641)
+  CHECK32(-1000)
+  CHECK32(-65536)
+  CHECK32(-1073741824)
+  CHECK32(-2147483647)
+
+  CHECK64(2)
+  CHECK64(3)
+  CHECK64(4)
+  CHECK64(5)
+  CHECK64(6)
+  CHECK64(7)
+  CHECK64(8)
+  CHECK64(9)
+  CHECK64(10)
+  CHECK64(11)
+  CHECK64(12)
+  CHECK64(13)
+  CHECK64(14)
+  CHECK64(15)
+  CHECK64(16)
+  CHECK64(17)
+  CHECK64(18)
+  CHECK64(19)
+  CHECK64(20)
+  CHECK64(21)
+  CHECK64(22)
+  CHECK64(23)
+  CHECK64(24)
+  CHECK64(25)
+  CHECK64(26)
+  CHECK64(27)
+  CHECK64(28)
+  CHECK64(29)
+  CHECK64(30)
+  CHECK64(31)
+  CHECK64(32)
+  CHECK64(33)
+  CHECK64(34)
+  CHECK64(35)
+  CHECK64(36)
+  CHECK64(37)
+  CHECK64(38)
+  CHECK64(39)
+  CHECK64(40)
+  CHECK64(64)
+  CHECK64(65)
+  CHECK64(66)
+  CHECK64(100)
+  CHECK64(127)
+  CHECK64(128)
+  CHECK64(255)
+  CHECK64(256)
+  CHECK64(641)
+  CHECK64(1000)
+  CHECK64(1024)
+  CHECK64(4096)
+  CHECK64(65535)
+  CHECK64(65536)
+  CHECK64(65537)
+  CHECK64(1000000)
+  CHECK64(16777216)
+  CHECK64(1000000007)
+  CHECK64(1073741824)
+  CHECK64(2147483647)
+  CHECK64(4294967295)
+  CHECK64(4294967296)
+  CHECK64(4294967311)
+  CHECK64(1000000000039)
+  CHECK64(4611686018427387904)
+  CHECK64(6148914691236517205)
+  CHECK64(3074457345618258603)
+  CHECK64(9223372036854775807)
+  CHECK64(-2)
+  CHECK64(-3)
+  CHECK64(-4)
+  CHECK64(-5)
+  CHECK64(-6)
+  CHECK64(-7)
+  CHECK64(-8)
+  CHECK64(-9)
+  CHECK64(-10)
+  CHECK64(-11)
+  CHECK64(-12)
+  CHECK64(-13)
+  CHECK64(-14)
+  CHECK64(-15)
+  CHECK64(-16)
+  CHECK64(-17)
+  CHECK64(-18)
+  CHECK64(-19)
+  CHECK64(-20)
+  CHECK64(-64)
+  CHECK64(-128)
+  CHECK64(-641)
+  CHECK64(-1000)
+  CHECK64(-65536)
+  CHECK64(-1073741824)
+  CHECK64(-2147483647)
+  CHECK64(-4294967296)
+  CHECK64(-4294967311)
+  CHECK64(-1000000000039)
+  CHECK64(-4611686018427387904)
+  CHECK64(-6148914691236517205)
+  CHECK64(-9223372036854775807)
+
+  ASSERT(0, fails);
+
+  printf("OK\n");
+  return 0;
+}
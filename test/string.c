@@ -35,6 +35,13 @@ int main() {
   ASSERT(0, "\x00"[0]);
   ASSERT(119, "\x77"[0]);
 
+  ASSERT(1, ({ char *p="abc"; char *q="abc"; p==q; }));
+  ASSERT(1, ({ char *p="xyz"; char *q="yz"; p+1==q; }));
+  ASSERT(99, ({ char *p="xbc"; char *q="c"; q[0]; }));
+  ASSERT(0, ({ char *p="xbc"; char *q=""; q[0]; }));
+  ASSERT(98, ({ char *p="a\0bc"; p[2]; }));
+  ASSERT(99, ({ char *p="a\0bc"; char *q="bc"; q[1]; }));
+
   printf("OK\n");
   return 0;
 }
\ No newline at end of file
@@ -40,11 +40,19 @@ int main() {
   ASSERT(7, ({ struct t {int a,b;}; struct t x; x.a=7; struct t y; struct t *z=&y; *z=x; y.a; }));
   ASSERT(7, ({ struct t {int a,b;}; struct t x; x.a=7; struct t y, *p=&x, *q=&y; *q=*p; y.a; }));
   ASSERT(5, ({ struct t {char a, b;} x, y; x.a=5; y=x; y.a; }));
+  ASSERT(7, ({ struct {char a[7];} x, y; x.a[6]=7; y=x; y.a[6]; }));
+  ASSERT(29, ({ struct {char a[31];} x, y; x.a[0]=1; x.a[30]=28; y=x; y.a[0]+y.a[30]; }));
+  ASSERT(47, ({ struct {char a[47];} x, y; x.a[16]=3; x.a[46]=44; y=x; y.a[16]+y.a[46]; }));
+  ASSERT(99, ({ struct {char a[2051];} x, y; x.a[0]=1; x.a[2050]=98; y=x; y.a[0]+y.a[2050]; }));
 
   ASSERT(3, ({ struct {int a,b;} x,y; x.a=3; y=x; y.a; }));
   ASSERT(7, ({ struct t {int a,b;}; struct t x; x.a=7; struct t y; struct t *z=&y; *z=x; y.a; }));
   ASSERT(7, ({ struct t {int a,b;}; struct t x; x.a=7; struct t y, *p=&x, *q=&y; *q=*p; y.a; }));
   ASSERT(5, ({ struct t {char a, b;} x, y; x.a=5; y=x; y.a; }));
+  ASSERT(7, ({ struct {char a[7];} x, y; x.a[6]=7; y=x; y.a[6]; }));
+  ASSERT(29, ({ struct {char a[31];} x, y; x.a[0]=1; x.a[30]=28; y=x; y.a[0]+y.a[30]; }));
+  ASSERT(47, ({ struct {char a[47];} x, y; x.a[16]=3; x.a[46]=44; y=x; y.a[16]+y.a[46]; }));
+  ASSERT(99, ({ struct {char a[2051];} x, y; x.a[0]=1; x.a[2050]=98; y=x; y.a[0]+y.a[2050]; }));
 
   ASSERT(8, ({ struct t {int a; int b;} x; struct t y; sizeof(y); }));
   ASSERT(8, ({ struct t {int a; int b;}; struct t y; sizeof(y); }));
@@ -52,6 +60,9 @@ int main() {
   ASSERT(16, ({ struct {char a; long b;} x; sizeof(x); }));
   ASSERT(4, ({ struct {char a; short b;} x; sizeof(x); }));
 
+  ASSERT(7, ({ struct {int b; int c;} s; struct {struct {int b; int c;} *a;} t; struct {struct {int b; int c;} *a;} *p=&t; t.a=&s; s.b=3; s.c=4; p->a->b+p->a->c; }));
+  ASSERT(10, ({ struct {int b; int c;} s; struct {int b; int c;} *p=&s; s.b=3; p->b=6; s.c=p->b-2; s.b+s.c; }));
+
   printf("OK\n");
   return 0;
 }
\ No newline at end of file
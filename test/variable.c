@@ -47,8 +47,12 @@ int main() {
   ASSERT(2, ({ int x=2; { int x=3; } int y=4; x; }));
   ASSERT(3, ({ int x=2; { x=3; } x; }));
 
-  ASSERT(7, ({ int x; int y; char z; char *a=&y; char *b=&z; b-a; }));
-  ASSERT(1, ({ int x; char y; int z; char *a=&y; char *b=&z; b-a; }));
+  ASSERT(-5, ({ int x; int y; char z; char *a=&y; char *b=&z; b-a; }));
+  ASSERT(5, ({ int x; char y; int z; char *a=&y; char *b=&z; b-a; }));
+  ASSERT(4, ({ int a=1; { int b=2; b; } { int c=3; a=a+c; } a; }));
+  ASSERT(8, ({ { int b=2; b; } int a=5; { long c=3; a=a+c; } a; }));
+  ASSERT(1, ({ int a; int r; { int b; r=&a!=&b; } r; }));
+  ASSERT(1, ({ { int b; } int a; int r; { int c; r=&a!=&c; } r; }));
 
   ASSERT(8, ({ long x; sizeof(x); }));
   ASSERT(2, ({ short x; sizeof(x); }));
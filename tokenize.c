@@ -60,6 +60,21 @@ void error_tok(Token *tok, char *fmt, ...) {
   verror_at(tok->line_no, tok->loc, fmt, ap);
 }
 
+// Reports an optimization with -fopt-info in the following format.
+//
+// foo.c:10: optimized: <message here>
+void opt_info(Token *tok, char *fmt, ...) {
+  if (!opt_fopt_info)
+    return;
+
+  fprintf(stderr, "%s:%d: optimized: ", current_filename, tok->line_no);
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+}
+
 // Consumes the current token if it matches `op`.
 bool equal(Token *tok, char *op) {
   return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
@@ -114,7 +129,7 @@ static int from_hex(char c) {
 
 // Read a punctuator token from p and returns its length.
 static int read_punct(char *p) {
-  static char *kw[] = {"==", "!=", "<=", ">=", "->"};
+  static char *kw[] = {"...", "==", "!=", "<=", ">=", "->"};
 
   for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
     if (startswith(p, kw[i]))
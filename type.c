@@ -83,9 +83,12 @@ void add_type(Node *node) {
   case ND_LT:
   case ND_LE:
   case ND_NUM:
-  case ND_FUNCALL:
     node->ty = ty_long;
     return;
+  case ND_FUNCALL:
+    // A function that is not declared is assumed to return long.
+    node->ty = node->func_ty ? node->func_ty->return_ty : ty_long;
+    return;
   case ND_VAR:
     node->ty = node->var->ty;
     return;
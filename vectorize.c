@@ -0,0 +1,326 @@
+// This file decides whether a `for` loop can be vectorized with SSE2.
+//
+// SSE2 is part of every x86-64 processor, so its 16-byte %xmm
+// registers and integer instructions are always available. With them,
+// a loop like
+//
+//   for (i = 0; i < n; i = i + 1)
+//     c[i] = a[i] + b[i];
+//
+// can process 4 ints, 8 shorts or 16 chars per iteration. We handle
+// loops counting up by 1 to a loop-invariant bound whose body is a
+// sequence of statements of the forms
+//
+//   x[i] = <expr>;
+//   sum = sum + <expr>;
+//
+// where <expr> is built from array elements indexed by `i`,
+// loop-invariant integers, `+`, `-`, `*` and comparisons. ir.c emits
+// a vector loop that runs while a full vector of iterations is left,
+// followed by the original loop for the remaining ones.
+//
+// The scalar code computes in 32 or 64 bits and truncates the result
+// when storing it, so computing in lanes as wide as the stored
+// elements gives the same result for `+`, `-` and `*`, which never
+// look at higher bits. A sum must be an int, and its terms are
+// computed in 4-byte lanes with narrower elements sign-extended.
+// Comparisons do look at every bit, so their operands must be
+// elements or constants that fit in a lane.
+//
+// If an array that is written may overlap another array accessed in
+// the loop, ir.c checks their address ranges at run time and skips
+// the vector loop if they do.
+//
+// With -fopt-info we report every vectorized loop, and why a loop
+// was not vectorized.
+
+#include "sodium.h"
+
+static Node *fn_body;
+static Node *loop;
+static Obj *counter;
+static LoopVec *vec;
+
+// Why the current loop can't be vectorized
+static char *reason;
+
+static bool fail(char *msg) {
+  reason = msg;
+  return false;
+}
+
+static int fail_expr(char *msg) {
+  reason = msg;
+  return -1;
+}
+
+static bool is_element_type(Type *ty) {
+  return ty->kind == TY_CHAR || ty->kind == TY_SHORT || ty->kind == TY_INT;
+}
+
+// Returns true if `node` is `x[i]`, which is `*(x + i * size)`.
+static bool is_element(Node *node) {
+  if (node->kind != ND_DEREF || node->lhs->kind != ND_ADD)
+    return false;
+
+  Node *mul = node->lhs->rhs;
+  return node->lhs->lhs->ty->base && mul->kind == ND_MUL &&
+         mul->lhs->kind == ND_VAR && mul->lhs->var == counter &&
+         mul->rhs->kind == ND_NUM && mul->rhs->val == node->ty->size;
+}
+
+// Returns true if `node` is `sum = sum + expr` for a local int `sum`
+// whose address is never taken, so that only this statement changes
+// it while the loop runs.
+static bool is_sum(Node *node) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+  return lhs->kind == ND_VAR && lhs->var->is_local && lhs->ty->kind == TY_INT &&
+         rhs->kind == ND_ADD && rhs->lhs->kind == ND_VAR &&
+         rhs->lhs->var == lhs->var && !is_addr_taken(fn_body, lhs->var);
+}
+
+static bool same_base(Node *x, Node *y) {
+  return x == y || (x->kind == ND_VAR && y->kind == ND_VAR && x->var == y->var);
+}
+
+VecArray *find_array(LoopVec *vec, Node *node) {
+  for (VecArray *a = vec->arrays; a; a = a->next)
+    if (same_base(a->base, node->lhs->lhs) && a->size == node->ty->size)
+      return a;
+  return NULL;
+}
+
+VecSplat *find_splat(LoopVec *vec, Node *node) {
+  for (VecSplat *s = vec->splats; s; s = s->next)
+    if (s->node == node)
+      return s;
+  return NULL;
+}
+
+static bool add_array(Node *node, bool is_stored) {
+  if (!is_element_type(node->ty))
+    return fail(format("%d-byte elements are not supported", node->ty->size));
+  if (node->ty->size > vec->lane)
+    return fail(format("%d-byte elements don't fit in %d-byte lanes",
+                       node->ty->size, vec->lane));
+  if (!is_loop_invariant(fn_body, loop, node->lhs->lhs))
+    return fail("an array address may change in the loop");
+
+  VecArray *a = find_array(vec, node);
+  if (!a) {
+    a = calloc(1, sizeof(VecArray));
+    a->base = node->lhs->lhs;
+    a->size = node->ty->size;
+    a->next = vec->arrays;
+    vec->arrays = a;
+  }
+  a->is_stored |= is_stored;
+  return true;
+}
+
+// Returns true if a loop-invariant value is known to fit in a lane.
+static bool fits_lane(Node *node) {
+  if (node->kind == ND_NUM) {
+    int64_t max = (1L << (vec->lane * 8 - 1)) - 1;
+    return -max - 1 <= node->val && node->val <= max;
+  }
+  return node->kind == ND_VAR && node->ty->size <= vec->lane;
+}
+
+// Check that the value of `node` can be computed in lanes. If `exact`
+// is true, it must be computed exactly rather than truncated to a
+// lane. Returns the number of vector registers ir.c uses to compute
+// it, or -1 if it can't be vectorized.
+static int check_expr(Node *node, bool exact) {
+  if (is_element(node))
+    return add_array(node, false) ? 1 : -1;
+
+  if (is_integer(node->ty) && is_loop_invariant(fn_body, loop, node)) {
+    if (exact && !fits_lane(node))
+      return fail_expr("a comparison operand may not fit in a lane");
+    if (!find_splat(vec, node)) {
+      VecSplat *s = calloc(1, sizeof(VecSplat));
+      s->node = node;
+      s->next = vec->splats;
+      vec->splats = s;
+    }
+    return 0;
+  }
+
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL: {
+    if (!is_integer(node->ty))
+      return fail_expr("pointer arithmetic in the loop");
+    if (exact)
+      return fail_expr("a comparison operand is computed in the loop");
+    if (node->kind == ND_MUL && vec->lane != 2)
+      return fail_expr(format("SSE2 has no %d-bit multiplication", vec->lane * 8));
+    int x = check_expr(node->lhs, false);
+    int y = check_expr(node->rhs, false);
+    return (x < 0 || y < 0) ? -1 : x + y + 1;
+  }
+  case ND_NEG: {
+    if (exact)
+      return fail_expr("a comparison operand is computed in the loop");
+    int x = check_expr(node->lhs, false);
+    return (x < 0) ? -1 : x + 2;
+  }
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    // The mask, a zero and the result, plus the inverted mask
+    // for != and <=
+    int x = check_expr(node->lhs, true);
+    int y = check_expr(node->rhs, true);
+    if (x < 0 || y < 0)
+      return -1;
+    return x + y + ((node->kind == ND_NE || node->kind == ND_LE) ? 4 : 3);
+  }
+  case ND_CAST:
+    if (!is_integer(node->ty) || node->ty->size < vec->lane)
+      return fail_expr("a cast narrower than a lane");
+    return check_expr(node->lhs, exact);
+  case ND_DIV:
+    return fail_expr("SSE2 has no integer division");
+  case ND_FUNCALL:
+    return fail_expr("a function is called in the loop");
+  case ND_VAR:
+    if (node->var == counter)
+      return fail_expr("the loop counter is used other than as an array index");
+    return fail_expr(format("%s may change in the loop", node->var->name));
+  case ND_DEREF:
+  case ND_MEMBER:
+    return fail_expr("memory is accessed other than by the loop counter");
+  }
+  return fail_expr("an unsupported expression in the loop");
+}
+
+static bool analyze(int64_t step) {
+  if (!counter || step != 1)
+    return fail("there is no loop counter incremented by 1");
+
+  Node *cond = loop->cond;
+  if (!cond || (cond->kind != ND_LT && cond->kind != ND_LE) ||
+      cond->lhs->kind != ND_VAR || cond->lhs->var != counter)
+    return fail("the exit test is not i < n or i <= n");
+
+  // The bound is sign-extended to 64 bits by loading it.
+  Node *bound = cond->rhs;
+  if (bound->kind == ND_NUM) {
+    if (counter->ty->size == 4 && bound->val != (int32_t)bound->val)
+      return fail("the loop bound doesn't fit in the loop counter");
+  } else if (bound->kind != ND_VAR || !is_integer(bound->ty) ||
+             bound->ty->size > counter->ty->size ||
+             !is_loop_invariant(fn_body, loop, bound)) {
+    return fail("the loop bound is not a loop-invariant variable or constant");
+  }
+
+  vec->counter = cond->lhs;
+  vec->bound = bound;
+  vec->inclusive = (cond->kind == ND_LE);
+
+  // Collect the statements.
+  Node *body = loop->then;
+  if (body->kind == ND_BLOCK) {
+    for (Node *n = body->body; n; n = n->next)
+      vec->nstmts++;
+    vec->stmts = calloc(vec->nstmts, sizeof(Node *));
+    vec->nstmts = 0;
+    for (Node *n = body->body; n; n = n->next)
+      vec->stmts[vec->nstmts++] = n;
+  } else {
+    vec->stmts = calloc(1, sizeof(Node *));
+    vec->stmts[vec->nstmts++] = body;
+  }
+  if (!vec->nstmts)
+    return fail("the loop body is empty");
+
+  // Stores determine the lane width.
+  for (int i = 0; i < vec->nstmts; i++) {
+    Node *stmt = vec->stmts[i];
+    if (stmt->kind != ND_EXPR_STMT || stmt->lhs->kind != ND_ASSIGN)
+      return fail("the loop body is not a sequence of assignments");
+
+    int lane;
+    if (is_sum(stmt->lhs)) {
+      lane = 4;
+      vec->nsums++;
+    } else if (is_element(stmt->lhs->lhs)) {
+      lane = stmt->lhs->lhs->ty->size;
+    } else {
+      return fail("something other than an array element or an int sum is assigned");
+    }
+
+    if (vec->lane && vec->lane != lane)
+      return fail("the statements need lanes of different widths");
+    vec->lane = lane;
+  }
+
+  int ntemps = 0;
+  for (int i = 0; i < vec->nstmts; i++) {
+    Node *assign = vec->stmts[i]->lhs;
+    Node *expr = assign->rhs;
+    if (is_sum(assign)) {
+      expr = expr->rhs;
+    } else if (!add_array(assign->lhs, true)) {
+      return false;
+    }
+
+    int n = check_expr(expr, false);
+    if (n < 0)
+      return false;
+    if (ntemps < n)
+      ntemps = n;
+  }
+
+  if (!vec->arrays)
+    return fail("no array elements are accessed");
+
+  // Sums and invariants take up a register for the whole loop.
+  int xmm = 1 + vec->nsums;
+  for (VecSplat *s = vec->splats; s; s = s->next)
+    s->xmm = xmm++;
+  if (xmm - 1 + ntemps > NUM_XMM)
+    return fail("too many vector registers are needed");
+
+  // Distinct array variables can't overlap, anything else may.
+  for (VecArray *x = vec->arrays; x; x = x->next) {
+    for (VecArray *y = x->next; y; y = y->next) {
+      if (!x->is_stored && !y->is_stored)
+        continue;
+      if (x->base->kind == ND_VAR && x->base->ty->kind == TY_ARRAY &&
+          y->base->kind == ND_VAR && y->base->ty->kind == TY_ARRAY)
+        continue;
+
+      VecCheck *c = calloc(1, sizeof(VecCheck));
+      c->x = x;
+      c->y = y;
+      c->next = vec->checks;
+      vec->checks = c;
+    }
+  }
+  return true;
+}
+
+// Analyze a `for` loop in a function with a given body. Returns NULL
+// if it can't be vectorized.
+LoopVec *vectorize(Node *body, Node *node) {
+  int64_t step = 0;
+  counter = loop_counter(body, node, &step);
+  fn_body = body;
+  loop = node;
+  vec = calloc(1, sizeof(LoopVec));
+
+  if (!analyze(step)) {
+    opt_info(node->tok, "loop not vectorized: %s", reason);
+    return NULL;
+  }
+
+  opt_info(node->tok, "vectorized loop with %d lanes%s", 16 / vec->lane,
+           vec->checks ? " and a runtime alias check" : "");
+  return vec;
+}